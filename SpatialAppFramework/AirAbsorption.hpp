@@ -0,0 +1,188 @@
+//
+//  AirAbsorption.hpp
+//  Capstone
+//
+
+#ifndef AirAbsorption_hpp
+#define AirAbsorption_hpp
+
+#include "BiquadBank.hpp"
+#include <cmath>
+#include <algorithm>
+#include <cstring>
+
+// air the absorption is computed for
+#define AIR_TEMPERATURE 20.0f
+#define AIR_HUMIDITY 50.0f
+// distance table, denser near the listener: entry i is AIR_MAX_DISTANCE * (i/(AIR_TABLE_SIZE-1))^2
+#define AIR_TABLE_SIZE 64
+#define AIR_MAX_DISTANCE 1000.0f
+// losses beyond this are inaudible and not fitted
+#define AIR_MAX_LOSS_DB 60.0f
+#define AIR_FIT_FREQUENCIES 16
+// fit errors count half as much where the loss is this large
+#define AIR_FIT_WEIGHT_DB 6.0f
+
+/*
+	AirAbsorption
+	High-frequency loss of sound travelling through air, per source and by distance, applied to
+	the sources before any rendering.
+	The loss in dB (ISO 9613-1) grows with distance and roughly with the square of frequency, which
+	is also how a one-pole lowpass rolls off below its cutoff. So each distance gets one biquad,
+	two real poles and two real zeros fitted to the loss over the audible band; far beyond 100 m
+	it stays close only where the loss is still moderate. The fits are made once for a table of
+	distances; per block a source's coefficients are interpolated
+	from the two entries around its distance and all sources run as lanes of one BiquadBank, a few
+	operations per sample however far away they are.
+ */
+class AirAbsorption {
+public:
+
+    AirAbsorption() {
+        m_nSources = 0;
+        m_fSampleRate = 44100.0f;
+    }
+
+    // Fits the distance table for this sample rate. Not real-time safe.
+    void init(float sampleRate, int blockSize, int maxSources) {
+        m_fSampleRate = sampleRate;
+        m_nSources = std::min(maxSources, int(BIQUAD_BANK_MAX_LANES));
+        m_Filters.init(m_nSources, blockSize);
+        buildTable();
+    }
+
+    void reset() {
+        m_Filters.reset();
+    }
+
+    // Metres, for the next process()
+    void setDistance(int source, float distance) {
+        float position = sqrtf(std::min(std::max(distance, 0.0f), AIR_MAX_DISTANCE) / AIR_MAX_DISTANCE) * (AIR_TABLE_SIZE - 1);
+        int index = std::min(int(position), AIR_TABLE_SIZE - 2);
+        float frac = position - index;
+        const BiquadCoefficients& a = m_pTable[index];
+        const BiquadCoefficients& b = m_pTable[index + 1];
+        BiquadCoefficients c;
+        c.b0 = a.b0 + frac * (b.b0 - a.b0);
+        c.b1 = a.b1 + frac * (b.b1 - a.b1);
+        c.b2 = a.b2 + frac * (b.b2 - a.b2);
+        c.a1 = a.a1 + frac * (b.a1 - a.a1);
+        c.a2 = a.a2 + frac * (b.a2 - a.a2);
+        m_Filters.setCoefficients(source, c);
+    }
+
+    // pSources[s] filtered in place
+    void process(float* const* pSources, int numSources, int numSamples) {
+        m_Filters.process(pSources, std::min(numSources, m_nSources), numSamples);
+    }
+
+    // ISO 9613-1 attenuation in dB per metre at a frequency, for AIR_TEMPERATURE and AIR_HUMIDITY
+    // at sea-level pressure
+    static float attenuationPerMetre(float frequency) {
+        double t = AIR_TEMPERATURE + 273.15;
+        double t0 = 293.15;
+        // molar concentration of water vapour, %
+        double saturation = pow(10.0, -6.8346 * pow(273.16 / t, 1.261) + 4.6151);
+        double h = AIR_HUMIDITY * saturation;
+        double frO = 24.0 + 4.04e4 * h * (0.02 + h) / (0.391 + h);
+        double frN = pow(t / t0, -0.5) * (9.0 + 280.0 * h * exp(-4.170 * (pow(t / t0, -1.0 / 3.0) - 1.0)));
+        double f2 = double(frequency) * frequency;
+        double alpha = 8.686 * f2 * (1.84e-11 * sqrt(t / t0) + pow(t / t0, -2.5) * (0.01275 * exp(-2239.1 / t) / (frO + f2 / frO) + 0.1068 * exp(-3352.0 / t) / (frN + f2 / frN)));
+        return float(alpha);
+    }
+
+private:
+
+    enum { POLE1, POLE2, ZERO1, ZERO2, PARAMETERS };
+
+    // Cutoff (natural log, Hz) of a matched-z one-pole lowpass to its pole
+    float pole(float logCutoff) const {
+        return expf(-2.0f * float(M_PI) * expf(logCutoff) / m_fSampleRate);
+    }
+
+    // Real poles and zeros to a biquad with unit gain at DC
+    BiquadCoefficients section(const float* pParameters) const {
+        float p1 = pole(pParameters[POLE1]), p2 = pole(pParameters[POLE2]);
+        float z1 = pParameters[ZERO1], z2 = pParameters[ZERO2];
+        float gain = (1.0f - p1) * (1.0f - p2) / ((1.0f - z1) * (1.0f - z2));
+        BiquadCoefficients c;
+        c.b0 = gain;
+        c.b1 = -gain * (z1 + z2);
+        c.b2 = gain * z1 * z2;
+        c.a1 = -(p1 + p2);
+        c.a2 = p1 * p2;
+        return c;
+    }
+
+    // Weighted squared dB error of a section against the target losses. Errors count less where
+    // the loss is already large, so the fit follows where the roll-off begins.
+    float fitError(const float* pParameters, const float* pCosines, const float* pTarget) const {
+        float p[2] = {pole(pParameters[POLE1]), pole(pParameters[POLE2])};
+        float z[2] = {pParameters[ZERO1], pParameters[ZERO2]};
+        float error = 0.0f;
+        for(int k = 0; k < AIR_FIT_FREQUENCIES; k++) {
+            float loss = 0.0f;
+            for(int j = 0; j < 2; j++) {
+                loss += 10.0f * log10f((1.0f - 2.0f * p[j] * pCosines[k] + p[j] * p[j]) / ((1.0f - p[j]) * (1.0f - p[j])));
+                loss -= 10.0f * log10f((1.0f - 2.0f * z[j] * pCosines[k] + z[j] * z[j]) / ((1.0f - z[j]) * (1.0f - z[j])));
+            }
+            float weighted = (loss - pTarget[k]) / (1.0f + pTarget[k] / AIR_FIT_WEIGHT_DB);
+            error += weighted * weighted;
+        }
+        return error;
+    }
+
+    // Each distance's section by compass search, starting from the previous distance's fit: two
+    // real poles, and two zeros on the negative real axis to steepen the roll-off towards Nyquist
+    void buildTable() {
+        float cosines[AIR_FIT_FREQUENCIES], perMetre[AIR_FIT_FREQUENCIES], target[AIR_FIT_FREQUENCIES];
+        float lowest = 250.0f, highest = std::min(20000.0f, 0.45f * m_fSampleRate);
+        for(int k = 0; k < AIR_FIT_FREQUENCIES; k++) {
+            float f = lowest * powf(highest / lowest, float(k) / (AIR_FIT_FREQUENCIES - 1));
+            cosines[k] = cosf(2.0f * float(M_PI) * f / m_fSampleRate);
+            perMetre[k] = attenuationPerMetre(f);
+        }
+
+        BiquadCoefficients identity = {1.0f, 0.0f, 0.0f, 0.0f, 0.0f};
+        m_pTable[0] = identity;
+        // started where the poles still have some slope at the top of the band
+        float x[PARAMETERS] = {logf(0.25f * m_fSampleRate), logf(0.25f * m_fSampleRate), 0.0f, 0.0f};
+        for(int i = 1; i < AIR_TABLE_SIZE; i++) {
+            float position = float(i) / (AIR_TABLE_SIZE - 1);
+            float distance = AIR_MAX_DISTANCE * position * position;
+            for(int k = 0; k < AIR_FIT_FREQUENCIES; k++)
+                target[k] = std::min(perMetre[k] * distance, AIR_MAX_LOSS_DB);
+
+            float best = fitError(x, cosines, target);
+            for(float step = 1.0f; step > 0.002f; ) {
+                bool improved = false;
+                for(int d = 0; d < 2 * PARAMETERS; d++) {
+                    float trial[PARAMETERS];
+                    memcpy(trial, x, sizeof(x));
+                    int k = d / 2;
+                    // cutoffs move in log steps, zeros by a quarter of the step
+                    if(k < ZERO1)
+                        trial[k] += (d & 1) ? -step : step;
+                    else
+                        trial[k] = std::min(std::max(trial[k] + ((d & 1) ? -0.25f : 0.25f) * step, -1.0f), 0.0f);
+                    float error = fitError(trial, cosines, target);
+                    if(error < best) {
+                        best = error;
+                        memcpy(x, trial, sizeof(x));
+                        improved = true;
+                    }
+                }
+                if(!improved)
+                    step *= 0.5f;
+            }
+            m_pTable[i] = section(x);
+        }
+    }
+
+    int m_nSources;
+    float m_fSampleRate;
+    BiquadCoefficients m_pTable[AIR_TABLE_SIZE];
+    BiquadBank m_Filters;
+};
+
+#endif /* AirAbsorption_hpp */
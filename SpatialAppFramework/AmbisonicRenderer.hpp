@@ -0,0 +1,231 @@
+//
+//  AmbisonicRenderer.hpp
+//  Capstone
+//
+
+#ifndef AmbisonicRenderer_hpp
+#define AmbisonicRenderer_hpp
+
+#include "FFTConvolver.hpp"
+#include "HRIRGrid.hpp"
+#include "SpatialSource.hpp"
+#include "SphericalHarmonics.hpp"
+#include "SceneRotator.hpp"
+#include "VectorOps.hpp"
+#include <vector>
+#include <cstring>
+
+/*
+	AmbisonicRenderer
+	Encodes any number of sources into an order 1...5 spherical-harmonic bus with per-source
+	gains, then renders the bus binaurally with a fixed set of (order+1)² decoding filters per ear.
+	The convolution cost therefore does not grow with the number of sources.
+ */
+class AmbisonicRenderer {
+public:
+
+    AmbisonicRenderer() {
+        m_nOrder = 0;
+        m_nChannels = 0;
+        m_nBlockSize = 0;
+        m_nMaxSources = 0;
+    }
+
+    // Derives the decoding filters from the HRIR grid. Not real-time safe, call off the render thread.
+    void init(const HRIRGrid& grid, int order, int blockSize, int maxSources) {
+        m_nOrder = clampOrder(order);
+        m_nChannels = ambisonicChannelCount(m_nOrder);
+        m_nBlockSize = blockSize;
+        m_nMaxSources = maxSources;
+
+        m_pBus.assign(m_nChannels * m_nBlockSize, 0.0f);
+        m_pScratch.assign(m_nBlockSize, 0.0f);
+        m_pSourceGains.assign(m_nMaxSources * MAX_AMBISONIC_CHANNELS, 0.0f);
+        m_pSourceStarted.assign(m_nMaxSources, false);
+
+        m_SceneRotator.init(m_nOrder, m_nBlockSize);
+        buildDecoder(grid);
+    }
+
+    int order() const { return m_nOrder; }
+    int channels() const { return m_nChannels; }
+
+    static int clampOrder(int order) {
+        return clampAmbisonicOrder(order);
+    }
+
+    void process(const SpatialSource* pSources, int numSources, float* pOutLeft, float* pOutRight, int numSamples) {
+        clearBus();
+        for(int s = 0; s < numSources && s < m_nMaxSources; s++)
+            encode(pSources[s], s, numSamples);
+        renderBus(pOutLeft, pOutRight, numSamples);
+    }
+
+    // Rotates and decodes whatever was encode()d since clearBus(), for callers that
+    // encode one source at a time
+    void renderBus(float* pOutLeft, float* pOutRight, int numSamples) {
+        m_SceneRotator.process(&m_pBus[0], numSamples);
+        decode(pOutLeft, pOutRight, numSamples);
+    }
+
+    // Listener head orientation, applied to the whole bus on the next block
+    void setHeadOrientation(const Quaternion& head) {
+        m_SceneRotator.setOrientation(head);
+    }
+
+    // Adds one source into the bus, ramping its gains from the previous block to avoid zipper noise
+    void encode(const SpatialSource& source, int sourceIndex, int numSamples) {
+        float targetGains[MAX_AMBISONIC_CHANNELS];
+        evaluateSphericalHarmonics(m_nOrder, source.fAzimuth, source.fElevation, targetGains);
+
+        float* pGains = &m_pSourceGains[sourceIndex * MAX_AMBISONIC_CHANNELS];
+        if(!m_pSourceStarted[sourceIndex]) {
+            memcpy(pGains, targetGains, sizeof(float)*m_nChannels);
+            m_pSourceStarted[sourceIndex] = true;
+        }
+
+        for(int i = 0; i < numSamples; i++)
+            m_pScratch[i] = source.fGain * source.pInput[i];
+
+        float inverseLength = 1.0f / float(numSamples);
+        for(int c = 0; c < m_nChannels; c++) {
+            float* pChannel = &m_pBus[c * m_nBlockSize];
+            float gain = pGains[c];
+            float step = (targetGains[c] - gain) * inverseLength;
+            vectorRampedMultiplyAccumulate(pChannel, &m_pScratch[0], gain, step, numSamples);
+            pGains[c] = targetGains[c];
+        }
+    }
+
+    void clearBus() {
+        memset(&m_pBus[0], 0, sizeof(float)*m_pBus.size());
+    }
+
+    float* busChannel(int channel) {
+        return &m_pBus[channel * m_nBlockSize];
+    }
+
+    // Renders the bus to two ears, one convolution per channel and ear
+    void decode(float* pOutLeft, float* pOutRight, int numSamples) {
+        memset(pOutLeft, 0, sizeof(float)*numSamples);
+        memset(pOutRight, 0, sizeof(float)*numSamples);
+        for(int c = 0; c < m_nChannels; c++) {
+            const float* pChannel = &m_pBus[c * m_nBlockSize];
+            m_pDecoder_L[c].process(pChannel, &m_pScratch[0], numSamples);
+            vectorAdd(pOutLeft, &m_pScratch[0], numSamples);
+            m_pDecoder_R[c].process(pChannel, &m_pScratch[0], numSamples);
+            vectorAdd(pOutRight, &m_pScratch[0], numSamples);
+        }
+    }
+
+private:
+
+    /*
+     Sampling decoder over the measured grid: every channel's filter is the quadrature-weighted
+     sum of the HRIRs times that channel's harmonic at each position. Per-order max-rE weights
+     tame the sidelobes of the truncated expansion.
+     */
+    void buildDecoder(const HRIRGrid& grid) {
+        int irLength = grid.irLength();
+        std::vector<float> filters_L(m_nChannels * irLength, 0.0f);
+        std::vector<float> filters_R(m_nChannels * irLength, 0.0f);
+
+        float orderWeights[MAX_AMBISONIC_ORDER + 1];
+        computeMaxREWeights(orderWeights);
+
+        float coeffs[MAX_AMBISONIC_CHANNELS];
+        for(int d = 0; d < grid.size(); d++) {
+            evaluateSphericalHarmonics(m_nOrder, grid.azimuth(d), grid.elevation(d), coeffs);
+            float quadrature = grid.weight(d) / float(4.0 * M_PI);
+            const float* pLeft = grid.leftIR(d);
+            const float* pRight = grid.rightIR(d);
+            for(int n = 0; n <= m_nOrder; n++) {
+                for(int c = n*n; c < (n+1)*(n+1); c++) {
+                    float g = quadrature * orderWeights[n] * coeffs[c];
+                    float* pFilter_L = &filters_L[c * irLength];
+                    float* pFilter_R = &filters_R[c * irLength];
+                    for(int k = 0; k < irLength; k++) {
+                        pFilter_L[k] += g * pLeft[k];
+                        pFilter_R[k] += g * pRight[k];
+                    }
+                }
+            }
+        }
+
+        // Truncating the expansion loses mostly high-frequency energy, so match the
+        // decoded level to the measured HRIRs over (a subset of) the grid
+        double measuredEnergy = 0.0, decodedEnergy = 0.0;
+        std::vector<float> decoded(irLength);
+        for(int d = 0; d < grid.size(); d += 4) {
+            evaluateSphericalHarmonics(m_nOrder, grid.azimuth(d), grid.elevation(d), coeffs);
+            for(int ear = 0; ear < 2; ear++) {
+                const float* pMeasured = ear == 0 ? grid.leftIR(d) : grid.rightIR(d);
+                const std::vector<float>& filters = ear == 0 ? filters_L : filters_R;
+                std::fill(decoded.begin(), decoded.end(), 0.0f);
+                for(int c = 0; c < m_nChannels; c++) {
+                    const float* pFilter = &filters[c * irLength];
+                    for(int k = 0; k < irLength; k++)
+                        decoded[k] += coeffs[c] * pFilter[k];
+                }
+                for(int k = 0; k < irLength; k++) {
+                    measuredEnergy += grid.weight(d) * pMeasured[k] * pMeasured[k];
+                    decodedEnergy += grid.weight(d) * decoded[k] * decoded[k];
+                }
+            }
+        }
+        if(decodedEnergy > 0.0) {
+            float normalisation = float(sqrt(measuredEnergy / decodedEnergy));
+            for(size_t k = 0; k < filters_L.size(); k++) {
+                filters_L[k] *= normalisation;
+                filters_R[k] *= normalisation;
+            }
+        }
+
+        for(int c = 0; c < MAX_AMBISONIC_CHANNELS; c++) {
+            if(c < m_nChannels) {
+                m_pDecoder_L[c].init(m_nBlockSize, &filters_L[c * irLength], irLength);
+                m_pDecoder_R[c].init(m_nBlockSize, &filters_R[c * irLength], irLength);
+            }
+            else {
+                m_pDecoder_L[c].reset();
+                m_pDecoder_R[c].reset();
+            }
+        }
+    }
+
+    // g_n = P_n(cos(137.9° / (N + 1.51)))
+    void computeMaxREWeights(float* pWeights) {
+        double x = cos(degreesToRadians(137.9f / (m_nOrder + 1.51f)));
+        double p0 = 1.0, p1 = x;
+        pWeights[0] = 1.0f;
+        if(m_nOrder > 0)
+            pWeights[1] = float(x);
+        for(int n = 2; n <= m_nOrder; n++) {
+            double pn = ((2*n - 1) * x * p1 - (n - 1) * p0) / n;
+            pWeights[n] = float(pn);
+            p0 = p1;
+            p1 = pn;
+        }
+    }
+
+    int m_nOrder;
+    int m_nChannels;
+    int m_nBlockSize;
+    int m_nMaxSources;
+
+    // channel-major bus, m_nChannels * m_nBlockSize
+    std::vector<float> m_pBus;
+    std::vector<float> m_pScratch;
+
+    // last gains used for each source, for ramping
+    std::vector<float> m_pSourceGains;
+    std::vector<bool> m_pSourceStarted;
+
+    // head tracking
+    SceneRotator m_SceneRotator;
+
+    fftconvolver::FFTConvolver m_pDecoder_L[MAX_AMBISONIC_CHANNELS];
+    fftconvolver::FFTConvolver m_pDecoder_R[MAX_AMBISONIC_CHANNELS];
+};
+
+#endif /* AmbisonicRenderer_hpp */
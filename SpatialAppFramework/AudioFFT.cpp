@@ -37,6 +37,9 @@
     #define AUDIOFFT_OOURA
   #endif
   #define AUDIOFFT_OOURA_USED
+  #include <map>
+  #include <memory>
+  #include <mutex>
   #include <vector>
 #endif
 
@@ -82,6 +85,10 @@ namespace audiofft
      * @internal
      * @class OouraFFT
      * @brief FFT implementation based on the great radix-4 routines by Takuya Ooura
+     *
+     * The twiddle/cosine tables only depend on the size, so all instances of one size
+     * share a single immutable copy. Only the bit-reversal work area (which rdft()
+     * rewrites on every call) and the conversion buffer are kept per instance.
      */
     class OouraFFT : public AudioFFTImpl
     {
@@ -89,8 +96,8 @@ namespace audiofft
       OouraFFT() :
         AudioFFTImpl(),
         _size(0),
+        _tables(),
         _ip(),
-        _w(),
         _buffer()
       {
       }
@@ -99,14 +106,10 @@ namespace audiofft
       {
         if (_size != size)
         {
-          _ip.resize(2 + static_cast<int>(std::sqrt(static_cast<double>(size))));
-          _w.resize(size / 2);
+          _tables = (size > 0) ? GetTables(size) : std::shared_ptr<const Tables>();
+          _ip = (size > 0) ? _tables->ip : std::vector<int>();
           _buffer.resize(size);
           _size = size;
-
-          const int size4 = static_cast<int>(_size) / 4;
-          makewt(size4, _ip.data(), _w.data());
-          makect(size4, _ip.data(), _w.data() + size4);
         }
       }
 
@@ -115,7 +118,7 @@ namespace audiofft
         // Convert into the format as required by the Ooura FFT
         ConvertBuffer(&_buffer[0], data, _size);
 
-        rdft(static_cast<int>(_size), +1, _buffer.data(), _ip.data(), _w.data());
+        rdft(static_cast<int>(_size), +1, _buffer.data(), _ip.data(), _tables->w.data());
 
         // Convert back to split-complex
         {
@@ -151,19 +154,49 @@ namespace audiofft
           _buffer[1] = re[_size / 2];
         }
 
-        rdft(static_cast<int>(_size), -1, _buffer.data(), _ip.data(), _w.data());
+        rdft(static_cast<int>(_size), -1, _buffer.data(), _ip.data(), _tables->w.data());
 
         // Convert back to split-complex
         ScaleBuffer(data, &_buffer[0], 2.0 / static_cast<double>(_size), _size);
       }
 
     private:
+      struct Tables
+      {
+        std::vector<int> ip;
+        std::vector<double> w;
+      };
+
+      /**
+       * @brief Returns the tables for a size, computing them if no instance holds them (thread-safe)
+       */
+      static std::shared_ptr<const Tables> GetTables(size_t size)
+      {
+        static std::mutex mutex;
+        static std::map<size_t, std::weak_ptr<const Tables> > cache;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        std::shared_ptr<const Tables> tables = cache[size].lock();
+        if (!tables)
+        {
+          Tables* t = new Tables();
+          t->ip.resize(2 + static_cast<int>(std::sqrt(static_cast<double>(size))));
+          t->w.resize(size / 2);
+          const int size4 = static_cast<int>(size) / 4;
+          makewt(size4, t->ip.data(), t->w.data());
+          makect(size4, t->ip.data(), t->w.data() + size4);
+          tables.reset(t);
+          cache[size] = tables;
+        }
+        return tables;
+      }
+
       size_t _size;
+      std::shared_ptr<const Tables> _tables;
       std::vector<int> _ip;
-      std::vector<double> _w;
       std::vector<double> _buffer;
 
-      void rdft(int n, int isgn, double *a, int *ip, double *w)
+      void rdft(int n, int isgn, double *a, int *ip, const double *w)
       {
         int nw = ip[0];
         int nc = ip[1];
@@ -204,7 +237,7 @@ namespace audiofft
 
       /* -------- initializing routines -------- */
 
-      void makewt(int nw, int *ip, double *w)
+      static void makewt(int nw, int *ip, double *w)
       {
         int j, nwh;
         double delta, x, y;
@@ -233,7 +266,7 @@ namespace audiofft
       }
 
 
-      void makect(int nc, int *ip, double *c)
+      static void makect(int nc, int *ip, double *c)
       {
         int j, nch;
         double delta;
@@ -255,7 +288,7 @@ namespace audiofft
       /* -------- child routines -------- */
 
 
-      void bitrv2(int n, int *ip, double *a)
+      static void bitrv2(int n, int *ip, double *a)
       {
         int j, j1, k, k1, l, m, m2;
         double xr, xi, yr, yi;
@@ -355,7 +388,7 @@ namespace audiofft
       }
 
 
-      void cftfsub(int n, double *a, double *w)
+      void cftfsub(int n, double *a, const double *w)
       {
         int j, j1, j2, j3, l;
         double x0r, x0i, x1r, x1i, x2r, x2i, x3r, x3i;
@@ -405,7 +438,7 @@ namespace audiofft
       }
 
 
-      void cftbsub(int n, double *a, double *w)
+      void cftbsub(int n, double *a, const double *w)
       {
         int j, j1, j2, j3, l;
         double x0r, x0i, x1r, x1i, x2r, x2i, x3r, x3i;
@@ -455,7 +488,7 @@ namespace audiofft
       }
 
 
-      void cft1st(int n, double *a, double *w)
+      void cft1st(int n, double *a, const double *w)
       {
         int j, k1, k2;
         double wk1r, wk1i, wk2r, wk2i, wk3r, wk3i;
@@ -560,7 +593,7 @@ namespace audiofft
       }
 
 
-      void cftmdl(int n, int l, double *a, double *w)
+      void cftmdl(int n, int l, double *a, const double *w)
       {
         int j, j1, j2, j3, k, k1, k2, m, m2;
         double wk1r, wk1i, wk2r, wk2i, wk3r, wk3i;
@@ -687,7 +720,7 @@ namespace audiofft
       }
 
 
-      void rftfsub(int n, double *a, int nc, double *c)
+      void rftfsub(int n, double *a, int nc, const double *c)
       {
         int j, k, kk, ks, m;
         double wkr, wki, xr, xi, yr, yi;
@@ -712,7 +745,7 @@ namespace audiofft
       }
 
 
-      void rftbsub(int n, double *a, int nc, double *c)
+      void rftbsub(int n, double *a, int nc, const double *c)
       {
         int j, k, kk, ks, m;
         double wkr, wki, xr, xi, yr, yi;
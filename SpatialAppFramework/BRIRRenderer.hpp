@@ -0,0 +1,212 @@
+//
+//  BRIRRenderer.hpp
+//  Capstone
+//
+
+#ifndef BRIRRenderer_hpp
+#define BRIRRenderer_hpp
+
+#include "TwoStageFFTConvolver.hpp"
+#include "VectorOps.hpp"
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+#define BRIR_MAX_SOURCES 16
+// the tail block is this many render blocks; the background has that long for each tail job
+#define BRIR_TAIL_BLOCKS 8
+#define BRIR_POLL_MS 1
+
+/*
+	BRIRRenderer
+	Convolves each source with its own binaural room impulse response pair, several seconds
+	long, and adds the result to both ears.
+	Each ear is a TwoStageFFTConvolver: the first two tail blocks (BRIR_TAIL_BLOCKS render blocks
+	each) run on the render thread, the rest of the response on this renderer's background
+	thread. For a 3 s response at 1024-sample blocks the render thread convolves 16 partitions
+	per ear instead of 130, whatever the length.
+	A newly loaded pair is handed to the render thread through an atomic pointer and the one it
+	replaces is freed by the background thread, so loading never blocks rendering.
+	The background thread is only started once the renderer is switched on and waits without
+	polling while it is off.
+ */
+class BRIRRenderer {
+public:
+
+    BRIRRenderer() : m_nMisses(0), m_bStopping(false) {
+        m_bActive = false;
+        m_nBlockSize = 0;
+        m_nSources = 0;
+        for(int s = 0; s < BRIR_MAX_SOURCES; s++) {
+            m_pSeenMisses[s] = 0;
+            m_pPending[s] = NULL;
+            m_pLive[s] = NULL;
+            m_pRetired[s] = NULL;
+        }
+    }
+
+    ~BRIRRenderer() {
+        stop();
+        for(int s = 0; s < BRIR_MAX_SOURCES; s++) {
+            delete m_pPending[s].load();
+            delete m_pLive[s].load();
+            delete m_pRetired[s].load();
+        }
+    }
+
+    // Drops the responses loaded before and starts the background thread if the renderer is on.
+    // Not real-time safe.
+    void init(int blockSize, int numSources) {
+        stop();
+        m_nBlockSize = blockSize;
+        m_nSources = std::min(numSources, int(BRIR_MAX_SOURCES));
+        for(int s = 0; s < BRIR_MAX_SOURCES; s++) {
+            delete m_pPending[s].exchange(NULL);
+            delete m_pLive[s].exchange(NULL);
+            delete m_pRetired[s].exchange(NULL);
+            m_pSeenMisses[s] = 0;
+        }
+        m_nMisses = 0;
+        m_pScratch.assign(blockSize, 0.0f);
+
+        m_bStopping = false;
+        if(m_bActive)
+            m_Worker = std::thread(&BRIRRenderer::work, this);
+    }
+
+    // Main thread: whether process() is being called, so whether the background thread polls
+    void setActive(bool active) {
+        {
+            std::lock_guard<std::mutex> lock(m_WakeMutex);
+            m_bActive = active;
+        }
+        if(active && !m_Worker.joinable() && m_nBlockSize > 0)
+            m_Worker = std::thread(&BRIRRenderer::work, this);
+        else
+            m_Wake.notify_one();
+    }
+
+    // Partitions a source's response pair and hands it to the render thread, which picks it up
+    // on its next block. Main thread only; it allocates.
+    bool load(int source, const float* pLeft, const float* pRight, int length) {
+        if(source < 0 || source >= m_nSources || length <= 0)
+            return false;
+        BRIR* brir = new BRIR;
+        int tailBlock = BRIR_TAIL_BLOCKS * m_nBlockSize;
+        if(!brir->left.init(m_nBlockSize, tailBlock, pLeft, length) || !brir->right.init(m_nBlockSize, tailBlock, pRight, length)) {
+            delete brir;
+            return false;
+        }
+        // one the render thread never took is still ours to free
+        delete m_pPending[source].exchange(brir);
+        return true;
+    }
+
+    // Convolves every source that has a response and adds it to both ears
+    void process(const float* const* pInputs, int numSources, float* pOutLeft, float* pOutRight, int numSamples) {
+        for(int s = 0; s < numSources && s < m_nSources; s++) {
+            adopt(s);
+            BRIR* brir = m_pLive[s].load(std::memory_order_relaxed);
+            if(!brir)
+                continue;
+            brir->left.process(pInputs[s], &m_pScratch[0], numSamples);
+            vectorAdd(pOutLeft, &m_pScratch[0], numSamples);
+            brir->right.process(pInputs[s], &m_pScratch[0], numSamples);
+            vectorAdd(pOutRight, &m_pScratch[0], numSamples);
+
+            size_t misses = brir->left.deadlineMisses() + brir->right.deadlineMisses();
+            if(misses != m_pSeenMisses[s]) {
+                m_nMisses.fetch_add(misses - m_pSeenMisses[s], std::memory_order_relaxed);
+                m_pSeenMisses[s] = misses;
+            }
+        }
+    }
+
+    // Tail blocks left silent because the background thread was late, over every source
+    size_t deadlineMisses() const {
+        return m_nMisses.load(std::memory_order_relaxed);
+    }
+
+private:
+
+    struct BRIR {
+        fftconvolver::TwoStageFFTConvolver left;
+        fftconvolver::TwoStageFFTConvolver right;
+    };
+
+    // Render thread: swaps in a newly loaded pair once the background has freed the last one
+    void adopt(int source) {
+        if(!m_pPending[source].load(std::memory_order_relaxed) || m_pRetired[source].load(std::memory_order_acquire))
+            return;
+        BRIR* brir = m_pPending[source].exchange(NULL, std::memory_order_acq_rel);
+        if(!brir)
+            return;
+        BRIR* old = m_pLive[source].exchange(brir, std::memory_order_acq_rel);
+        m_pSeenMisses[source] = 0;
+        if(old)
+            m_pRetired[source].store(old, std::memory_order_release);
+    }
+
+    void stop() {
+        if(!m_Worker.joinable())
+            return;
+        {
+            std::lock_guard<std::mutex> lock(m_WakeMutex);
+            m_bStopping = true;
+        }
+        m_Wake.notify_one();
+        m_Worker.join();
+    }
+
+    // Background thread: frees retired pairs, then runs the tails' queued jobs. A pair is only
+    // freed at the top of a pass, so never while this thread is still working on it. Parked
+    // until woken while the renderer is off.
+    void work() {
+        std::unique_lock<std::mutex> lock(m_WakeMutex);
+        while(!m_bStopping) {
+            lock.unlock();
+            bool busy = false;
+            for(int s = 0; s < m_nSources; s++) {
+                BRIR* retired = m_pRetired[s].load(std::memory_order_acquire);
+                if(retired) {
+                    delete retired;
+                    m_pRetired[s].store(NULL, std::memory_order_release);
+                }
+                BRIR* brir = m_pLive[s].load(std::memory_order_acquire);
+                if(brir) {
+                    busy |= brir->left.processBackground();
+                    busy |= brir->right.processBackground();
+                }
+            }
+            lock.lock();
+            if(!m_bActive && !m_bStopping)
+                m_Wake.wait(lock);
+            else if(!busy && !m_bStopping)
+                m_Wake.wait_for(lock, std::chrono::milliseconds(BRIR_POLL_MS));
+        }
+    }
+
+    int m_nBlockSize;
+    int m_nSources;
+    std::vector<float> m_pScratch;
+    // render thread's running total of the convolvers' misses
+    size_t m_pSeenMisses[BRIR_MAX_SOURCES];
+    std::atomic<size_t> m_nMisses;
+
+    // loaded by the main thread, in use by the render thread, waiting for the background to free it
+    std::atomic<BRIR*> m_pPending[BRIR_MAX_SOURCES];
+    std::atomic<BRIR*> m_pLive[BRIR_MAX_SOURCES];
+    std::atomic<BRIR*> m_pRetired[BRIR_MAX_SOURCES];
+
+    // background thread, and whether it polls (guarded by m_WakeMutex)
+    std::atomic<bool> m_bStopping;
+    bool m_bActive;
+    std::mutex m_WakeMutex;
+    std::condition_variable m_Wake;
+    std::thread m_Worker;
+};
+
+#endif /* BRIRRenderer_hpp */
@@ -0,0 +1,188 @@
+//
+//  BiquadBank.hpp
+//  Capstone
+//
+
+#ifndef BiquadBank_hpp
+#define BiquadBank_hpp
+
+#include "VectorOps.hpp"
+#include <vector>
+#include <cstring>
+#include <algorithm>
+
+#define BIQUAD_BANK_MAX_LANES 32
+// lanes filtered together, one per vector element
+#define BIQUAD_BANK_WIDTH 4
+
+// a0 normalised to 1
+struct BiquadCoefficients {
+    float b0, b1, b2;
+    float a1, a2;
+};
+
+/*
+	BiquadBank
+	Up to BIQUAD_BANK_MAX_LANES independent biquads (transposed direct form II), e.g. one per
+	source and ear. Coefficients and state are kept structure-of-arrays, one lane per filter, and
+	the inputs are interleaved sample by sample, so each step of the recursion runs on four lanes
+	at once with NEON or SSE instead of one filter at a time.
+	New coefficients are ramped linearly across the next block. The stable region of (a1, a2) is
+	a triangle, so every coefficient set on the way between two stable ones is stable too.
+ */
+class BiquadBank {
+public:
+
+    BiquadBank() {
+        m_nLanes = 0;
+        reset();
+        for(int l = 0; l < BIQUAD_BANK_MAX_LANES; l++) {
+            BiquadCoefficients identity = {1.0f, 0.0f, 0.0f, 0.0f, 0.0f};
+            store(m_pCurrent, l, identity);
+            store(m_pTarget, l, identity);
+        }
+    }
+
+    // Allocates the interleaving buffer. Not real-time safe.
+    void init(int lanes, int blockSize) {
+        m_nLanes = std::min(lanes, int(BIQUAD_BANK_MAX_LANES));
+        m_pInterleaved.assign(paddedLanes(m_nLanes) * blockSize, 0.0f);
+        reset();
+    }
+
+    int lanes() const { return m_nLanes; }
+
+    // Empties every filter; the next coefficients set are used straight away
+    void reset() {
+        memset(m_pState1, 0, sizeof(m_pState1));
+        memset(m_pState2, 0, sizeof(m_pState2));
+        memset(m_pStarted, 0, sizeof(m_pStarted));
+    }
+
+    // Coefficients a lane ramps to over the next process()
+    void setCoefficients(int lane, const BiquadCoefficients& coefficients) {
+        store(m_pTarget, lane, coefficients);
+        if(!m_pStarted[lane]) {
+            store(m_pCurrent, lane, coefficients);
+            m_pStarted[lane] = true;
+        }
+    }
+
+    // Filters pBuffers[l] in place for the first numLanes lanes, at most the block size given to init()
+    void process(float* const* pBuffers, int numLanes, int numSamples) {
+        numLanes = std::min(numLanes, m_nLanes);
+        int stride = paddedLanes(numLanes);
+        float* pX = &m_pInterleaved[0];
+
+        for(int l = 0; l < numLanes; l++)
+            for(int i = 0; i < numSamples; i++)
+                pX[i * stride + l] = pBuffers[l][i];
+        for(int l = numLanes; l < stride; l++)
+            for(int i = 0; i < numSamples; i++)
+                pX[i * stride + l] = 0.0f;
+
+        float inverseLength = 1.0f / float(numSamples);
+        for(int g = 0; g < stride; g += BIQUAD_BANK_WIDTH)
+            processGroup(pX + g, stride, g, inverseLength, numSamples);
+
+        for(int l = 0; l < numLanes; l++)
+            for(int i = 0; i < numSamples; i++)
+                pBuffers[l][i] = pX[i * stride + l];
+
+        // the ramps end exactly on the targets
+        memcpy(m_pCurrent, m_pTarget, sizeof(m_pCurrent));
+    }
+
+private:
+
+    enum { B0, B1, B2, A1, A2, COEFFICIENTS };
+
+    static int paddedLanes(int lanes) {
+        return (lanes + BIQUAD_BANK_WIDTH - 1) / BIQUAD_BANK_WIDTH * BIQUAD_BANK_WIDTH;
+    }
+
+    static void store(float (*pTable)[BIQUAD_BANK_MAX_LANES], int lane, const BiquadCoefficients& c) {
+        pTable[B0][lane] = c.b0;
+        pTable[B1][lane] = c.b1;
+        pTable[B2][lane] = c.b2;
+        pTable[A1][lane] = c.a1;
+        pTable[A2][lane] = c.a2;
+    }
+
+    // Four lanes, interleaved with the given stride, filtered in place
+    void processGroup(float* pX, int stride, int lane, float inverseLength, int numSamples) {
+#if defined(VECTOROPS_USE_NEON)
+        float32x4_t c[COEFFICIENTS], step[COEFFICIENTS];
+        for(int k = 0; k < COEFFICIENTS; k++) {
+            c[k] = vld1q_f32(&m_pCurrent[k][lane]);
+            step[k] = vmulq_n_f32(vsubq_f32(vld1q_f32(&m_pTarget[k][lane]), c[k]), inverseLength);
+        }
+        float32x4_t s1 = vld1q_f32(&m_pState1[lane]);
+        float32x4_t s2 = vld1q_f32(&m_pState2[lane]);
+        for(int i = 0; i < numSamples; i++, pX += stride) {
+            for(int k = 0; k < COEFFICIENTS; k++)
+                c[k] = vaddq_f32(c[k], step[k]);
+            float32x4_t x = vld1q_f32(pX);
+            float32x4_t y = vmlaq_f32(s1, c[B0], x);
+            s1 = vmlsq_f32(vmlaq_f32(s2, c[B1], x), c[A1], y);
+            s2 = vmlsq_f32(vmulq_f32(c[B2], x), c[A2], y);
+            vst1q_f32(pX, y);
+        }
+        vst1q_f32(&m_pState1[lane], s1);
+        vst1q_f32(&m_pState2[lane], s2);
+#elif defined(VECTOROPS_USE_SSE)
+        __m128 c[COEFFICIENTS], step[COEFFICIENTS];
+        __m128 scale = _mm_set1_ps(inverseLength);
+        for(int k = 0; k < COEFFICIENTS; k++) {
+            c[k] = _mm_loadu_ps(&m_pCurrent[k][lane]);
+            step[k] = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&m_pTarget[k][lane]), c[k]), scale);
+        }
+        __m128 s1 = _mm_loadu_ps(&m_pState1[lane]);
+        __m128 s2 = _mm_loadu_ps(&m_pState2[lane]);
+        for(int i = 0; i < numSamples; i++, pX += stride) {
+            for(int k = 0; k < COEFFICIENTS; k++)
+                c[k] = _mm_add_ps(c[k], step[k]);
+            __m128 x = _mm_loadu_ps(pX);
+            __m128 y = _mm_add_ps(s1, _mm_mul_ps(c[B0], x));
+            s1 = _mm_sub_ps(_mm_add_ps(s2, _mm_mul_ps(c[B1], x)), _mm_mul_ps(c[A1], y));
+            s2 = _mm_sub_ps(_mm_mul_ps(c[B2], x), _mm_mul_ps(c[A2], y));
+            _mm_storeu_ps(pX, y);
+        }
+        _mm_storeu_ps(&m_pState1[lane], s1);
+        _mm_storeu_ps(&m_pState2[lane], s2);
+#else
+        for(int l = lane; l < lane + BIQUAD_BANK_WIDTH; l++) {
+            float c[COEFFICIENTS], step[COEFFICIENTS];
+            for(int k = 0; k < COEFFICIENTS; k++) {
+                c[k] = m_pCurrent[k][l];
+                step[k] = (m_pTarget[k][l] - c[k]) * inverseLength;
+            }
+            float s1 = m_pState1[l], s2 = m_pState2[l];
+            float* pLane = pX + (l - lane);
+            for(int i = 0; i < numSamples; i++, pLane += stride) {
+                for(int k = 0; k < COEFFICIENTS; k++)
+                    c[k] += step[k];
+                float x = *pLane;
+                float y = c[B0] * x + s1;
+                s1 = c[B1] * x - c[A1] * y + s2;
+                s2 = c[B2] * x - c[A2] * y;
+                *pLane = y;
+            }
+            m_pState1[l] = s1;
+            m_pState2[l] = s2;
+        }
+#endif
+    }
+
+    int m_nLanes;
+    // [coefficient][lane]
+    float m_pCurrent[COEFFICIENTS][BIQUAD_BANK_MAX_LANES];
+    float m_pTarget[COEFFICIENTS][BIQUAD_BANK_MAX_LANES];
+    float m_pState1[BIQUAD_BANK_MAX_LANES];
+    float m_pState2[BIQUAD_BANK_MAX_LANES];
+    bool m_pStarted[BIQUAD_BANK_MAX_LANES];
+    // [sample][lane], lanes padded to a multiple of BIQUAD_BANK_WIDTH
+    std::vector<float> m_pInterleaved;
+};
+
+#endif /* BiquadBank_hpp */
@@ -7,11 +7,69 @@
 //
 
 #include "DDLModule.hpp"
+#include "VectorOps.hpp"
+#include <algorithm>
+#include <vector>
+#include <cmath>
+
+static double besselI0(double x)
+{
+    double sum=1.0,term=1.0;
+    for(int k=1;k<30;k++)
+    {
+        term*=(x/(2.0*k))*(x/(2.0*k));
+        sum+=term;
+    }
+    return sum;
+}
+// Kaiser-windowed sinc, one row of taps per fraction 0..1 in DDL_SINC_PHASES steps plus the
+// closing row, each row normalised to unity gain at DC
+static std::vector<float> buildSincTable()
+{
+    std::vector<float> table;
+    {
+        const double beta=DDL_SINC_BETA;
+        const double half=DDL_SINC_TAPS/2;
+        table.resize((DDL_SINC_PHASES+1)*DDL_SINC_TAPS);
+        for(int p=0;p<=DDL_SINC_PHASES;p++)
+        {
+            double fFrac=(double)p/DDL_SINC_PHASES;
+            double sum=0;
+            double row[DDL_SINC_TAPS];
+            for(int k=0;k<DDL_SINC_TAPS;k++)
+            {
+                double t=k-(half-1)-fFrac;
+                double sinc=(t==0)?1.0:sin(M_PI*t)/(M_PI*t);
+                double w=t/half;
+                double window=(fabs(w)<1.0)?besselI0(beta*sqrt(1.0-w*w))/besselI0(beta):0.0;
+                row[k]=sinc*window;
+                sum+=row[k];
+            }
+            for(int k=0;k<DDL_SINC_TAPS;k++)
+                table[p*DDL_SINC_TAPS+k]=(float)(row[k]/sum);
+        }
+    }
+    return table;
+}
+// built once, shared by every delay line
+static const float* sincTable()
+{
+    static const std::vector<float> table=buildSincTable();
+    return &table[0];
+}
 
 
 CDDLModule::CDDLModule()
 {
 
+    m_pBuffer=NULL;
+    m_nBufferSize=0;
+    m_nBufferMask=0;
+    m_nSampleRate=44100;
+    m_fBlockDelay=0;
+    m_fAllpassState=0;
+    m_nInterpolation=DDLInterpolationLinear;
+    m_pSincTable=sincTable();
     m_fDelayInSamples=0;
     m_fFeedback=0;
     m_fWetLevel=0;
@@ -25,11 +83,29 @@ CDDLModule::CDDLModule()
     resetDelay();
     cookVariables();
 
+}
+CDDLModule::~CDDLModule()
+{
+
+    if(m_pBuffer)
+        delete[] m_pBuffer;
+
 }
 void CDDLModule::prepare()
 {
 
-    m_nBufferSize=2*m_nSampleRate;
+    // two seconds
+    prepare(2*m_nSampleRate);
+
+}
+void CDDLModule::prepare(int nMaxDelay)
+{
+
+    // rounded up to a power of two, with room for the block path's chunk and taps
+    m_nBufferSize=1;
+    while(m_nBufferSize<nMaxDelay+DDL_CHUNK+DDL_SINC_TAPS+2)
+        m_nBufferSize<<=1;
+    m_nBufferMask=m_nBufferSize-1;
     if(m_pBuffer)
         delete[] m_pBuffer;
     m_pBuffer=new float[m_nBufferSize];
@@ -54,6 +130,8 @@ void CDDLModule::resetDelay()
         memset(m_pBuffer,0.0,m_nBufferSize*sizeof(float));
     m_nWriteIndex=0;
     m_fCurrentInput=0;
+    m_fBlockDelay=m_fDelayInSamples;
+    m_fAllpassState=0;
     cookVariables();
 
 }
@@ -107,3 +185,383 @@ float CDDLModule::processAudio(float fInput)
     
 
 }
+
+void CDDLModule::processBlock(const float* pInput, float* pOutput, int numSamples)
+{
+    if(numSamples<=0)
+        return;
+    if(!m_pBuffer||m_bUseExternalFeedback||m_bUseExternalXn)
+    {
+        for(int i=0;i<numSamples;i++)
+            pOutput[i]=processAudio(pInput[i]);
+        m_fBlockDelay=m_fDelayInSamples;
+        return;
+    }
+    
+    float fCurrentInput=pInput[numSamples-1];
+    float fStart=clampDelay(m_fBlockDelay);
+    float fEnd=clampDelay(m_fDelayInSamples);
+    if(m_nInterpolation==DDLInterpolationThiran)
+        processAllpass(pInput,pOutput,numSamples,fStart,fEnd);
+    else if(fStart==fEnd)
+        processConstant(pInput,pOutput,numSamples,fEnd);
+    else
+        processRamped(pInput,pOutput,numSamples,fStart,fEnd);
+    
+    m_fBlockDelay=fEnd;
+    m_fCurrentInput=fCurrentInput;
+    cookVariables();
+
+}
+void CDDLModule::readBlock(float* pOutput, int numSamples)
+{
+    if(!m_pBuffer)
+    {
+        memset(pOutput,0,numSamples*sizeof(float));
+        return;
+    }
+    float pCoeffs[DDL_MAX_TAPS];
+    int nBase;
+    float fDelay=clampDelay(m_fDelayInSamples);
+    computeTaps(&fDelay,&nBase,pCoeffs,1);
+    readTaps(pOutput,m_nWriteIndex-nBase,pCoeffs,tapCount(),numSamples);
+    m_fBlockDelay=fDelay;
+}
+void CDDLModule::writeBlock(const float* pInput, int numSamples)
+{
+    if(!m_pBuffer||numSamples<=0)
+        return;
+    int nFirst=std::min(numSamples,m_nBufferSize-m_nWriteIndex);
+    memcpy(&m_pBuffer[m_nWriteIndex],pInput,nFirst*sizeof(float));
+    memcpy(m_pBuffer,pInput+nFirst,(numSamples-nFirst)*sizeof(float));
+    m_nWriteIndex=(m_nWriteIndex+numSamples)&m_nBufferMask;
+    m_fCurrentInput=pInput[numSamples-1];
+    cookVariables();
+}
+void CDDLModule::readTap(float fStartDelay, float fEndDelay, float* pOutput, int numSamples)
+{
+    if(!m_pBuffer)
+    {
+        memset(pOutput,0,numSamples*sizeof(float));
+        return;
+    }
+    // sample i of the last block written sits at nBlockStart+i
+    int nBlockStart=m_nWriteIndex-numSamples;
+    float fMaxDelay=(float)(m_nBufferSize-numSamples-DDL_SINC_TAPS-2);
+    float fStart=std::min(clampDelay(fStartDelay),fMaxDelay);
+    float fEnd=std::min(clampDelay(fEndDelay),fMaxDelay);
+    int nTaps=tapCount();
+    float pCoeffs[DDL_MAX_TAPS*DDL_CHUNK];
+    int pBase[DDL_CHUNK];
+    if(fStart==fEnd)
+    {
+        computeTaps(&fEnd,pBase,pCoeffs,1);
+        readTaps(pOutput,nBlockStart-pBase[0],pCoeffs,nTaps,numSamples);
+        return;
+    }
+    
+    float fStep=(fEnd-fStart)/numSamples;
+    float pDelays[DDL_CHUNK];
+    for(int nDone=0;nDone<numSamples;)
+    {
+        int nChunk=std::min(numSamples-nDone,DDL_CHUNK);
+        for(int i=0;i<nChunk;i++)
+            pDelays[i]=fStart+fStep*(nDone+i+1);
+        if(nDone+nChunk==numSamples)
+            pDelays[nChunk-1]=fEnd;
+        computeTaps(pDelays,pBase,pCoeffs,nChunk);
+        for(int i=0;i<nChunk;i++)
+        {
+            int nRead=nBlockStart+nDone+i-pBase[i];
+            float fOut=0;
+            for(int k=0;k<nTaps;k++)
+                fOut+=pCoeffs[i*nTaps+k]*m_pBuffer[(nRead-k)&m_nBufferMask];
+            pOutput[nDone+i]=fOut;
+        }
+        nDone+=nChunk;
+    }
+}
+float CDDLModule::minimumDelay() const
+{
+    switch(m_nInterpolation)
+    {
+        case DDLInterpolationLagrange3: return 1.0f;
+        case DDLInterpolationLagrange5: return 2.0f;
+        case DDLInterpolationThiran: return 0.5f;
+        case DDLInterpolationSinc: return (float)(DDL_SINC_TAPS/2-1);
+        default: return 0.0f;
+    }
+}
+float CDDLModule::clampDelay(float fDelay)
+{
+    // leaves room for a whole chunk to be written ahead of the oldest tap
+    return std::min(std::max(fDelay,minimumDelay()),(float)(m_nBufferSize-DDL_CHUNK-DDL_SINC_TAPS-2));
+}
+// Lagrange taps at -half..order-half around the integer delay:
+// c_k = prod_{j!=k} (frac-x_j) / prod_{j!=k} (x_k-x_j), numerators from prefix and suffix
+// products, denominators (-1)^(order-k) k! (order-k)!
+template<int Order>
+static void lagrangeTaps(const float* pDelays, int* pBase, float* pCoeffs, int numSamples)
+{
+    const int nHalf=(Order-1)/2;
+    float pInverse[Order+1];
+    for(int k=0;k<=Order;k++)
+    {
+        float fDenominator=((Order-k)&1)?-1.0f:1.0f;
+        for(int j=2;j<=k;j++)
+            fDenominator*=j;
+        for(int j=2;j<=Order-k;j++)
+            fDenominator*=j;
+        pInverse[k]=1.0f/fDenominator;
+    }
+    for(int i=0;i<numSamples;i++)
+    {
+        int nDelay=(int)pDelays[i];
+        float fFrac=pDelays[i]-nDelay;
+        pBase[i]=nDelay-nHalf;
+        float pNumerator[Order+1];
+        float fPrefix=1.0f;
+        for(int k=0;k<=Order;k++)
+        {
+            pNumerator[k]=fPrefix;
+            fPrefix*=fFrac-(float)(k-nHalf);
+        }
+        float fSuffix=1.0f;
+        for(int k=Order;k>=0;k--)
+        {
+            pCoeffs[i*(Order+1)+k]=pNumerator[k]*fSuffix*pInverse[k];
+            fSuffix*=fFrac-(float)(k-nHalf);
+        }
+    }
+}
+void CDDLModule::computeTaps(const float* pDelays, int* pBase, float* pCoeffs, int numSamples) const
+{
+    switch(m_nInterpolation)
+    {
+        case DDLInterpolationLagrange3:
+            lagrangeTaps<3>(pDelays,pBase,pCoeffs,numSamples);
+            return;
+        case DDLInterpolationLagrange5:
+            lagrangeTaps<5>(pDelays,pBase,pCoeffs,numSamples);
+            return;
+        case DDLInterpolationSinc:
+            // table rows either side of the fraction, blended
+            for(int i=0;i<numSamples;i++)
+            {
+                int nDelay=(int)pDelays[i];
+                float fPhase=(pDelays[i]-nDelay)*DDL_SINC_PHASES;
+                int nPhase=std::min((int)fPhase,DDL_SINC_PHASES-1);
+                float fBlend=fPhase-nPhase;
+                const float* pRow=&m_pSincTable[nPhase*DDL_SINC_TAPS];
+                pBase[i]=nDelay-(DDL_SINC_TAPS/2-1);
+                for(int k=0;k<DDL_SINC_TAPS;k++)
+                    pCoeffs[i*DDL_SINC_TAPS+k]=pRow[k]+fBlend*(pRow[k+DDL_SINC_TAPS]-pRow[k]);
+            }
+            return;
+        default:
+            for(int i=0;i<numSamples;i++)
+            {
+                int nDelay=(int)pDelays[i];
+                float fFrac=pDelays[i]-nDelay;
+                pBase[i]=nDelay;
+                pCoeffs[2*i]=1.0f-fFrac;
+                pCoeffs[2*i+1]=fFrac;
+            }
+            return;
+    }
+}
+int CDDLModule::tapCount() const
+{
+    switch(m_nInterpolation)
+    {
+        case DDLInterpolationLagrange3: return 4;
+        case DDLInterpolationLagrange5: return 6;
+        case DDLInterpolationSinc: return DDL_SINC_TAPS;
+        default: return 2;
+    }
+}
+void CDDLModule::readTaps(float* pOutput, int nReadIndex, const float* pCoeffs, int nTaps, int numSamples)
+{
+    // tap k reads k samples further back than nReadIndex, in runs where it does not wrap
+    if(nTaps==2)
+    {
+        int nRead=nReadIndex&m_nBufferMask;
+        int nRead_1=(nRead-1)&m_nBufferMask;
+        float fFrac=pCoeffs[1];
+        while(numSamples>0)
+        {
+            int nRun=std::min(numSamples,std::min(m_nBufferSize-nRead,m_nBufferSize-nRead_1));
+            vectorLerp(pOutput,&m_pBuffer[nRead],&m_pBuffer[nRead_1],fFrac,nRun);
+            pOutput+=nRun;
+            numSamples-=nRun;
+            nRead=(nRead+nRun)&m_nBufferMask;
+            nRead_1=(nRead_1+nRun)&m_nBufferMask;
+        }
+        return;
+    }
+    
+    memset(pOutput,0,numSamples*sizeof(float));
+    for(int k=0;k<nTaps;k++)
+    {
+        int nRead=(nReadIndex-k)&m_nBufferMask;
+        for(int nDone=0;nDone<numSamples;)
+        {
+            int nRun=std::min(numSamples-nDone,m_nBufferSize-nRead);
+            vectorMultiplyAccumulate(pOutput+nDone,&m_pBuffer[nRead],pCoeffs[k],nRun);
+            nDone+=nRun;
+            nRead=(nRead+nRun)&m_nBufferMask;
+        }
+    }
+}
+void CDDLModule::processConstant(const float* pInput, float* pOutput, int numSamples, float fDelay)
+{
+    float pCoeffs[DDL_MAX_TAPS];
+    int nTaps=tapCount();
+    int nBase;
+    computeTaps(&fDelay,&nBase,pCoeffs,1);
+    float fDry=1.0f-m_fWetLevel;
+    float pTaps[DDL_CHUNK];
+    
+    // with feedback a chunk may only read samples written before it
+    int nMaxChunk=DDL_CHUNK;
+    if(m_fFeedback!=0)
+        nMaxChunk=std::min(nMaxChunk,nBase);
+    if(nMaxChunk<=0)
+    {
+        processRamped(pInput,pOutput,numSamples,fDelay,fDelay);
+        return;
+    }
+    
+    while(numSamples>0)
+    {
+        int nChunk=std::min(numSamples,nMaxChunk);
+        if(m_fFeedback==0)
+        {
+            // input first, so delays under a chunk read this chunk's samples
+            int nFirst=std::min(nChunk,m_nBufferSize-m_nWriteIndex);
+            memcpy(&m_pBuffer[m_nWriteIndex],pInput,nFirst*sizeof(float));
+            memcpy(m_pBuffer,pInput+nFirst,(nChunk-nFirst)*sizeof(float));
+            readTaps(pTaps,m_nWriteIndex-nBase,pCoeffs,nTaps,nChunk);
+        }
+        else
+        {
+            readTaps(pTaps,m_nWriteIndex-nBase,pCoeffs,nTaps,nChunk);
+            for(int i=0;i<nChunk;i++)
+                m_pBuffer[(m_nWriteIndex+i)&m_nBufferMask]=pInput[i]+m_fFeedback*pTaps[i];
+        }
+        for(int i=0;i<nChunk;i++)
+            pOutput[i]=m_fWetLevel*pTaps[i]+fDry*pInput[i];
+        
+        m_nWriteIndex=(m_nWriteIndex+nChunk)&m_nBufferMask;
+        pInput+=nChunk;
+        pOutput+=nChunk;
+        numSamples-=nChunk;
+    }
+}
+template<int Taps>
+void CDDLModule::processTaps(const float* pInput, float* pOutput, int numSamples, float fStart, float fEnd)
+{
+    // coefficients a chunk at a time, then one pass of Taps-long dot products, contiguous
+    // unless the taps straddle the start of the buffer
+    float fStep=(fEnd-fStart)/numSamples;
+    float fDry=1.0f-m_fWetLevel;
+    float pDelays[DDL_CHUNK];
+    int pBase[DDL_CHUNK];
+    float pCoeffs[Taps*DDL_CHUNK];
+    int nWrite=m_nWriteIndex;
+    for(int nDone=0;nDone<numSamples;)
+    {
+        int nChunk=std::min(numSamples-nDone,DDL_CHUNK);
+        for(int i=0;i<nChunk;i++)
+            pDelays[i]=fStart+fStep*(nDone+i+1);
+        if(nDone+nChunk==numSamples)
+            pDelays[nChunk-1]=fEnd;
+        computeTaps(pDelays,pBase,pCoeffs,nChunk);
+        
+        for(int i=0;i<nChunk;i++)
+        {
+            float xn=pInput[nDone+i];
+            m_pBuffer[nWrite]=xn;
+            int nRead=nWrite-pBase[i];
+            const float* pTapCoeffs=&pCoeffs[i*Taps];
+            float fOut=0;
+            if(nRead>=Taps-1)
+            {
+                const float* pTaps=&m_pBuffer[nRead];
+                for(int k=0;k<Taps;k++)
+                    fOut+=pTapCoeffs[k]*pTaps[-k];
+            }
+            else
+            {
+                for(int k=0;k<Taps;k++)
+                    fOut+=pTapCoeffs[k]*m_pBuffer[(nRead-k)&m_nBufferMask];
+            }
+            
+            m_pBuffer[nWrite]=xn+m_fFeedback*fOut;
+            pOutput[nDone+i]=m_fWetLevel*fOut+fDry*xn;
+            nWrite=(nWrite+1)&m_nBufferMask;
+        }
+        nDone+=nChunk;
+    }
+    m_nWriteIndex=nWrite;
+}
+void CDDLModule::processRamped(const float* pInput, float* pOutput, int numSamples, float fStart, float fEnd)
+{
+    switch(tapCount())
+    {
+        case 4: processTaps<4>(pInput,pOutput,numSamples,fStart,fEnd); return;
+        case 6: processTaps<6>(pInput,pOutput,numSamples,fStart,fEnd); return;
+        case DDL_SINC_TAPS: processTaps<DDL_SINC_TAPS>(pInput,pOutput,numSamples,fStart,fEnd); return;
+        default: break;
+    }
+    
+    float fStep=(fEnd-fStart)/numSamples;
+    float fDry=1.0f-m_fWetLevel;
+    int nWrite=m_nWriteIndex;
+    for(int i=0;i<numSamples;i++)
+    {
+        float fDelay=(i==numSamples-1)?fEnd:fStart+fStep*(i+1);
+        int nDelay=(int)fDelay;
+        float fFrac=fDelay-nDelay;
+        float xn=pInput[i];
+        
+        // written ahead of the read, so a delay under one sample reads the current input
+        m_pBuffer[nWrite]=xn;
+        float yn=m_pBuffer[(nWrite-nDelay)&m_nBufferMask];
+        float yn_1=m_pBuffer[(nWrite-nDelay-1)&m_nBufferMask];
+        float fOut=yn+fFrac*(yn_1-yn);
+        
+        m_pBuffer[nWrite]=xn+m_fFeedback*fOut;
+        pOutput[i]=m_fWetLevel*fOut+fDry*xn;
+        nWrite=(nWrite+1)&m_nBufferMask;
+    }
+    m_nWriteIndex=nWrite;
+}
+void CDDLModule::processAllpass(const float* pInput, float* pOutput, int numSamples, float fStart, float fEnd)
+{
+    // first-order Thiran allpass after an integer delay, its own delay kept in 0.5..1.5 samples
+    float fStep=(fEnd-fStart)/numSamples;
+    float fDry=1.0f-m_fWetLevel;
+    int nWrite=m_nWriteIndex;
+    float fState=m_fAllpassState;
+    for(int i=0;i<numSamples;i++)
+    {
+        float fDelay=(i==numSamples-1)?fEnd:fStart+fStep*(i+1);
+        int nDelay=(int)(fDelay-0.5f);
+        float d=fDelay-nDelay;
+        float a=(1.0f-d)/(1.0f+d);
+        float xn=pInput[i];
+        
+        m_pBuffer[nWrite]=xn;
+        float x0=m_pBuffer[(nWrite-nDelay)&m_nBufferMask];
+        float x1=m_pBuffer[(nWrite-nDelay-1)&m_nBufferMask];
+        float fOut=a*(x0-fState)+x1;
+        fState=fOut;
+        
+        m_pBuffer[nWrite]=xn+m_fFeedback*fOut;
+        pOutput[i]=m_fWetLevel*fOut+fDry*xn;
+        nWrite=(nWrite+1)&m_nBufferMask;
+    }
+    m_fAllpassState=fState;
+    m_nWriteIndex=nWrite;
+}
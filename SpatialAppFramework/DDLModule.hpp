@@ -13,19 +13,76 @@
 #include<stdlib.h>
 #include <cstring>
 
+// longest run processBlock() reads or writes in one go
+#define DDL_CHUNK 64
+// windowed-sinc interpolator: taps, table resolution and Kaiser beta
+#define DDL_SINC_TAPS 8
+#define DDL_SINC_PHASES 512
+#define DDL_SINC_BETA 4.5
+#define DDL_MAX_TAPS DDL_SINC_TAPS
 
+/*
+	Fractional delay interpolators for processBlock(), cheapest first. Cost per sample on x86
+	(-O2) for a constant / a ramped delay. Error is the worst deviation from an ideal delay over
+	all fractions, relative to the signal, at 48 kHz up to 8 kHz / up to 16 kHz:
+	Linear      2 taps      0.9 /  2.9 ns   -17.5 / -6.0 dB
+	Lagrange3   4 taps      1.3 /  7.1 ns   -31.8 / -10.1 dB
+	Lagrange5   6 taps      1.7 / 12.9 ns   -45.3 / -13.7 dB
+	Thiran      allpass     3.7 /  3.8 ns   -18.1 / -3.9 dB
+	Sinc        8 taps      1.9 / 10.9 ns   -46.1 / -33.4 dB
+	Linear and Lagrange lose level towards Nyquist. The sinc stays within 2% to 16 kHz. Thiran keeps
+	its level but gets its phase right only at low frequencies, and it rings if the delay moves
+	quickly, so it suits fixed or slowly moving delays. Each one needs a minimum delay to keep
+	its taps in the past; see minimumDelay().
+ */
+enum DDLInterpolation
+{
+    DDLInterpolationLinear,
+    DDLInterpolationLagrange3,
+    DDLInterpolationLagrange5,
+    DDLInterpolationThiran,
+    DDLInterpolationSinc
+};
 
+/*
+	CDDLModule
+	Fractional delay line with feedback and a wet/dry mix. processAudio() runs one sample at a
+	time and supports the external feedback/xn hooks; processBlock() runs a whole block and is
+	the one to use per source (ITD, Doppler).
+	The buffer is a power of two long so the block path wraps with a mask.
+ */
 class CDDLModule
 {
 public:
     CDDLModule();
+    ~CDDLModule();
     void cookVariables();
     void resetDelay();
     void prepare();
+    // Buffer for delays up to nMaxDelay samples, instead of two seconds
+    void prepare(int nMaxDelay);
     float m_fFeedback;
     float m_fWetLevel;
     float m_fDelayInSamples;
     float processAudio(float fInput);
+    // Processes numSamples at once, same output as calling processAudio() for each of them.
+    // The delay ramps linearly from where the last block ended to m_fDelayInSamples over the
+    // block; if it did not change, the taps are read with vector code. pInput and pOutput may
+    // be the same buffer. With the external feedback/xn hooks on it falls back to processAudio().
+    void processBlock(const float* pInput, float* pOutput, int numSamples);
+    // Split block access for delay lines inside a feedback loop (FDN): readBlock() reads the
+    // next numSamples outputs at the current delay, writeBlock() then writes as many inputs.
+    // The delay has to be at least numSamples plus minimumDelay(); the delay does not ramp.
+    void readBlock(float* pOutput, int numSamples);
+    void writeBlock(const float* pInput, int numSamples);
+    // Multi-tap access: reads the block just written (by writeBlock() or processBlock()) at a
+    // delay ramping from fStartDelay to fEndDelay over it, without touching the line. Any number
+    // of taps can be read per block. Thiran falls back to linear here.
+    void readTap(float fStartDelay, float fEndDelay, float* pOutput, int numSamples);
+    // interpolator processBlock() uses, a DDLInterpolation. processAudio() is always linear.
+    int m_nInterpolation;
+    // shortest delay the interpolator can produce, shorter delays are clamped to it
+    float minimumDelay() const;
     int m_nSampleRate;
     float m_fExternalXn;
     bool m_bUseExternalFeedback;
@@ -39,8 +96,24 @@ public:
     
 private:
     
+    float clampDelay(float fDelay);
+    int tapCount() const;
+    // base (youngest tap's delay) and coefficients per delay, tap k of sample i at pCoeffs[i*taps+k]
+    void computeTaps(const float* pDelays, int* pBase, float* pCoeffs, int numSamples) const;
+    void processConstant(const float* pInput, float* pOutput, int numSamples, float fDelay);
+    void processRamped(const float* pInput, float* pOutput, int numSamples, float fStart, float fEnd);
+    template<int Taps>
+    void processTaps(const float* pInput, float* pOutput, int numSamples, float fStart, float fEnd);
+    void processAllpass(const float* pInput, float* pOutput, int numSamples, float fStart, float fEnd);
+    void readTaps(float* pOutput, int nReadIndex, const float* pCoeffs, int nTaps, int numSamples);
+    
     float* m_pBuffer;
     int m_nReadIndex,m_nWriteIndex,m_nBufferSize;
+    int m_nBufferMask;
+    // delay at the end of the last block, where the next block's ramp starts
+    float m_fBlockDelay;
+    float m_fAllpassState;
+    const float* m_pSincTable;
     
     
 
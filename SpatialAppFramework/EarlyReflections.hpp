@@ -0,0 +1,399 @@
+//
+//  EarlyReflections.hpp
+//  Capstone
+//
+
+#ifndef EarlyReflections_hpp
+#define EarlyReflections_hpp
+
+#include "AmbisonicRenderer.hpp"
+#include "DDLModule.hpp"
+#include "PropagationDelay.hpp"
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <cmath>
+#include <algorithm>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+
+#define EARLY_MAX_SOURCES 16
+#define EARLY_MAX_ORDER 3
+// image sources up to third order: 6 + 18 + 38
+#define EARLY_MAX_PATHS 62
+#define EARLY_POLL_MS 10
+// how far a source has to move before its paths are computed again, in metres
+#define EARLY_MOVE_THRESHOLD 0.01f
+#define EARLY_AMBISONIC_ORDER 1
+// largest room edge setRoom() accepts, in metres; the delay lines are sized for its paths
+#define EARLY_MAX_ROOM_SIZE 40.0f
+
+// One reflection as heard by the listener
+struct ReflectionPath {
+    // after the direct sound, in samples
+    float fDelay;
+    float fGain;
+    float fAzimuth;
+    float fElevation;
+};
+
+// All of a source's reflections. Path k is always the same image source, so a path's
+// delay and gain can be ramped from one set to the next.
+struct ReflectionPaths {
+    int nCount;
+    ReflectionPath pPaths[EARLY_MAX_PATHS];
+};
+
+struct RoomSettings {
+    // x front, y left, z up, in metres; the room spans 0..size on each axis
+    float pSize[3];
+    float pListener[3];
+    // fraction of the energy each wall absorbs
+    float fAbsorption;
+    int nOrder;
+};
+
+/*
+	ReflectionMailbox
+	Triple buffer handing one source's paths from the control thread to the render thread.
+	Neither side ever waits; the render thread always gets the newest complete set.
+ */
+class ReflectionMailbox {
+public:
+
+    ReflectionMailbox() : m_nMiddle(1) {
+        m_nBack = 0;
+        m_nFront = 2;
+        for(int i = 0; i < 3; i++)
+            m_pSlots[i].nCount = 0;
+    }
+
+    // control thread
+    ReflectionPaths& back() { return m_pSlots[m_nBack]; }
+    void publish() {
+        m_nBack = m_nMiddle.exchange(m_nBack | FRESH) & INDEX;
+    }
+
+    // render thread, true if a new set arrived
+    bool fetch() {
+        if(!(m_nMiddle.load(std::memory_order_acquire) & FRESH))
+            return false;
+        m_nFront = m_nMiddle.exchange(m_nFront) & INDEX;
+        return true;
+    }
+    const ReflectionPaths& front() const { return m_pSlots[m_nFront]; }
+
+    // only while neither thread is running
+    void clear() {
+        for(int i = 0; i < 3; i++)
+            m_pSlots[i].nCount = 0;
+        m_nMiddle = m_nMiddle & INDEX;
+    }
+
+private:
+    enum { INDEX = 3, FRESH = 4 };
+    ReflectionPaths m_pSlots[3];
+    std::atomic<int> m_nMiddle;
+    int m_nBack;
+    int m_nFront;
+};
+
+/*
+	EarlyReflections
+	Early reflections of a shoebox room from image sources, up to third order.
+	A control thread polls the sources' positions and recomputes the paths (delay, gain,
+	direction) of only those that moved or all of them when the room changed. It never runs on
+	the render thread, is only started once the reflections are switched on and waits without
+	polling while they are off.
+	On the render thread each source is written once into its own delay line. Every path is
+	one tap on that line, ramped from its last delay and gain to the new ones, and encoded into
+	a first-order ambisonic bus. That one bus is decoded binaurally, so the convolution cost
+	does not depend on the number of sources or paths.
+	Delays are relative to the direct sound, so the sources' inputs should be what the direct
+	path is fed (with or without the propagation delay).
+ */
+class EarlyReflections {
+public:
+
+    EarlyReflections() : m_nRoomGeneration(1), m_bStopping(false) {
+        m_bActive = false;
+        m_nSources = 0;
+        m_fSampleRate = 44100.0f;
+        m_fMaxDelay = 0.0f;
+        RoomSettings room = {{6.0f, 4.0f, 3.0f}, {2.5f, 2.2f, 1.6f}, 0.3f, 2};
+        m_Room = room;
+        for(int s = 0; s < EARLY_MAX_SOURCES; s++) {
+            m_pPosted[s][0] = 0.0f;
+            m_pPosted[s][1] = 0.0f;
+            m_pPosted[s][2] = -1.0f;
+        }
+    }
+
+    ~EarlyReflections() {
+        stop();
+    }
+
+    // Builds the decoder and the delay lines, and starts the control thread if the reflections
+    // are on. Not real-time safe.
+    void init(const HRIRGrid& grid, float sampleRate, int blockSize, int numSources) {
+        stop();
+        m_fSampleRate = sampleRate;
+        m_nSources = std::min(numSources, int(EARLY_MAX_SOURCES));
+        m_Renderer.init(grid, EARLY_AMBISONIC_ORDER, blockSize, m_nSources * EARLY_MAX_PATHS);
+        m_pTap.assign(blockSize, 0.0f);
+        // A path is never longer than its image is from the source, for a source in the room at
+        // most EARLY_MAX_ORDER + 1 room edges along each axis
+        m_fMaxDelay = ceilf(sqrtf(3.0f) * (EARLY_MAX_ORDER + 1) * EARLY_MAX_ROOM_SIZE * sampleRate / SPEED_OF_SOUND);
+        for(int s = 0; s < m_nSources; s++) {
+            m_pLine[s].m_nSampleRate = int(sampleRate);
+            // readTap() reaches a block further back than the delay
+            m_pLine[s].prepare(int(m_fMaxDelay) + blockSize);
+            m_pMailbox[s].clear();
+            m_pActivePaths[s] = 0;
+            m_pPosted[s][2] = -1.0f;
+        }
+
+        m_bStopping = false;
+        if(m_bActive)
+            m_Control = std::thread(&EarlyReflections::control, this);
+    }
+    
+    // Main thread: whether the reflections are rendered, so whether the control thread polls
+    void setActive(bool active) {
+        {
+            std::lock_guard<std::mutex> lock(m_WakeMutex);
+            m_bActive = active;
+        }
+        if(active && !m_Control.joinable() && m_nSources > 0)
+            m_Control = std::thread(&EarlyReflections::control, this);
+        else
+            m_Wake.notify_one();
+    }
+
+    // Room size (1 to EARLY_MAX_ROOM_SIZE metres) and listener position, wall absorption (0 to 1)
+    // and reflection order (1 to 3). Main thread; the paths follow within a poll.
+    void setRoom(const RoomSettings& room) {
+        std::lock_guard<std::mutex> lock(m_RoomMutex);
+        m_Room = room;
+        for(int a = 0; a < 3; a++) {
+            m_Room.pSize[a] = std::min(std::max(room.pSize[a], 1.0f), EARLY_MAX_ROOM_SIZE);
+            m_Room.pListener[a] = std::min(std::max(room.pListener[a], 0.0f), m_Room.pSize[a]);
+        }
+        m_Room.fAbsorption = std::min(std::max(room.fAbsorption, 0.0f), 1.0f);
+        m_Room.nOrder = std::min(std::max(room.nOrder, 1), int(EARLY_MAX_ORDER));
+        m_nRoomGeneration++;
+    }
+
+    RoomSettings room() {
+        std::lock_guard<std::mutex> lock(m_RoomMutex);
+        return m_Room;
+    }
+
+    // Render thread, every block: where a source is relative to the listener (degrees, HRIRGrid
+    // convention, and metres). The coordinates are stored one by one; a set mixing two blocks is
+    // corrected by the next poll.
+    void setSourcePosition(int source, float azimuth, float elevation, float distance) {
+        m_pPosted[source][0].store(azimuth, std::memory_order_relaxed);
+        m_pPosted[source][1].store(elevation, std::memory_order_relaxed);
+        m_pPosted[source][2].store(distance, std::memory_order_relaxed);
+    }
+
+    void setHeadOrientation(const Quaternion& head) {
+        m_Renderer.setHeadOrientation(head);
+    }
+
+    // Forgets the sources' past input, e.g. after the reflections were switched off for a while
+    void reset() {
+        for(int s = 0; s < m_nSources; s++)
+            m_pLine[s].resetDelay();
+    }
+
+    // Renders every source's reflections into the two ears (overwriting them)
+    void process(const float* const* pInputs, int numSources, float* pOutLeft, float* pOutRight, int numSamples) {
+        m_Renderer.clearBus();
+        for(int s = 0; s < numSources && s < m_nSources; s++) {
+            m_pLine[s].writeBlock(pInputs[s], numSamples);
+            if(m_pMailbox[s].fetch())
+                adoptPaths(s);
+
+            const ReflectionPaths& paths = m_pMailbox[s].front();
+            for(int k = 0; k < paths.nCount; k++) {
+                const ReflectionPath& target = paths.pPaths[k];
+                ReflectionPath& current = m_pCurrent[s][k];
+                if(current.fGain == 0.0f && target.fGain == 0.0f) {
+                    current = target;
+                    continue;
+                }
+                float* pTap = &m_pTap[0];
+                m_pLine[s].readTap(current.fDelay, target.fDelay, pTap, numSamples);
+
+                float gain = current.fGain;
+                float step = (target.fGain - gain) / float(numSamples);
+                for(int i = 0; i < numSamples; i++) {
+                    gain += step;
+                    pTap[i] *= gain;
+                }
+
+                SpatialSource reflection = {pTap, target.fAzimuth, target.fElevation, 1.0f};
+                m_Renderer.encode(reflection, s * EARLY_MAX_PATHS + k, numSamples);
+                current = target;
+            }
+        }
+        m_Renderer.renderBus(pOutLeft, pOutRight, numSamples);
+    }
+
+private:
+
+    // Paths that were not there before fade in from silence at their new delay
+    void adoptPaths(int source) {
+        const ReflectionPaths& paths = m_pMailbox[source].front();
+        for(int k = m_pActivePaths[source]; k < paths.nCount; k++) {
+            m_pCurrent[source][k] = paths.pPaths[k];
+            m_pCurrent[source][k].fGain = 0.0f;
+        }
+        m_pActivePaths[source] = paths.nCount;
+    }
+
+    void stop() {
+        if(!m_Control.joinable())
+            return;
+        {
+            std::lock_guard<std::mutex> lock(m_WakeMutex);
+            m_bStopping = true;
+        }
+        m_Wake.notify_one();
+        m_Control.join();
+    }
+
+    // Control thread: recomputes the paths of sources that moved, or of all after a room change.
+    // Parked until woken while the reflections are off.
+    void control() {
+        RoomSettings room = {};
+        unsigned roomGeneration = 0;
+        float lastPosition[EARLY_MAX_SOURCES][3];
+        bool computed[EARLY_MAX_SOURCES] = {};
+
+        std::unique_lock<std::mutex> lock(m_WakeMutex);
+        while(!m_bStopping) {
+            if(m_bActive)
+                m_Wake.wait_for(lock, std::chrono::milliseconds(EARLY_POLL_MS));
+            else
+                m_Wake.wait(lock);
+            if(m_bStopping)
+                break;
+            if(!m_bActive)
+                continue;
+            lock.unlock();
+
+            bool roomChanged = false;
+            if(m_nRoomGeneration.load() != roomGeneration) {
+                std::lock_guard<std::mutex> roomLock(m_RoomMutex);
+                room = m_Room;
+                roomGeneration = m_nRoomGeneration.load();
+                roomChanged = true;
+            }
+
+            for(int s = 0; s < m_nSources; s++) {
+                float distance = m_pPosted[s][2].load(std::memory_order_relaxed);
+                if(distance < 0.0f)
+                    continue;
+                float position[3];
+                sourceInRoom(room, m_pPosted[s][0].load(std::memory_order_relaxed), m_pPosted[s][1].load(std::memory_order_relaxed), distance, position);
+                if(computed[s] && !roomChanged && !hasMoved(lastPosition[s], position))
+                    continue;
+
+                computePaths(room, position, m_pMailbox[s].back());
+                m_pMailbox[s].publish();
+                memcpy(lastPosition[s], position, sizeof(position));
+                computed[s] = true;
+            }
+
+            lock.lock();
+        }
+    }
+
+    static bool hasMoved(const float* a, const float* b) {
+        float dx = a[0] - b[0], dy = a[1] - b[1], dz = a[2] - b[2];
+        return dx*dx + dy*dy + dz*dz > EARLY_MOVE_THRESHOLD * EARLY_MOVE_THRESHOLD;
+    }
+
+    static void sourceInRoom(const RoomSettings& room, float azimuth, float elevation, float distance, float* pPosition) {
+        float az = azimuth * float(M_PI) / 180.0f;
+        float el = elevation * float(M_PI) / 180.0f;
+        pPosition[0] = room.pListener[0] + distance * cosf(el) * cosf(az);
+        pPosition[1] = room.pListener[1] + distance * cosf(el) * sinf(az);
+        pPosition[2] = room.pListener[2] + distance * sinf(el);
+    }
+
+    // Image n along an axis: the source mirrored |n| times, on the far side for odd n
+    static float imageCoordinate(int n, float size, float source) {
+        return (n & 1) ? (n + 1) * size - source : n * size + source;
+    }
+
+    // Every image up to EARLY_MAX_ORDER, always in the same order so path k keeps its image
+    // whatever the room's order; those above it are silent
+    void computePaths(const RoomSettings& room, const float* pSource, ReflectionPaths& paths) {
+        float reflectance = sqrtf(1.0f - room.fAbsorption);
+        float dx = pSource[0] - room.pListener[0], dy = pSource[1] - room.pListener[1], dz = pSource[2] - room.pListener[2];
+        float direct = sqrtf(dx*dx + dy*dy + dz*dz);
+        float samplesPerMetre = m_fSampleRate / SPEED_OF_SOUND;
+
+        int count = 0;
+        for(int nx = -EARLY_MAX_ORDER; nx <= EARLY_MAX_ORDER; nx++) {
+            for(int ny = -EARLY_MAX_ORDER; ny <= EARLY_MAX_ORDER; ny++) {
+                for(int nz = -EARLY_MAX_ORDER; nz <= EARLY_MAX_ORDER; nz++) {
+                    int reflections = abs(nx) + abs(ny) + abs(nz);
+                    if(reflections == 0 || reflections > EARLY_MAX_ORDER)
+                        continue;
+                    float vx = imageCoordinate(nx, room.pSize[0], pSource[0]) - room.pListener[0];
+                    float vy = imageCoordinate(ny, room.pSize[1], pSource[1]) - room.pListener[1];
+                    float vz = imageCoordinate(nz, room.pSize[2], pSource[2]) - room.pListener[2];
+                    float distance = sqrtf(vx*vx + vy*vy + vz*vz);
+
+                    ReflectionPath& path = paths.pPaths[count++];
+                    float delay = std::max(distance - direct, 0.0f) * samplesPerMetre;
+                    path.fDelay = std::min(delay, m_fMaxDelay);
+                    // same 1/r law as the direct path, which stops at one metre; a source far
+                    // outside the room can have paths longer than the line, those are left out
+                    bool audible = reflections <= room.nOrder && delay <= m_fMaxDelay;
+                    path.fGain = audible ? powf(reflectance, float(reflections)) / std::max(distance, 1.0f) : 0.0f;
+                    path.fAzimuth = atan2f(vy, vx) * 180.0f / float(M_PI);
+                    path.fElevation = asinf(std::min(std::max(vz / std::max(distance, 1e-6f), -1.0f), 1.0f)) * 180.0f / float(M_PI);
+                }
+            }
+        }
+        paths.nCount = count;
+    }
+
+    int m_nSources;
+    float m_fSampleRate;
+    // longest path the delay lines hold, in samples
+    float m_fMaxDelay;
+
+    // render thread
+    CDDLModule m_pLine[EARLY_MAX_SOURCES];
+    ReflectionPath m_pCurrent[EARLY_MAX_SOURCES][EARLY_MAX_PATHS];
+    int m_pActivePaths[EARLY_MAX_SOURCES];
+    std::vector<float> m_pTap;
+    AmbisonicRenderer m_Renderer;
+
+    // between the threads
+    std::atomic<float> m_pPosted[EARLY_MAX_SOURCES][3];
+    ReflectionMailbox m_pMailbox[EARLY_MAX_SOURCES];
+
+    // room, written by the main thread
+    std::mutex m_RoomMutex;
+    RoomSettings m_Room;
+    std::atomic<unsigned> m_nRoomGeneration;
+
+    // control thread, and whether it polls (guarded by m_WakeMutex)
+    std::atomic<bool> m_bStopping;
+    bool m_bActive;
+    std::mutex m_WakeMutex;
+    std::condition_variable m_Wake;
+    std::thread m_Control;
+};
+
+#endif /* EarlyReflections_hpp */
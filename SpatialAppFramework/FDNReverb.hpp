@@ -0,0 +1,172 @@
+//
+//  FDNReverb.hpp
+//  Capstone
+//
+
+#ifndef FDNReverb_hpp
+#define FDNReverb_hpp
+
+#include "DDLModule.hpp"
+#include "VectorOps.hpp"
+#include <vector>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+#define FDN_MIN_LINES 8
+#define FDN_MAX_LINES 16
+// the line lengths are primes spread geometrically between these
+#define FDN_SHORTEST_LINE_MS 29.0f
+#define FDN_LONGEST_LINE_MS 79.0f
+
+/*
+	FDNReverb
+	Late reverberation shared by all sources: a feedback delay network of 8 or 16 lines fed from
+	one send bus, so its cost does not depend on how many sources send to it.
+	The lines are CDDLModules read and written a chunk at a time (the shortest line is far longer
+	than a chunk, so nothing read in a chunk was written in it). The feedback matrix is a
+	normalised Hadamard matrix applied as a fast Walsh-Hadamard transform, butterflies over
+	whole chunks. Each line has its own decay gain for the set reverb time and a one-pole
+	lowpass for high-frequency damping. The two ears tap the lines with orthogonal sign
+	patterns, so they are decorrelated.
+ */
+class FDNReverb {
+public:
+
+    FDNReverb() {
+        m_nLines = FDN_MIN_LINES;
+        m_fSampleRate = 44100.0f;
+        m_fDecayTime = 1.5f;
+        m_fDamping = 0.3f;
+        memset(m_pLength, 0, sizeof(m_pLength));
+        memset(m_pGain, 0, sizeof(m_pGain));
+        memset(m_pDampState, 0, sizeof(m_pDampState));
+    }
+
+    // Allocates all FDN_MAX_LINES lines for this sample rate. Not real-time safe.
+    void init(float sampleRate, int numLines) {
+        m_fSampleRate = sampleRate;
+        int maxLength = int(FDN_LONGEST_LINE_MS * 0.001f * sampleRate) + 64;
+        for(int i = 0; i < FDN_MAX_LINES; i++) {
+            m_pLine[i].m_nSampleRate = int(sampleRate);
+            m_pLine[i].m_nInterpolation = DDLInterpolationLinear;
+            m_pLine[i].prepare(maxLength);
+        }
+        m_pTaps.assign(FDN_MAX_LINES * DDL_CHUNK, 0.0f);
+        setLines(numLines);
+    }
+
+    static int clampLineCount(int numLines) {
+        return numLines > FDN_MIN_LINES ? FDN_MAX_LINES : FDN_MIN_LINES;
+    }
+
+    int lines() const { return m_nLines; }
+
+    // 8 or 16 lines. Empties the network; allocates nothing, so it may run on the render thread.
+    void setLines(int numLines) {
+        m_nLines = clampLineCount(numLines);
+        for(int i = 0; i < m_nLines; i++) {
+            float ms = FDN_SHORTEST_LINE_MS * powf(FDN_LONGEST_LINE_MS / FDN_SHORTEST_LINE_MS, float(i) / (m_nLines - 1));
+            m_pLength[i] = nextPrime(int(ms * 0.001f * m_fSampleRate));
+            m_pLine[i].m_fDelayInSamples = float(m_pLength[i]);
+        }
+        updateGains();
+        reset();
+    }
+
+    // Time for the reverb to decay by 60 dB (at low frequencies)
+    void setDecayTime(float seconds) {
+        seconds = std::max(seconds, 0.05f);
+        if(seconds == m_fDecayTime)
+            return;
+        m_fDecayTime = seconds;
+        updateGains();
+    }
+
+    // 0 to 1, how much faster high frequencies die away
+    void setDamping(float damping) {
+        m_fDamping = std::min(std::max(damping, 0.0f), 0.95f);
+    }
+
+    void reset() {
+        for(int i = 0; i < FDN_MAX_LINES; i++)
+            m_pLine[i].resetDelay();
+        memset(m_pDampState, 0, sizeof(m_pDampState));
+    }
+
+    // Runs the send bus through the network and adds the result to both ears
+    void process(const float* pSend, float* pOutLeft, float* pOutRight, int numSamples) {
+        for(int done = 0; done < numSamples; done += DDL_CHUNK) {
+            int chunk = std::min(numSamples - done, int(DDL_CHUNK));
+            processChunk(pSend + done, pOutLeft + done, pOutRight + done, chunk);
+        }
+    }
+
+private:
+
+    void processChunk(const float* pSend, float* pOutLeft, float* pOutRight, int numSamples) {
+        float outputGain = 1.0f / sqrtf(float(m_nLines));
+        for(int i = 0; i < m_nLines; i++) {
+            float* pTap = tap(i);
+            m_pLine[i].readBlock(pTap, numSamples);
+
+            // left taps +,-,+,-,... right taps +,+,-,-,...
+            vectorMultiplyAccumulate(pOutLeft, pTap, (i & 1) ? -outputGain : outputGain, numSamples);
+            vectorMultiplyAccumulate(pOutRight, pTap, (i & 2) ? -outputGain : outputGain, numSamples);
+        }
+
+        // damping and decay, the matrix normalisation folded into the gain. Lines innermost,
+        // so their one-pole recursions run side by side instead of one after another.
+        float feedback = m_fDamping;
+        for(int n = 0; n < numSamples; n++) {
+            for(int i = 0; i < m_nLines; i++) {
+                float x = m_pTaps[i * DDL_CHUNK + n];
+                m_pDampState[i] = x + feedback * (m_pDampState[i] - x);
+                m_pTaps[i * DDL_CHUNK + n] = m_pGain[i] * m_pDampState[i];
+            }
+        }
+
+        // Hadamard matrix as log2(lines) stages of butterflies between lines
+        for(int half = 1; half < m_nLines; half *= 2)
+            for(int i = 0; i < m_nLines; i += 2 * half)
+                for(int j = i; j < i + half; j++)
+                    vectorButterfly(tap(j), tap(j + half), numSamples);
+
+        for(int i = 0; i < m_nLines; i++) {
+            vectorAdd(tap(i), pSend, numSamples);
+            m_pLine[i].writeBlock(tap(i), numSamples);
+        }
+    }
+
+    // g = 10^(-3 length / (T60 fs)) per line, times 1/sqrt(lines) for the unnormalised transform
+    void updateGains() {
+        float norm = 1.0f / sqrtf(float(m_nLines));
+        for(int i = 0; i < m_nLines; i++)
+            m_pGain[i] = norm * powf(10.0f, -3.0f * m_pLength[i] / (m_fDecayTime * m_fSampleRate));
+    }
+
+    static int nextPrime(int n) {
+        for(n = std::max(n, 2); ; n++) {
+            bool prime = true;
+            for(int d = 2; d * d <= n && prime; d++)
+                prime = (n % d) != 0;
+            if(prime)
+                return n;
+        }
+    }
+
+    float* tap(int line) { return &m_pTaps[line * DDL_CHUNK]; }
+
+    int m_nLines;
+    float m_fSampleRate;
+    float m_fDecayTime;
+    float m_fDamping;
+    CDDLModule m_pLine[FDN_MAX_LINES];
+    int m_pLength[FDN_MAX_LINES];
+    float m_pGain[FDN_MAX_LINES];
+    float m_pDampState[FDN_MAX_LINES];
+    // line-major, one chunk per line
+    std::vector<float> m_pTaps;
+};
+
+#endif /* FDNReverb_hpp */
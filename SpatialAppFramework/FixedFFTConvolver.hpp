@@ -0,0 +1,303 @@
+//
+//  FixedFFTConvolver.hpp
+//  Capstone
+//
+
+#ifndef _FFTCONVOLVER_FIXEDFFTCONVOLVER_H
+#define _FFTCONVOLVER_FIXEDFFTCONVOLVER_H
+
+#include "AudioFFT.hpp"
+#include "Utilities.hpp"
+
+#include <cassert>
+#include <cmath>
+
+#if defined (FFTCONVOLVER_USE_SSE)
+  #include <xmmintrin.h>
+#endif
+
+
+namespace fftconvolver
+{
+
+/**
+* @class FixedFFTConvolver
+* @brief FFTConvolver with the block size and the number of segments fixed at compile time
+*
+* Same algorithm and results as FFTConvolver (uniformly partitioned, zero latency,
+* no allocation or locking after init()), for configurations known up front, e.g.
+* FixedFFTConvolver<128, 4> for 128-sample blocks and 512-tap impulse responses.
+*
+* - All sizes are constants, so the multiply-accumulate loops have fixed trip
+*   counts the compiler can unroll and vectorize.
+*
+* - The tail segments are accumulated bin by bin across all segments, so every
+*   output bin is written once per block instead of once per segment.
+*
+* - The input spectra ring has a power-of-two number of slots and is indexed with
+*   a mask instead of a modulo (unused slots when SegCount is not a power of two).
+*
+* - Buffers are members and the per-call scratch lives on the stack, so a
+*   convolver is a single allocation (or none, as a member of something else).
+*/
+template<size_t BlockSize, size_t SegCount>
+class FixedFFTConvolver
+{
+public:
+  enum
+  {
+    SegSize = 2 * BlockSize,
+    ComplexSize = BlockSize + 1,
+    // rows of the spectra tables are padded so every row stays 16-byte aligned
+    ComplexStride = BlockSize + 4,
+    RingSize = (SegCount <= 1) ? 1 :
+               (SegCount <= 2) ? 2 :
+               (SegCount <= 4) ? 4 :
+               (SegCount <= 8) ? 8 :
+               (SegCount <= 16) ? 16 :
+               (SegCount <= 32) ? 32 :
+               (SegCount <= 64) ? 64 : 128,
+    RingMask = RingSize - 1,
+    MaxIRLength = BlockSize * SegCount
+  };
+
+  static_assert(BlockSize >= 4 && (BlockSize & (BlockSize - 1)) == 0, "BlockSize has to be a power of two");
+  static_assert(SegCount >= 1 && SegCount <= 128, "SegCount has to be between 1 and 128");
+
+  FixedFFTConvolver() :
+    _fft(),
+    _current(0),
+    _inputBufferFill(0),
+    _initialized(false)
+  {
+    clearBuffers();
+  }
+
+  virtual ~FixedFFTConvolver()
+  {
+  }
+
+  /**
+  * @brief Initializes the convolver
+  * @param ir The impulse response
+  * @param irLen Length of the impulse response, at most MaxIRLength (longer ones are truncated)
+  * @return true: Success - false: Failed
+  */
+  bool init(const Sample* ir, size_t irLen)
+  {
+    reset();
+    assert(irLen <= MaxIRLength);
+    irLen = std::min(irLen, static_cast<size_t>(MaxIRLength));
+
+    _fft.init(SegSize);
+
+    alignas(16) Sample fftBuffer[SegSize];
+    for (size_t i=0; i<SegCount; ++i)
+    {
+      const size_t offset = i * BlockSize;
+      const size_t sizeCopy = (offset < irLen) ? std::min(irLen - offset, static_cast<size_t>(BlockSize)) : 0;
+      if (sizeCopy > 0)
+      {
+        ::memcpy(fftBuffer, &ir[offset], sizeCopy * sizeof(Sample));
+      }
+      ::memset(fftBuffer + sizeCopy, 0, (SegSize - sizeCopy) * sizeof(Sample));
+      _fft.fft(fftBuffer, _irRe[i], _irIm[i]);
+    }
+
+    _initialized = true;
+    return true;
+  }
+
+  /**
+  * @brief Convolves the the given input samples and immediately outputs the result
+  * @param input The input samples
+  * @param output The convolution result
+  * @param len Number of input/output samples
+  */
+  void process(const Sample* input, Sample* output, size_t len)
+  {
+    if (!_initialized)
+    {
+      ::memset(output, 0, len * sizeof(Sample));
+      return;
+    }
+
+    alignas(16) Sample fftBuffer[SegSize];
+    alignas(16) Sample convRe[ComplexSize];
+    alignas(16) Sample convIm[ComplexSize];
+
+    size_t processed = 0;
+    while (processed < len)
+    {
+      const bool inputBufferWasEmpty = (_inputBufferFill == 0);
+      const size_t processing = std::min(len-processed, static_cast<size_t>(BlockSize)-_inputBufferFill);
+      const size_t inputBufferPos = _inputBufferFill;
+      ::memcpy(_inputBuffer+inputBufferPos, input+processed, processing * sizeof(Sample));
+
+      // Forward FFT
+      ::memcpy(fftBuffer, _inputBuffer, BlockSize * sizeof(Sample));
+      ::memset(fftBuffer+BlockSize, 0, BlockSize * sizeof(Sample));
+      _fft.fft(fftBuffer, _ringRe[_current], _ringIm[_current]);
+
+      // Complex multiplication, older segments only change once per block
+      if (inputBufferWasEmpty)
+      {
+        multiplyAccumulateTail();
+      }
+      ::memcpy(convRe, _preMultipliedRe, ComplexSize * sizeof(Sample));
+      ::memcpy(convIm, _preMultipliedIm, ComplexSize * sizeof(Sample));
+      MultiplyAccumulate(convRe, convIm, _ringRe[_current], _ringIm[_current], _irRe[0], _irIm[0]);
+
+      // Backward FFT
+      _fft.ifft(fftBuffer, convRe, convIm);
+
+      // Add overlap
+      Sum(output+processed, fftBuffer+inputBufferPos, _overlap+inputBufferPos, processing);
+
+      // Input buffer full => Next block
+      _inputBufferFill += processing;
+      if (_inputBufferFill == BlockSize)
+      {
+        // Input buffer is empty again now
+        ::memset(_inputBuffer, 0, sizeof(_inputBuffer));
+        _inputBufferFill = 0;
+
+        // Save the overlap
+        ::memcpy(_overlap, fftBuffer+BlockSize, BlockSize * sizeof(Sample));
+
+        // Update current segment
+        _current = (_current - 1) & RingMask;
+      }
+
+      processed += processing;
+    }
+  }
+
+  /**
+  * @brief Resets the convolver and discards the set impulse response
+  */
+  void reset()
+  {
+    _fft.init(0);
+    clearBuffers();
+    _current = 0;
+    _inputBufferFill = 0;
+    _initialized = false;
+  }
+
+private:
+  // re += a * b, over one spectrum
+  static void MultiplyAccumulate(Sample* FFTCONVOLVER_RESTRICT re,
+                                 Sample* FFTCONVOLVER_RESTRICT im,
+                                 const Sample* FFTCONVOLVER_RESTRICT reA,
+                                 const Sample* FFTCONVOLVER_RESTRICT imA,
+                                 const Sample* FFTCONVOLVER_RESTRICT reB,
+                                 const Sample* FFTCONVOLVER_RESTRICT imB)
+  {
+#if defined(FFTCONVOLVER_USE_SSE)
+    for (size_t k=0; k<BlockSize; k+=4)
+    {
+      const __m128 ra = _mm_load_ps(&reA[k]);
+      const __m128 ia = _mm_load_ps(&imA[k]);
+      const __m128 rb = _mm_load_ps(&reB[k]);
+      const __m128 ib = _mm_load_ps(&imB[k]);
+      __m128 real = _mm_load_ps(&re[k]);
+      __m128 imag = _mm_load_ps(&im[k]);
+      real = _mm_add_ps(real, _mm_sub_ps(_mm_mul_ps(ra, rb), _mm_mul_ps(ia, ib)));
+      imag = _mm_add_ps(imag, _mm_add_ps(_mm_mul_ps(ra, ib), _mm_mul_ps(ia, rb)));
+      _mm_store_ps(&re[k], real);
+      _mm_store_ps(&im[k], imag);
+    }
+    // Nyquist bin
+    re[BlockSize] += reA[BlockSize] * reB[BlockSize] - imA[BlockSize] * imB[BlockSize];
+    im[BlockSize] += reA[BlockSize] * imB[BlockSize] + imA[BlockSize] * reB[BlockSize];
+#else
+    for (size_t k=0; k<ComplexSize; ++k)
+    {
+      re[k] += reA[k] * reB[k] - imA[k] * imB[k];
+      im[k] += reA[k] * imB[k] + imA[k] * reB[k];
+    }
+#endif
+  }
+
+  // Sum of segments 1..SegCount-1 times the input spectra they line up with,
+  // accumulated in registers over all segments before it is stored
+  void multiplyAccumulateTail()
+  {
+    const Sample* ringRe[SegCount];
+    const Sample* ringIm[SegCount];
+    for (size_t i=1; i<SegCount; ++i)
+    {
+      const size_t indexAudio = (_current + i) & RingMask;
+      ringRe[i] = _ringRe[indexAudio];
+      ringIm[i] = _ringIm[indexAudio];
+    }
+
+#if defined(FFTCONVOLVER_USE_SSE)
+    for (size_t k=0; k<BlockSize; k+=4)
+    {
+      __m128 real = _mm_setzero_ps();
+      __m128 imag = _mm_setzero_ps();
+      for (size_t i=1; i<SegCount; ++i)
+      {
+        const __m128 ra = _mm_load_ps(&_irRe[i][k]);
+        const __m128 ia = _mm_load_ps(&_irIm[i][k]);
+        const __m128 rb = _mm_load_ps(&ringRe[i][k]);
+        const __m128 ib = _mm_load_ps(&ringIm[i][k]);
+        real = _mm_add_ps(real, _mm_sub_ps(_mm_mul_ps(ra, rb), _mm_mul_ps(ia, ib)));
+        imag = _mm_add_ps(imag, _mm_add_ps(_mm_mul_ps(ra, ib), _mm_mul_ps(ia, rb)));
+      }
+      _mm_store_ps(&_preMultipliedRe[k], real);
+      _mm_store_ps(&_preMultipliedIm[k], imag);
+    }
+    const size_t first = BlockSize;
+#else
+    const size_t first = 0;
+#endif
+    for (size_t k=first; k<ComplexSize; ++k)
+    {
+      Sample re = 0;
+      Sample im = 0;
+      for (size_t i=1; i<SegCount; ++i)
+      {
+        re += _irRe[i][k] * ringRe[i][k] - _irIm[i][k] * ringIm[i][k];
+        im += _irRe[i][k] * ringIm[i][k] + _irIm[i][k] * ringRe[i][k];
+      }
+      _preMultipliedRe[k] = re;
+      _preMultipliedIm[k] = im;
+    }
+  }
+
+  void clearBuffers()
+  {
+    ::memset(_irRe, 0, sizeof(_irRe));
+    ::memset(_irIm, 0, sizeof(_irIm));
+    ::memset(_ringRe, 0, sizeof(_ringRe));
+    ::memset(_ringIm, 0, sizeof(_ringIm));
+    ::memset(_preMultipliedRe, 0, sizeof(_preMultipliedRe));
+    ::memset(_preMultipliedIm, 0, sizeof(_preMultipliedIm));
+    ::memset(_overlap, 0, sizeof(_overlap));
+    ::memset(_inputBuffer, 0, sizeof(_inputBuffer));
+  }
+
+  audiofft::AudioFFT _fft;
+  alignas(16) Sample _irRe[SegCount][ComplexStride];
+  alignas(16) Sample _irIm[SegCount][ComplexStride];
+  alignas(16) Sample _ringRe[RingSize][ComplexStride];
+  alignas(16) Sample _ringIm[RingSize][ComplexStride];
+  alignas(16) Sample _preMultipliedRe[ComplexSize];
+  alignas(16) Sample _preMultipliedIm[ComplexSize];
+  alignas(16) Sample _overlap[BlockSize];
+  alignas(16) Sample _inputBuffer[BlockSize];
+  size_t _current;
+  size_t _inputBufferFill;
+  bool _initialized;
+
+  // Prevent uncontrolled usage
+  FixedFFTConvolver(const FixedFFTConvolver&);
+  FixedFFTConvolver& operator=(const FixedFFTConvolver&);
+};
+
+} // End of namespace fftconvolver
+
+#endif // Header guard
@@ -0,0 +1,130 @@
+//
+//  HRIRGrid.hpp
+//  Capstone
+//
+
+#ifndef HRIRGrid_hpp
+#define HRIRGrid_hpp
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+static inline float degreesToRadians(float degrees) {
+    return degrees * float(M_PI / 180.0);
+}
+
+/*
+	HRIRGrid
+	Flat list of every measured HRIR pair with its direction.
+	Azimuth is in degrees, counter-clockwise from the front (90° is the left ear),
+	elevation is in degrees above the horizontal plane.
+	The IR data itself is not owned, it points into the HRIR_El* arrays.
+ */
+class HRIRGrid {
+public:
+
+    HRIRGrid() {
+        m_nIRLength = 0;
+    }
+
+    void clear() {
+        m_ppLeft.clear();
+        m_ppRight.clear();
+        m_pAzimuth.clear();
+        m_pElevation.clear();
+        m_pWeight.clear();
+        m_nIRLength = 0;
+    }
+
+    void setIRLength(int irLength) {
+        m_nIRLength = irLength;
+    }
+
+    // Add one rail of IRs that were all measured at the same elevation
+    void addRail(float elevation, float** pLeftIRs, float** pRightIRs, const float* pAzimuths, int numIRs) {
+        for(int i = 0; i < numIRs; i++) {
+            m_ppLeft.push_back(pLeftIRs[i]);
+            m_ppRight.push_back(pRightIRs[i]);
+            m_pAzimuth.push_back(pAzimuths[i]);
+            m_pElevation.push_back(elevation);
+        }
+        computeWeights();
+    }
+
+    int size() const { return (int)m_ppLeft.size(); }
+    int irLength() const { return m_nIRLength; }
+
+    const float* leftIR(int index) const { return m_ppLeft[index]; }
+    const float* rightIR(int index) const { return m_ppRight[index]; }
+    float azimuth(int index) const { return m_pAzimuth[index]; }
+    float elevation(int index) const { return m_pElevation[index]; }
+
+    // Solid angle covered by each position (sums to 4*pi), used as quadrature weights
+    float weight(int index) const { return m_pWeight[index]; }
+
+private:
+
+    // Rails split the sphere into elevation bands (edges half way between rails),
+    // and each IR gets the part of its band half way to its azimuth neighbours.
+    void computeWeights() {
+        int numPositions = size();
+        m_pWeight.assign(numPositions, 0.0f);
+
+        std::vector<float> railElevations(m_pElevation);
+        std::sort(railElevations.begin(), railElevations.end());
+        railElevations.erase(std::unique(railElevations.begin(), railElevations.end()), railElevations.end());
+
+        for(size_t r = 0; r < railElevations.size(); r++) {
+            float bottom = (r == 0) ? -90.0f : 0.5f * (railElevations[r-1] + railElevations[r]);
+            float top = (r == railElevations.size()-1) ? 90.0f : 0.5f * (railElevations[r] + railElevations[r+1]);
+            float bandArea = sinf(degreesToRadians(top)) - sinf(degreesToRadians(bottom));
+
+            std::vector<int> rail;
+            for(int i = 0; i < numPositions; i++) {
+                if(m_pElevation[i] == railElevations[r])
+                    rail.push_back(i);
+            }
+            std::sort(rail.begin(), rail.end(), AzimuthLess(m_pAzimuth));
+
+            int numOnRail = (int)rail.size();
+            for(int k = 0; k < numOnRail; k++) {
+                float prev = m_pAzimuth[rail[(k + numOnRail - 1) % numOnRail]];
+                float next = m_pAzimuth[rail[(k + 1) % numOnRail]];
+                float gap = wrapDegrees(next - prev);
+                if(numOnRail == 1)
+                    gap = 720.0f;
+                m_pWeight[rail[k]] = 0.5f * degreesToRadians(gap) * bandArea;
+            }
+        }
+    }
+
+    static float wrapDegrees(float degrees) {
+        while(degrees <= 0.0f)
+            degrees += 360.0f;
+        while(degrees > 360.0f)
+            degrees -= 360.0f;
+        return degrees;
+    }
+
+    struct AzimuthLess {
+        AzimuthLess(const std::vector<float>& azimuths) : m_azimuths(azimuths) {}
+        bool operator()(int a, int b) const {
+            return fmodf(m_azimuths[a] + 360.0f, 360.0f) < fmodf(m_azimuths[b] + 360.0f, 360.0f);
+        }
+        const std::vector<float>& m_azimuths;
+    };
+
+    std::vector<const float*> m_ppLeft;
+    std::vector<const float*> m_ppRight;
+    std::vector<float> m_pAzimuth;
+    std::vector<float> m_pElevation;
+    std::vector<float> m_pWeight;
+    int m_nIRLength;
+};
+
+#endif /* HRIRGrid_hpp */
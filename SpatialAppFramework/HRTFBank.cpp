@@ -0,0 +1,401 @@
+//
+//  HRTFBank.cpp
+//  Capstone
+//
+
+#include "HRTFBank.hpp"
+#include "IRArraySetter.hpp"
+#include "PolyphaseResampler.hpp"
+#include <map>
+#include <tuple>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <chrono>
+
+
+// Guards the loaded banks and the cache directory
+static std::mutex& bankMutex()
+{
+    static std::mutex mutex;
+    return mutex;
+}
+
+static std::string& bankCacheDirectory()
+{
+    static std::string directory;
+    return directory;
+}
+
+std::shared_ptr<const HRTFBank> HRTFBank::shared(int blockSize, fftconvolver::SpectrumPrecision precision, int sampleRate)
+{
+    static std::map<std::tuple<int, int, int>, std::weak_ptr<const HRTFBank> > banks;
+
+    // held while loading, so instances created together load the bank once
+    std::lock_guard<std::mutex> lock(bankMutex());
+    std::tuple<int, int, int> key(blockSize, int(precision), sampleRate);
+    std::shared_ptr<const HRTFBank> bank = banks[key].lock();
+    if(!bank) {
+        bank.reset(new HRTFBank(blockSize, precision, sampleRate));
+        banks[key] = bank;
+    }
+    return bank;
+}
+
+void HRTFBank::setCacheDirectory(const std::string& directory)
+{
+    std::lock_guard<std::mutex> lock(bankMutex());
+    bankCacheDirectory() = directory;
+}
+
+struct HRTFBank::RailSpectra {
+    fftconvolver::PartitionedIR left[NUM_OF_IRS];
+    fftconvolver::PartitionedIR right[NUM_OF_IRS];
+};
+
+HRTFBank::HRTFBank(int blockSize, fftconvolver::SpectrumPrecision precision, int sampleRate)
+{
+    m_nBlockSize = blockSize;
+    m_nPrecision = precision;
+    m_nSampleRate = sampleRate;
+
+    // E330, E345, E15, E30 and E60 have setters in IRArraySetter but no HRIR data in the project
+    // yet; a rail added here (in elevation order) is paged like the others
+    IRArraySetter irArraySetter;
+    irArraySetter.setIRsForE315(m_pIRs_L[0], m_pIRs_R[0]);
+    irArraySetter.setIRsForE0(m_pIRs_L[1], m_pIRs_R[1]);
+    irArraySetter.setIRsForE45(m_pIRs_L[2], m_pIRs_R[2]);
+    irArraySetter.setIRsForE75(m_pIRs_L[3], m_pIRs_R[3]);
+
+    // shared() holds the lock the cache directory is read under
+    if(m_nSampleRate != HRIR_SAMPLE_RATE)
+        resample(bankCacheDirectory());
+
+    float railAzimuths[NUM_OF_IRS];
+    for(int i = 0; i < NUM_OF_IRS; i++)
+        railAzimuths[i] = IRArraySetter::azimuthForIndex(i);
+    m_Grid.setIRLength(IR_SIZE);
+    for(int rail = 0; rail < ELEV_RAILS; rail++)
+        m_Grid.addRail(elevationForRail(rail), m_pIRs_L[rail], m_pIRs_R[rail], railAzimuths, NUM_OF_IRS);
+    m_SphericalGrid.build(m_Grid);
+
+    for(int rail = 0; rail < ELEV_RAILS; rail++) {
+        m_pRailSpectra[rail] = NULL;
+        m_pRailPins[rail] = 0;
+        m_pRailEvicting[rail] = false;
+        m_pRailRequested[rail] = false;
+        m_pRailLastUse[rail] = milliseconds();
+    }
+
+    // the home rail is prepared now and pinned for good
+    pinRail(homeRail());
+
+    m_bStopping = false;
+    m_nRenderers = 0;
+    m_Prefetcher = std::thread(&HRTFBank::prefetch, this);
+}
+
+HRTFBank::~HRTFBank()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_WakeMutex);
+        m_bStopping = true;
+    }
+    m_Wake.notify_one();
+    m_Prefetcher.join();
+
+    for(int rail = 0; rail < ELEV_RAILS; rail++)
+        delete m_pRailSpectra[rail].load();
+}
+
+const fftconvolver::PartitionedIR& HRTFBank::leftSpectra(int position) const
+{
+    return m_pRailSpectra[railOf(position)].load()->left[position % NUM_OF_IRS];
+}
+
+const fftconvolver::PartitionedIR& HRTFBank::rightSpectra(int position) const
+{
+    return m_pRailSpectra[railOf(position)].load()->right[position % NUM_OF_IRS];
+}
+
+void HRTFBank::pinRail(int rail) const
+{
+    std::lock_guard<std::mutex> lock(m_PrepareMutex);
+    if(!m_pRailSpectra[rail].load())
+        m_pRailSpectra[rail] = prepare(rail);
+    m_pRailPins[rail]++;
+    stamp(rail);
+}
+
+bool HRTFBank::tryPinRail(int rail) const
+{
+    // pin first, then look: the prefetcher flags a rail as evicting before it checks the pins,
+    // so either it sees this pin and keeps the rail, or this sees the flag and backs off
+    m_pRailPins[rail]++;
+    if(!m_pRailEvicting[rail].load() && m_pRailSpectra[rail].load()) {
+        stamp(rail);
+        return true;
+    }
+    m_pRailPins[rail]--;
+    return false;
+}
+
+void HRTFBank::unpinRail(int rail) const
+{
+    // stamped before the pin goes, so the grace period starts from here
+    stamp(rail);
+    m_pRailPins[rail]--;
+}
+
+void HRTFBank::requestRail(int rail) const
+{
+    stamp(rail);
+    if(!m_pRailSpectra[rail].load())
+        m_pRailRequested[rail] = true;
+}
+
+int HRTFBank::preparedRails() const
+{
+    int prepared = 0;
+    for(int rail = 0; rail < ELEV_RAILS; rail++)
+        if(m_pRailSpectra[rail].load())
+            prepared++;
+    return prepared;
+}
+
+void HRTFBank::beginRendering() const
+{
+    {
+        std::lock_guard<std::mutex> lock(m_WakeMutex);
+        m_nRenderers++;
+    }
+    m_Wake.notify_one();
+}
+
+void HRTFBank::endRendering() const
+{
+    // woken once more to start the grace period of the rails left behind
+    {
+        std::lock_guard<std::mutex> lock(m_WakeMutex);
+        m_nRenderers--;
+    }
+    m_Wake.notify_one();
+}
+
+int HRTFBank::nearestRail(float elevation)
+{
+    int nearest = 0;
+    for(int rail = 1; rail < ELEV_RAILS; rail++)
+        if(fabsf(elevationForRail(rail) - elevation) < fabsf(elevationForRail(nearest) - elevation))
+            nearest = rail;
+    return nearest;
+}
+
+void HRTFBank::stamp(int rail) const
+{
+    m_pRailLastUse[rail] = milliseconds();
+}
+
+// Steady clock in milliseconds, wrapping; only differences are used
+unsigned HRTFBank::milliseconds()
+{
+    return unsigned(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// Partitions and transforms every IR pair of a rail, about a quarter of the bank's load time
+HRTFBank::RailSpectra* HRTFBank::prepare(int rail) const
+{
+    RailSpectra* spectra = new RailSpectra();
+    for(int index = 0; index < NUM_OF_IRS; index++) {
+        spectra->left[index].init(m_nBlockSize, m_pIRs_L[rail][index], IR_SIZE, m_nPrecision);
+        spectra->right[index].init(m_nBlockSize, m_pIRs_R[rail][index], IR_SIZE, m_nPrecision);
+    }
+    return spectra;
+}
+
+// Frees a rail nobody has pinned. Called with m_PrepareMutex held.
+bool HRTFBank::evict(int rail) const
+{
+    m_pRailEvicting[rail] = true;
+    if(m_pRailPins[rail].load() > 0) {
+        m_pRailEvicting[rail] = false;
+        return false;
+    }
+    RailSpectra* spectra = m_pRailSpectra[rail].exchange(NULL);
+    m_pRailEvicting[rail] = false;
+    delete spectra;
+    return true;
+}
+
+// Evicts least recently used rails until the unpinned ones fit the budget. Pinned rails and
+// rails used within the grace period stay, even over budget. Returns whether one of those is
+// still waiting out its grace. Called with m_PrepareMutex held.
+bool HRTFBank::trim() const
+{
+    while(preparedRails() > RAIL_BUDGET) {
+        unsigned now = milliseconds();
+        int oldest = -1;
+        unsigned oldestAge = 0;
+        bool waiting = false;
+        for(int rail = 0; rail < ELEV_RAILS; rail++) {
+            if(!m_pRailSpectra[rail].load() || m_pRailPins[rail].load() > 0 || m_pRailRequested[rail].load())
+                continue;
+            unsigned age = now - m_pRailLastUse[rail].load();
+            if(age < RAIL_EVICT_GRACE_MS)
+                waiting = true;
+            else if(oldest < 0 || age > oldestAge) {
+                oldest = rail;
+                oldestAge = age;
+            }
+        }
+        if(oldest < 0 || !evict(oldest))
+            return waiting;
+    }
+    return false;
+}
+
+// Polls while a kernel renders or a rail waits out its grace, parked otherwise
+void HRTFBank::prefetch()
+{
+    bool waiting = false;
+    std::unique_lock<std::mutex> lock(m_WakeMutex);
+    while(!m_bStopping) {
+        if(m_nRenderers > 0 || waiting)
+            m_Wake.wait_for(lock, std::chrono::milliseconds(RAIL_POLL_MS));
+        else
+            m_Wake.wait(lock);
+        if(m_bStopping)
+            break;
+        lock.unlock();
+
+        {
+            std::lock_guard<std::mutex> prepareLock(m_PrepareMutex);
+            for(int rail = 0; rail < ELEV_RAILS; rail++) {
+                if(!m_pRailRequested[rail].exchange(false) || m_pRailSpectra[rail].load())
+                    continue;
+                m_pRailSpectra[rail] = prepare(rail);
+                stamp(rail);
+            }
+            waiting = trim();
+        }
+
+        lock.lock();
+    }
+}
+
+// Header of a cache file, followed by the IRs as laid out in m_pResampled
+struct HRIRCacheHeader {
+    char magic[4];
+    int32_t version;
+    int32_t sourceRate;
+    int32_t sampleRate;
+    int32_t irLength;
+    int32_t irCount;
+};
+
+// Replaces the IRs by their resampled versions, read from the cache or resampled and cached
+void HRTFBank::resample(const std::string& cacheDirectory)
+{
+    m_pResampled.assign(size_t(ELEV_RAILS) * NUM_OF_IRS * 2 * IR_SIZE, 0.0f);
+
+    std::string path;
+    if(!cacheDirectory.empty()) {
+        char name[32];
+        snprintf(name, sizeof(name), "/HRIRs_%d.cache", m_nSampleRate);
+        path = cacheDirectory + name;
+    }
+
+    if(path.empty() || !readCache(path)) {
+        PolyphaseResampler resampler;
+        resampler.init(HRIR_SAMPLE_RATE, m_nSampleRate, IR_SIZE);
+        std::vector<float> output(resampler.maxOutput(IR_SIZE) + resampler.maxOutput(resampler.latency()));
+        std::vector<float> silence(resampler.latency(), 0.0f);
+        // an IR keeps its frequency response with as many more samples as the rate is higher
+        float gain = float(HRIR_SAMPLE_RATE) / float(m_nSampleRate);
+
+        for(int rail = 0; rail < ELEV_RAILS; rail++) {
+            for(int index = 0; index < NUM_OF_IRS; index++) {
+                for(int ear = 0; ear < 2; ear++) {
+                    resampler.reset();
+                    const float* ir = ear ? m_pIRs_R[rail][index] : m_pIRs_L[rail][index];
+                    int length = resampler.process(ir, IR_SIZE, &output[0]);
+                    length += resampler.process(&silence[0], int(silence.size()), &output[length]);
+
+                    float* resampled = &m_pResampled[((rail * NUM_OF_IRS + index) * 2 + ear) * size_t(IR_SIZE)];
+                    int kept = std::min(length, IR_SIZE);
+                    for(int i = 0; i < kept; i++)
+                        resampled[i] = gain * output[i];
+                    std::fill(resampled + kept, resampled + IR_SIZE, 0.0f);
+                    if(length > IR_SIZE) {
+                        for(int i = 0; i < HRIR_RESAMPLE_FADE; i++)
+                            resampled[IR_SIZE - HRIR_RESAMPLE_FADE + i] *= 0.5f + 0.5f * cosf(float(M_PI) * (i + 1) / HRIR_RESAMPLE_FADE);
+                    }
+                }
+            }
+        }
+        if(!path.empty())
+            writeCache(path);
+    }
+
+    for(int rail = 0; rail < ELEV_RAILS; rail++) {
+        for(int index = 0; index < NUM_OF_IRS; index++) {
+            m_pIRs_L[rail][index] = &m_pResampled[((rail * NUM_OF_IRS + index) * 2) * size_t(IR_SIZE)];
+            m_pIRs_R[rail][index] = &m_pResampled[((rail * NUM_OF_IRS + index) * 2 + 1) * size_t(IR_SIZE)];
+        }
+    }
+}
+
+// Fills m_pResampled from a cache file, if there is one for this rate and version
+bool HRTFBank::readCache(const std::string& path)
+{
+    FILE* file = fopen(path.c_str(), "rb");
+    if(!file)
+        return false;
+
+    HRIRCacheHeader header;
+    bool valid = fread(&header, sizeof(header), 1, file) == 1
+        && memcmp(header.magic, "HRIR", 4) == 0
+        && header.version == HRIR_CACHE_VERSION
+        && header.sourceRate == HRIR_SAMPLE_RATE
+        && header.sampleRate == m_nSampleRate
+        && header.irLength == IR_SIZE
+        && header.irCount == ELEV_RAILS * NUM_OF_IRS * 2
+        && fread(&m_pResampled[0], sizeof(float), m_pResampled.size(), file) == m_pResampled.size();
+    fclose(file);
+    return valid;
+}
+
+// Written to a temporary file and renamed, so a cache is never seen half written
+void HRTFBank::writeCache(const std::string& path) const
+{
+    std::string temporary = path + ".tmp";
+    FILE* file = fopen(temporary.c_str(), "wb");
+    if(!file)
+        return;
+
+    HRIRCacheHeader header;
+    memcpy(header.magic, "HRIR", 4);
+    header.version = HRIR_CACHE_VERSION;
+    header.sourceRate = HRIR_SAMPLE_RATE;
+    header.sampleRate = m_nSampleRate;
+    header.irLength = IR_SIZE;
+    header.irCount = ELEV_RAILS * NUM_OF_IRS * 2;
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(&m_pResampled[0], sizeof(float), m_pResampled.size(), file) == m_pResampled.size();
+    written = fclose(file) == 0 && written;
+
+    if(!written || rename(temporary.c_str(), path.c_str()) != 0)
+        remove(temporary.c_str());
+}
+
+float HRTFBank::elevationForRail(int rail)
+{
+    static const float railElevations[ELEV_RAILS] = {-45.0f, 0.0f, 45.0f, 75.0f};
+    return railElevations[rail];
+}
+
+float HRTFBank::azimuthForIndex(int index)
+{
+    return IRArraySetter::azimuthForIndex(index);
+}
@@ -0,0 +1,262 @@
+//
+//  HRTFBank.hpp
+//  Capstone
+//
+
+#ifndef HRTFBank_hpp
+#define HRTFBank_hpp
+
+#include "SwitchingConvolver.hpp"
+#include "HRIRGrid.hpp"
+#include "SphericalGrid.hpp"
+#include <memory>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#define NUM_OF_IRS 90
+#define IR_SIZE 8192
+#define ELEV_RAILS 4
+// rate the embedded HRIRs were measured at
+#define HRIR_SAMPLE_RATE 44100
+// bump whenever the embedded HRIRs or the resampler change, so stale caches are redone
+#define HRIR_CACHE_VERSION 2
+// samples faded out at the end of an IR cut to IR_SIZE after upsampling
+#define HRIR_RESAMPLE_FADE 256
+
+// rails whose spectra may stay prepared without being pinned (the home rail counts)
+#define RAIL_BUDGET 3
+// how often the prefetcher looks for requested rails while a kernel renders, in milliseconds
+#define RAIL_POLL_MS 5
+// a rail is only evicted once it has been unpinned and unrequested for this long
+#define RAIL_EVICT_GRACE_MS 1000
+// blocks a moving source's elevation is extrapolated over to pick the rail to prefetch
+#define RAIL_PREFETCH_BLOCKS 20
+
+/*
+	HRTFBank
+	Every measured HRIR pair with its direction, the triangulation of the directions and the
+	IR spectra for one block size. Loaded once per process and block size and shared by every
+	kernel through shared(); it is freed when the last kernel lets go of it. Positions are
+	numbered rail by rail (rail * NUM_OF_IRS + index on the rail), rails are ordered by
+	elevation: E315, E0, E45, E75.
+	The time-domain IRs are always there, but spectra are prepared a rail at a time: only the
+	home (E0) rail is prepared up front, the others when a source heads for them. A background
+	prefetcher prepares requested rails and evicts the least recently used ones beyond
+	RAIL_BUDGET, so resident memory grows with the rails in use rather than the rails measured.
+	It only polls while some kernel renders from the bank (or a rail waits out its eviction
+	grace) and waits without a timeout otherwise.
+	Spectra may only be used while their rail is pinned; pinned rails are never evicted.
+	Spectra can be stored as 16-bit floats (see SpectrumPrecision), which halves the memory of a
+	prepared rail and what the convolvers stream from it every block.
+	At any other rate than HRIR_SAMPLE_RATE the IRs are resampled once when the bank loads, and
+	kept IR_SIZE samples long. The result is cached per rate in the directory given to
+	setCacheDirectory(), if any, so later loads only read it back.
+ */
+class HRTFBank {
+public:
+
+    // The bank for a block size, spectrum format and sample rate, loaded on first use. Blocks
+    // while loading, not real-time safe.
+    static std::shared_ptr<const HRTFBank> shared(int blockSize, fftconvolver::SpectrumPrecision precision = fftconvolver::SpectrumFloat32, int sampleRate = HRIR_SAMPLE_RATE);
+
+    // Where resampled IRs are cached, for banks loaded from now on; empty to not cache
+    static void setCacheDirectory(const std::string& directory);
+
+    ~HRTFBank();
+
+    int blockSize() const { return m_nBlockSize; }
+    int sampleRate() const { return m_nSampleRate; }
+    fftconvolver::SpectrumPrecision precision() const { return m_nPrecision; }
+    int size() const { return m_Grid.size(); }
+
+    const HRIRGrid& grid() const { return m_Grid; }
+    const SphericalGrid& sphericalGrid() const { return m_SphericalGrid; }
+
+    // Spectra of a position, only while its rail is pinned
+    const fftconvolver::PartitionedIR& leftSpectra(int position) const;
+    const fftconvolver::PartitionedIR& rightSpectra(int position) const;
+
+    // Pins a rail, preparing it first if need be. Blocks, not real-time safe.
+    void pinRail(int rail) const;
+    // Pins a rail if it is prepared and returns true, otherwise returns false. Real-time safe.
+    bool tryPinRail(int rail) const;
+    void unpinRail(int rail) const;
+    // Asks the prefetcher to prepare a rail (or keep it). Real-time safe, never waits.
+    void requestRail(int rail) const;
+    bool isRailPrepared(int rail) const { return m_pRailSpectra[rail].load() != NULL; }
+    // Number of rails whose spectra are currently prepared
+    int preparedRails() const;
+
+    // Brackets the time a kernel renders from the bank, so the prefetcher knows to poll for
+    // requested rails. Not real-time safe.
+    void beginRendering() const;
+    void endRendering() const;
+
+    static int railOf(int position) { return position / NUM_OF_IRS; }
+    // The rail that is always prepared, E0
+    static int homeRail() { return 1; }
+    // Rail closest to an elevation in degrees
+    static int nearestRail(float elevation);
+
+    // Rails are ordered E315, E0, E45, E75
+    static float elevationForRail(int rail);
+    // Azimuth in degrees of an index on a rail, the same on every rail
+    static float azimuthForIndex(int index);
+
+private:
+
+    struct RailSpectra;
+
+    HRTFBank(int blockSize, fftconvolver::SpectrumPrecision precision, int sampleRate);
+
+    void resample(const std::string& cacheDirectory);
+    bool readCache(const std::string& path);
+    void writeCache(const std::string& path) const;
+
+    RailSpectra* prepare(int rail) const;
+    bool evict(int rail) const;
+    bool trim() const;
+    void prefetch();
+    void stamp(int rail) const;
+    static unsigned milliseconds();
+
+    int m_nBlockSize;
+    fftconvolver::SpectrumPrecision m_nPrecision;
+    int m_nSampleRate;
+
+    // pointers into the HRIR_El* arrays or, resampled, into m_pResampled, one table per rail
+    float* m_pIRs_L[ELEV_RAILS][NUM_OF_IRS];
+    float* m_pIRs_R[ELEV_RAILS][NUM_OF_IRS];
+    // every resampled IR, rail by rail, left then right
+    std::vector<float> m_pResampled;
+
+    HRIRGrid m_Grid;
+    SphericalGrid m_SphericalGrid;
+
+    // Paging state, shared by every user of the bank. A rail's spectra pointer is only
+    // published or cleared by the prefetcher (or pinRail) under m_PrepareMutex; users pin it
+    // first and read it after, so a rail with pins is never freed under them.
+    mutable std::atomic<RailSpectra*> m_pRailSpectra[ELEV_RAILS];
+    mutable std::atomic<int> m_pRailPins[ELEV_RAILS];
+    mutable std::atomic<bool> m_pRailEvicting[ELEV_RAILS];
+    mutable std::atomic<bool> m_pRailRequested[ELEV_RAILS];
+    // time (milliseconds()) of each rail's last pin, unpin or request, for LRU and the grace period
+    mutable std::atomic<unsigned> m_pRailLastUse[ELEV_RAILS];
+    mutable std::mutex m_PrepareMutex;
+
+    std::atomic<bool> m_bStopping;
+    // kernels rendering from the bank, guarded by m_WakeMutex
+    mutable int m_nRenderers;
+    mutable std::mutex m_WakeMutex;
+    mutable std::condition_variable m_Wake;
+    std::thread m_Prefetcher;
+
+    // Prevent uncontrolled usage
+    HRTFBank(const HRTFBank&);
+    HRTFBank& operator=(const HRTFBank&);
+};
+
+
+/*
+	RailTracker
+	Keeps the rail of one moving direction (a source, a cluster) pinned, and requests the rail
+	it is heading for ahead of time from its elevation and how fast that is changing. Used
+	from the render thread only, apart from init().
+ */
+class RailTracker {
+public:
+
+    RailTracker() {
+        m_pBank = NULL;
+        m_nRail = -1;
+        m_bStarted = false;
+        m_fElevation = 0.0f;
+        m_fVelocity = 0.0f;
+    }
+
+    ~RailTracker() { release(); }
+
+    // Starts on the home rail, which is always prepared
+    void init(const HRTFBank& bank) {
+        release();
+        m_pBank = &bank;
+        m_nRail = HRTFBank::homeRail();
+        bank.pinRail(m_nRail);
+        m_bStarted = false;
+        m_fVelocity = 0.0f;
+    }
+
+    void release() {
+        if(m_pBank && m_nRail >= 0)
+            m_pBank->unpinRail(m_nRail);
+        m_pBank = NULL;
+        m_nRail = -1;
+    }
+
+    int rail() const { return m_nRail; }
+
+    // Once per block with the elevation (degrees) the direction has now
+    void anticipate(float elevation) {
+        if(m_bStarted)
+            m_fVelocity = 0.7f*m_fVelocity + 0.3f*(elevation - m_fElevation);
+        m_fElevation = elevation;
+        m_bStarted = true;
+
+        m_pBank->requestRail(HRTFBank::nearestRail(elevation));
+        int ahead = HRTFBank::nearestRail(elevation + m_fVelocity*RAIL_PREFETCH_BLOCKS);
+        if(ahead != m_nRail)
+            m_pBank->requestRail(ahead);
+    }
+
+    // Moves the pin to rail. If that rail is not prepared yet it stays requested and rail is
+    // replaced by the closest prepared one (the one held already, or nearer); returns whether
+    // rail was kept.
+    bool follow(int& rail) {
+        if(rail == m_nRail)
+            return true;
+        if(m_pBank->tryPinRail(rail)) {
+            m_pBank->unpinRail(m_nRail);
+            m_nRail = rail;
+            return true;
+        }
+        m_pBank->requestRail(rail);
+
+        // rails are ordered by elevation, so walk outwards until a prepared one or the held one
+        for(int step = 1; step < ELEV_RAILS; step++) {
+            for(int side = -1; side <= 1; side += 2) {
+                int candidate = rail + side*step;
+                if(candidate < 0 || candidate >= ELEV_RAILS)
+                    continue;
+                if(candidate == m_nRail) {
+                    rail = m_nRail;
+                    return false;
+                }
+                if(m_pBank->tryPinRail(candidate)) {
+                    m_pBank->unpinRail(m_nRail);
+                    m_nRail = candidate;
+                    rail = candidate;
+                    return false;
+                }
+            }
+        }
+        rail = m_nRail;
+        return false;
+    }
+
+private:
+    const HRTFBank* m_pBank;
+    int m_nRail;
+    bool m_bStarted;
+    float m_fElevation;
+    float m_fVelocity;
+
+    // Prevent uncontrolled usage
+    RailTracker(const RailTracker&);
+    RailTracker& operator=(const RailTracker&);
+};
+
+#endif /* HRTFBank_hpp */
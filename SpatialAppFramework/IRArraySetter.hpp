@@ -28,6 +28,18 @@ public:
     IRArraySetter() {
     }
     
+    // Azimuth (degrees, counter-clockwise from front) of each index on a rail
+    // 180° -> 90° in 6° steps, 87° -> 273° through the front in 3° steps, 264° -> 186° in 6° steps
+    static float azimuthForIndex(int index) {
+        if(index < 16)
+            return 180.0f - 6.0f*index;
+        if(index < 76) {
+            float azimuth = 90.0f - 3.0f*(index - 15);
+            return azimuth < 0.0f ? azimuth + 360.0f : azimuth;
+        }
+        return 270.0f - 6.0f*(index - 75);
+    }
+    
     // Azimuth Rails
     
     void setIRsForE0(float *pLeftIRArray[], float *pRightIRArray[]) {
@@ -0,0 +1,130 @@
+//
+//  NearFieldCorrection.hpp
+//  Capstone
+//
+
+#ifndef NearFieldCorrection_hpp
+#define NearFieldCorrection_hpp
+
+#include "BiquadBank.hpp"
+#include "PropagationDelay.hpp"
+#include <cmath>
+#include <algorithm>
+
+// metres
+#define NEARFIELD_HEAD_RADIUS 0.0875f
+// distance the HRIRs are taken to be measured at; no correction there
+#define NEARFIELD_REFERENCE_DISTANCE 1.0f
+// closest a source is corrected for, anything nearer is treated as this far
+#define NEARFIELD_MIN_DISTANCE 0.15f
+// Brown & Duda head shadow: high-frequency gain at the ear's darkest angle, and that angle
+#define NEARFIELD_SHADOW_MIN_GAIN 0.1f
+#define NEARFIELD_SHADOW_MIN_ANGLE 150.0f
+
+/*
+	NearFieldCorrection
+	What a source's HRIR pair misses when the source is closer (or farther) than the HRIRs were
+	measured: the level difference between the ears grows at all frequencies and the far ear sinks
+	deeper into the head's shadow at high frequencies.
+	Each ear gets a first-order shelf, the ratio of a spherical-head model of that ear at the
+	source's distance to the same model at the reference distance:
+	- low frequencies: the ear's path length from the source, straight if it can see the source,
+	  over the head's surface if not, against the distance to the head's centre (already applied
+	  as the source's gain);
+	- high frequencies: the Brown & Duda one-pole head-shadow filter of the angle to the ear,
+	  that angle warped so the shadow's edge moves forward from 90° as the source closes in.
+	Every source and ear is one lane of a BiquadBank, filtered in one pass.
+ */
+class NearFieldCorrection {
+public:
+
+    NearFieldCorrection() {
+        m_fSampleRate = 44100.0f;
+        m_nSources = 0;
+    }
+
+    // Not real-time safe
+    void init(float sampleRate, int blockSize, int maxSources) {
+        m_fSampleRate = sampleRate;
+        m_nSources = std::min(maxSources, int(BIQUAD_BANK_MAX_LANES / 2));
+        m_Filters.init(2 * m_nSources, blockSize);
+    }
+
+    // Forgets the filters' state; the next positions are used without a ramp
+    void reset() {
+        m_Filters.reset();
+    }
+
+    // A source's position for the next process(): degrees (azimuth counter-clockwise from the
+    // front) and metres
+    void setSource(int source, float azimuth, float elevation, float distance) {
+        float az = azimuth * float(M_PI) / 180.0f;
+        float el = elevation * float(M_PI) / 180.0f;
+        // cosine of the angle between the source and the left ear's axis (+y); the right ear's is -
+        float lateral = cosf(el) * sinf(az);
+        distance = std::max(distance, float(NEARFIELD_MIN_DISTANCE));
+
+        m_Filters.setCoefficients(2 * source, earFilter(acosf(clampCosine(lateral)), distance));
+        m_Filters.setCoefficients(2 * source + 1, earFilter(acosf(clampCosine(-lateral)), distance));
+    }
+
+    // pEars[2*s] is source s at the left ear, pEars[2*s+1] at the right, filtered in place
+    void process(float* const* pEars, int numSources, int numSamples) {
+        m_Filters.process(pEars, 2 * std::min(numSources, m_nSources), numSamples);
+    }
+
+private:
+
+    static float clampCosine(float x) {
+        return std::min(std::max(x, -1.0f), 1.0f);
+    }
+
+    // Shelf from the model at the reference distance to the model at this one, bilinear transformed
+    BiquadCoefficients earFilter(float angle, float distance) const {
+        float lowGain = pathGain(angle, distance) / pathGain(angle, NEARFIELD_REFERENCE_DISTANCE);
+        // zero and pole of the two head-shadow filters, w0 = c / a
+        float w0 = SPEED_OF_SOUND / NEARFIELD_HEAD_RADIUS;
+        float zero = 2.0f * w0 / shadowGain(angle, distance);
+        float pole = 2.0f * w0 / shadowGain(angle, NEARFIELD_REFERENCE_DISTANCE);
+
+        float k = 2.0f * m_fSampleRate;
+        float a0 = 1.0f + k / pole;
+        BiquadCoefficients c;
+        c.b0 = lowGain * (1.0f + k / zero) / a0;
+        c.b1 = lowGain * (1.0f - k / zero) / a0;
+        c.b2 = 0.0f;
+        c.a1 = (1.0f - k / pole) / a0;
+        c.a2 = 0.0f;
+        return c;
+    }
+
+    // Low-frequency level at the ear relative to the head's centre, the inverse of their path lengths
+    static float pathGain(float angle, float distance) {
+        float a = NEARFIELD_HEAD_RADIUS;
+        float edge = acosf(a / distance);
+        float path;
+        if(angle <= edge)
+            path = sqrtf(distance * distance + a * a - 2.0f * a * distance * cosf(angle));
+        else
+            path = sqrtf(distance * distance - a * a) + a * (angle - edge);
+        return distance / path;
+    }
+
+    // High-frequency gain of the Brown & Duda head-shadow filter
+    static float shadowGain(float angle, float distance) {
+        // the lit part of the head ends at acos(a/r) rather than at 90°
+        float edge = acosf(NEARFIELD_HEAD_RADIUS / distance);
+        float halfPi = 0.5f * float(M_PI);
+        float warped = angle <= edge ? angle * halfPi / edge : halfPi + (angle - edge) * halfPi / (float(M_PI) - edge);
+
+        float minAngle = NEARFIELD_SHADOW_MIN_ANGLE * float(M_PI) / 180.0f;
+        float minGain = NEARFIELD_SHADOW_MIN_GAIN;
+        return (1.0f + 0.5f * minGain) + (1.0f - 0.5f * minGain) * cosf(warped * float(M_PI) / minAngle);
+    }
+
+    float m_fSampleRate;
+    int m_nSources;
+    BiquadBank m_Filters;
+};
+
+#endif /* NearFieldCorrection_hpp */
@@ -0,0 +1,283 @@
+//
+//  PCARenderer.hpp
+//  Capstone
+//
+
+#ifndef PCARenderer_hpp
+#define PCARenderer_hpp
+
+#include "FFTConvolver.hpp"
+#include "HRIRGrid.hpp"
+#include "SphericalGrid.hpp"
+#include "SpatialSource.hpp"
+#include "VectorOps.hpp"
+#include <vector>
+#include <algorithm>
+#include <cstring>
+
+#define MIN_PCA_COMPONENTS 4
+#define MAX_PCA_COMPONENTS 32
+// mean filter plus the components
+#define MAX_PCA_FILTERS (MAX_PCA_COMPONENTS + 1)
+
+/*
+	PCARenderer
+	Decomposes each ear's HRIR bank into a mean filter plus K principal-component filters and
+	a table of K weights per position. Sources are mixed into K+1 basis buses per ear with their
+	(interpolated) weights and each bus is convolved once, so the filter count does not grow with
+	the number of sources and moving a source only changes weights.
+	This saves convolutions, not memory. The spectral bank is shared with the other render
+	paths and kernel instances and stays resident (its home rail always), and the basis filters
+	come on top of it.
+ */
+class PCARenderer {
+public:
+
+    PCARenderer() {
+        m_nComponents = 0;
+        m_nBlockSize = 0;
+        m_nMaxSources = 0;
+        m_nPositions = 0;
+        m_fExplainedVariance = 0.0f;
+    }
+
+    // Runs the decomposition and loads the basis filters. Takes a while, call off the render thread.
+    void init(const HRIRGrid& grid, int numComponents, int blockSize, int maxSources) {
+        m_nComponents = std::min(clampComponentCount(numComponents), grid.size() - 1);
+        m_nBlockSize = blockSize;
+        m_nMaxSources = maxSources;
+        m_nPositions = grid.size();
+
+        int irLength = grid.irLength();
+        std::vector<float> basis(filters() * irLength);
+        float explained[2];
+        for(int ear = 0; ear < 2; ear++) {
+            std::vector<float>& weights = ear == 0 ? m_pWeights_L : m_pWeights_R;
+            explained[ear] = decompose(grid, ear, basis, weights);
+            fftconvolver::FFTConvolver* pConvolvers = ear == 0 ? m_pBasis_L : m_pBasis_R;
+            for(int k = 0; k < MAX_PCA_FILTERS; k++) {
+                if(k < filters())
+                    pConvolvers[k].init(m_nBlockSize, &basis[k * irLength], irLength);
+                else
+                    pConvolvers[k].reset();
+            }
+        }
+        m_fExplainedVariance = 0.5f * (explained[0] + explained[1]);
+
+        m_SphericalGrid.build(grid);
+
+        m_pBus_L.assign(filters() * m_nBlockSize, 0.0f);
+        m_pBus_R.assign(filters() * m_nBlockSize, 0.0f);
+        m_pScratch.assign(m_nBlockSize, 0.0f);
+        m_pSourceGains.assign(m_nMaxSources * 2 * MAX_PCA_FILTERS, 0.0f);
+        m_pSourceStarted.assign(m_nMaxSources, false);
+    }
+
+    int components() const { return m_nComponents; }
+
+    // Fraction of the bank's variance (around the mean) the kept components reproduce
+    float explainedVariance() const { return m_fExplainedVariance; }
+
+    static int clampComponentCount(int numComponents) {
+        return std::min(std::max(numComponents, MIN_PCA_COMPONENTS), MAX_PCA_COMPONENTS);
+    }
+
+    void process(const SpatialSource* pSources, int numSources, float* pOutLeft, float* pOutRight, int numSamples) {
+        memset(&m_pBus_L[0], 0, sizeof(float)*m_pBus_L.size());
+        memset(&m_pBus_R[0], 0, sizeof(float)*m_pBus_R.size());
+        for(int s = 0; s < numSources && s < m_nMaxSources; s++)
+            mix(pSources[s], s, numSamples);
+
+        memset(pOutLeft, 0, sizeof(float)*numSamples);
+        memset(pOutRight, 0, sizeof(float)*numSamples);
+        for(int k = 0; k < filters(); k++) {
+            m_pBasis_L[k].process(&m_pBus_L[k * m_nBlockSize], &m_pScratch[0], numSamples);
+            vectorAdd(pOutLeft, &m_pScratch[0], numSamples);
+            m_pBasis_R[k].process(&m_pBus_R[k * m_nBlockSize], &m_pScratch[0], numSamples);
+            vectorAdd(pOutRight, &m_pScratch[0], numSamples);
+        }
+    }
+
+    /*
+     Weights for an arbitrary direction, interpolated over the enclosing triangle of measured
+     positions. pGains gets 1 for the mean filter followed by the K component weights, for each ear.
+     */
+    void computeGains(float azimuth, float elevation, float* pGains_L, float* pGains_R) {
+        int positions[3];
+        float amounts[3];
+        int count = m_SphericalGrid.interpolate(azimuth, elevation, positions, amounts);
+
+        pGains_L[0] = 1.0f;
+        pGains_R[0] = 1.0f;
+        for(int k = 0; k < m_nComponents; k++) {
+            float wL = 0.0f, wR = 0.0f;
+            for(int n = 0; n < count; n++) {
+                wL += amounts[n] * m_pWeights_L[positions[n] * m_nComponents + k];
+                wR += amounts[n] * m_pWeights_R[positions[n] * m_nComponents + k];
+            }
+            pGains_L[k + 1] = wL;
+            pGains_R[k + 1] = wR;
+        }
+    }
+
+private:
+
+    int filters() const { return m_nComponents + 1; }
+
+    void mix(const SpatialSource& source, int sourceIndex, int numSamples) {
+        float target[2 * MAX_PCA_FILTERS];
+        computeGains(source.fAzimuth, source.fElevation, target, target + MAX_PCA_FILTERS);
+
+        float* pGains = &m_pSourceGains[sourceIndex * 2 * MAX_PCA_FILTERS];
+        if(!m_pSourceStarted[sourceIndex]) {
+            memcpy(pGains, target, sizeof(target));
+            m_pSourceStarted[sourceIndex] = true;
+        }
+
+        for(int i = 0; i < numSamples; i++)
+            m_pScratch[i] = source.fGain * source.pInput[i];
+
+        float inverseLength = 1.0f / float(numSamples);
+        for(int ear = 0; ear < 2; ear++) {
+            float* pBus = ear == 0 ? &m_pBus_L[0] : &m_pBus_R[0];
+            for(int k = 0; k < filters(); k++) {
+                int g = ear * MAX_PCA_FILTERS + k;
+                float step = (target[g] - pGains[g]) * inverseLength;
+                vectorRampedMultiplyAccumulate(pBus + k * m_nBlockSize, &m_pScratch[0], pGains[g], step, numSamples);
+                pGains[g] = target[g];
+            }
+        }
+    }
+
+    /*
+     PCA through the positions x positions Gram matrix of the mean-removed IRs (cheaper than the
+     taps x taps covariance when IRs are long). Eigenvectors come from power iteration with
+     deflation. Writes the mean and the unit-energy component filters into basis and the
+     per-position weights into weights; returns the fraction of variance kept.
+     */
+    float decompose(const HRIRGrid& grid, int ear, std::vector<float>& basis, std::vector<float>& weights) {
+        int n = grid.size();
+        int irLength = grid.irLength();
+
+        float* pMean = &basis[0];
+        memset(pMean, 0, sizeof(float)*irLength);
+        for(int d = 0; d < n; d++) {
+            const float* pIR = ear == 0 ? grid.leftIR(d) : grid.rightIR(d);
+            for(int t = 0; t < irLength; t++)
+                pMean[t] += pIR[t];
+        }
+        for(int t = 0; t < irLength; t++)
+            pMean[t] /= float(n);
+
+        std::vector<float> centred(n * irLength);
+        for(int d = 0; d < n; d++) {
+            const float* pIR = ear == 0 ? grid.leftIR(d) : grid.rightIR(d);
+            for(int t = 0; t < irLength; t++)
+                centred[d * irLength + t] = pIR[t] - pMean[t];
+        }
+
+        std::vector<double> gram(n * n);
+        double totalVariance = 0.0;
+        for(int a = 0; a < n; a++) {
+            const float* pA = &centred[a * irLength];
+            for(int b = a; b < n; b++) {
+                const float* pB = &centred[b * irLength];
+                double sum = 0.0;
+                for(int t = 0; t < irLength; t++)
+                    sum += pA[t] * pB[t];
+                gram[a * n + b] = sum;
+                gram[b * n + a] = sum;
+            }
+            totalVariance += gram[a * n + a];
+        }
+
+        weights.assign(n * m_nComponents, 0.0f);
+        std::vector<double> v(n), next(n);
+        double keptVariance = 0.0;
+        for(int k = 0; k < m_nComponents; k++) {
+            for(int d = 0; d < n; d++)
+                v[d] = 1.0 + 0.001 * ((d * 7919 + k * 104729) % 1000);
+            double eigenvalue = powerIteration(gram, n, v, next);
+            if(eigenvalue <= 0.0)
+                break;
+            keptVariance += eigenvalue;
+
+            // deflate so the next iteration finds the next component
+            for(int a = 0; a < n; a++)
+                for(int b = 0; b < n; b++)
+                    gram[a * n + b] -= eigenvalue * v[a] * v[b];
+
+            // basis = X' v / sqrt(lambda) has unit energy, weights = sqrt(lambda) v
+            double scale = sqrt(eigenvalue);
+            float* pFilter = &basis[(k + 1) * irLength];
+            memset(pFilter, 0, sizeof(float)*irLength);
+            for(int d = 0; d < n; d++)
+                vectorMultiplyAccumulate(pFilter, &centred[d * irLength], float(v[d] / scale), irLength);
+            for(int d = 0; d < n; d++)
+                weights[d * m_nComponents + k] = float(v[d] * scale);
+        }
+
+        return totalVariance > 0.0 ? float(keptVariance / totalVariance) : 1.0f;
+    }
+
+    // Dominant eigenvector of a symmetric positive semi-definite matrix, normalised in place
+    static double powerIteration(const std::vector<double>& matrix, int n, std::vector<double>& v, std::vector<double>& next) {
+        double eigenvalue = 0.0;
+        normalise(v);
+        for(int iteration = 0; iteration < 500; iteration++) {
+            for(int a = 0; a < n; a++) {
+                double sum = 0.0;
+                const double* pRow = &matrix[a * n];
+                for(int b = 0; b < n; b++)
+                    sum += pRow[b] * v[b];
+                next[a] = sum;
+            }
+            double previous = eigenvalue;
+            eigenvalue = normalise(next);
+            v.swap(next);
+            if(fabs(eigenvalue - previous) <= 1e-10 * eigenvalue)
+                break;
+        }
+        return eigenvalue;
+    }
+
+    static double normalise(std::vector<double>& v) {
+        double norm = 0.0;
+        for(size_t i = 0; i < v.size(); i++)
+            norm += v[i] * v[i];
+        norm = sqrt(norm);
+        if(norm > 0.0) {
+            for(size_t i = 0; i < v.size(); i++)
+                v[i] /= norm;
+        }
+        return norm;
+    }
+
+    int m_nComponents;
+    int m_nBlockSize;
+    int m_nMaxSources;
+    int m_nPositions;
+    float m_fExplainedVariance;
+
+    // K weights per position, position-major
+    std::vector<float> m_pWeights_L;
+    std::vector<float> m_pWeights_R;
+
+    // triangulation of the measured positions, for weight interpolation
+    SphericalGrid m_SphericalGrid;
+
+    // basis buses, filter-major, (K+1) * m_nBlockSize per ear
+    std::vector<float> m_pBus_L;
+    std::vector<float> m_pBus_R;
+    std::vector<float> m_pScratch;
+
+    // last gains used for each source (left then right), for ramping
+    std::vector<float> m_pSourceGains;
+    std::vector<bool> m_pSourceStarted;
+
+    // [0] is the mean filter, then one filter per component
+    fftconvolver::FFTConvolver m_pBasis_L[MAX_PCA_FILTERS];
+    fftconvolver::FFTConvolver m_pBasis_R[MAX_PCA_FILTERS];
+};
+
+#endif /* PCARenderer_hpp */
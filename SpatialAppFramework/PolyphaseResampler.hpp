@@ -0,0 +1,206 @@
+//
+//  PolyphaseResampler.hpp
+//  Capstone
+//
+
+#ifndef PolyphaseResampler_hpp
+#define PolyphaseResampler_hpp
+
+#include "VectorOps.hpp"
+#include <vector>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <climits>
+
+// a ratio needing more phases than this interpolates between this many
+#define RESAMPLER_MAX_PHASES 1024
+
+// Filter lengths to pick from, each with the window that suits it: about -50, -70 and -95 dB
+// of error and aliasing, flat to within 0.1 dB up to about 65%, 75% and 85% of the lower
+// Nyquist frequency
+enum ResamplerQuality {
+    ResamplerQualityLow,
+    ResamplerQualityMedium,
+    ResamplerQualityHigh
+};
+
+/*
+	PolyphaseResampler
+	Streaming sample-rate conversion by a rational ratio: the output is upsampled by L, lowpass
+	filtered and decimated by M, where L/M is the rate ratio reduced. Only the filter phase each
+	output sample lands on is evaluated, one SIMD dot product over taps contiguous input samples,
+	the phases stored tap-major so each is one row of the table. Ratios that would need more than
+	RESAMPLER_MAX_PHASES phases interpolate between the two nearest of that many.
+	The filter is a Kaiser-windowed sinc cut off below the lower of the two Nyquist frequencies,
+	each phase normalised to unit gain at DC. The resampler starts as if preceded by silence and
+	keeps its history across process() calls, so a stream can be fed in blocks of any size up
+	to the one given to init(), or pulled exactly as much as inputNeeded() says a number of
+	outputs takes.
+ */
+class PolyphaseResampler {
+public:
+
+    PolyphaseResampler() {
+        m_nUp = 1;
+        m_nDown = 1;
+        m_nPhases = 1;
+        m_nTaps = 0;
+        m_nFill = 0;
+        m_nIndex = 0;
+        m_nFraction = 0;
+    }
+
+    // Builds the filter for a conversion and allocates room for blocks of up to maxInput samples.
+    // Not real-time safe.
+    void init(int inputRate, int outputRate, int maxInput, int quality = ResamplerQualityHigh) {
+        int divisor = greatestCommonDivisor(inputRate, outputRate);
+        m_nUp = outputRate / divisor;
+        m_nDown = inputRate / divisor;
+        m_nPhases = std::min(m_nUp, int(RESAMPLER_MAX_PHASES));
+        quality = std::min(std::max(quality, int(ResamplerQualityLow)), int(ResamplerQualityHigh));
+        // downsampling narrows the passband, so the filter gets that much longer to keep its shape
+        float scale = std::min(1.0f, float(outputRate) / float(inputRate));
+        m_nTaps = (int(ceilf(tapsForQuality(quality) / scale)) + 3) / 4 * 4;
+
+        buildTable(scale, betaForQuality(quality));
+        m_pBuffer.assign(m_nTaps + maxInput, 0.0f);
+        reset();
+    }
+
+    // Back to silence
+    void reset() {
+        std::fill(m_pBuffer.begin(), m_pBuffer.end(), 0.0f);
+        // the first output lines up with the first input sample, half the taps before it
+        m_nFill = m_nTaps / 2 - 1;
+        m_nIndex = m_nTaps / 2 - 1;
+        m_nFraction = 0;
+    }
+
+    // Taps of a ResamplerQuality when upsampling, a multiple of 4 for the SIMD dot product
+    static int tapsForQuality(int quality) {
+        static const int taps[3] = {16, 32, 64};
+        return taps[std::min(std::max(quality, int(ResamplerQualityLow)), int(ResamplerQualityHigh))];
+    }
+
+    // Delay from an input sample to its output, in input samples
+    int latency() const { return m_nTaps / 2; }
+
+    // Input samples the next numOutput output samples still need, so a caller pulling its input
+    // can ask for exactly that much
+    int inputNeeded(int numOutput) const {
+        if(numOutput <= 0)
+            return 0;
+        long long last = m_nIndex + (m_nFraction + (long long)(numOutput - 1) * m_nDown) / m_nUp;
+        return std::max(int(last + m_nTaps / 2 + 1 - m_nFill), 0);
+    }
+
+    // Most output samples numInput input samples can produce
+    int maxOutput(int numInput) const {
+        return int((long long)(numInput + m_nTaps) * m_nUp / m_nDown) + 1;
+    }
+
+    // Resamples numInput samples (at most init()'s maxInput) and returns the number written to
+    // out: every output whose taps have all arrived, up to outputLimit
+    int process(const float* in, int numInput, float* out, int outputLimit = INT_MAX) {
+        memcpy(&m_pBuffer[m_nFill], in, numInput * sizeof(float));
+        m_nFill += numInput;
+
+        int half = m_nTaps / 2;
+        int written = 0;
+        const float* pTable = &m_pTable[0];
+        while(m_nIndex + half < m_nFill && written < outputLimit) {
+            const float* pTaps = &m_pBuffer[m_nIndex - half + 1];
+            if(m_nPhases == m_nUp)
+                out[written++] = vectorDotProduct(pTaps, pTable + m_nFraction * m_nTaps, m_nTaps);
+            else {
+                long long scaled = (long long)m_nFraction * m_nPhases;
+                int phase = int(scaled / m_nUp);
+                float frac = float(scaled % m_nUp) / float(m_nUp);
+                float a = vectorDotProduct(pTaps, pTable + phase * m_nTaps, m_nTaps);
+                float b = vectorDotProduct(pTaps, pTable + (phase + 1) * m_nTaps, m_nTaps);
+                out[written++] = a + frac * (b - a);
+            }
+            m_nFraction += m_nDown;
+            m_nIndex += m_nFraction / m_nUp;
+            m_nFraction %= m_nUp;
+        }
+
+        // keep what the next output's taps start from
+        int consumed = std::min(m_nIndex - half + 1, m_nFill);
+        memmove(&m_pBuffer[0], &m_pBuffer[consumed], (m_nFill - consumed) * sizeof(float));
+        m_nFill -= consumed;
+        m_nIndex -= consumed;
+        return written;
+    }
+
+private:
+
+    static int greatestCommonDivisor(int a, int b) {
+        while(b) {
+            int r = a % b;
+            a = b;
+            b = r;
+        }
+        return a;
+    }
+
+    // Zeroth-order modified Bessel function, for the Kaiser window
+    static double besselI0(double x) {
+        double sum = 1.0, term = 1.0;
+        for(int k = 1; k < 50 && term > 1e-12 * sum; k++) {
+            term *= (x / (2.0 * k)) * (x / (2.0 * k));
+            sum += term;
+        }
+        return sum;
+    }
+
+    // Kaiser window shape of a ResamplerQuality
+    static float betaForQuality(int quality) {
+        static const float beta[3] = {4.5f, 6.5f, 9.0f};
+        return beta[quality];
+    }
+
+    // Row p holds the taps of phase p, output p/phases of an input sample after the centre tap.
+    // The extra last row, a whole sample on, is what interpolated phases end on. The cutoff sits
+    // half the window's transition band below the lower Nyquist frequency, so the stopband starts
+    // right at it.
+    void buildTable(float scale, float beta) {
+        m_pTable.assign((m_nPhases + 1) * m_nTaps, 0.0f);
+        double attenuation = beta / 0.1102 + 8.7;
+        double transition = (attenuation - 8.0) / (2.285 * m_nTaps * 2.0 * M_PI);
+        double cutoff = 0.5 * scale - 0.5 * transition;
+        double half = 0.5 * m_nTaps;
+        double norm = besselI0(beta);
+        for(int p = 0; p <= m_nPhases; p++) {
+            float* pRow = &m_pTable[p * m_nTaps];
+            double phase = double(p) / m_nPhases;
+            double sum = 0.0;
+            for(int k = 0; k < m_nTaps; k++) {
+                // distance from the output to this tap, in input samples
+                double d = half - 1.0 + phase - k;
+                double x = d / half;
+                double window = fabs(x) < 1.0 ? besselI0(beta * sqrt(1.0 - x * x)) / norm : 0.0;
+                double sinc = d == 0.0 ? 1.0 : sin(2.0 * M_PI * cutoff * d) / (2.0 * M_PI * cutoff * d);
+                pRow[k] = float(window * sinc);
+                sum += pRow[k];
+            }
+            for(int k = 0; k < m_nTaps; k++)
+                pRow[k] = float(pRow[k] / sum);
+        }
+    }
+
+    int m_nUp, m_nDown;
+    int m_nPhases;
+    int m_nTaps;
+    // [phase][tap]
+    std::vector<float> m_pTable;
+    // input from the next output's first tap on, m_nFill samples of it
+    std::vector<float> m_pBuffer;
+    int m_nFill;
+    // the next output's centre tap in m_pBuffer, and how far past it in 1/m_nUp samples
+    int m_nIndex;
+    int m_nFraction;
+};
+
+#endif /* PolyphaseResampler_hpp */
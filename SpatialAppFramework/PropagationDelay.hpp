@@ -0,0 +1,95 @@
+//
+//  PropagationDelay.hpp
+//  Capstone
+//
+
+#ifndef PropagationDelay_hpp
+#define PropagationDelay_hpp
+
+#include "DDLModule.hpp"
+#include <cmath>
+#include <algorithm>
+
+// metres per second, at 20 °C
+#define SPEED_OF_SOUND 343.0f
+// time constant of the distance smoothing
+#define PROPAGATION_SMOOTHING_MS 50.0f
+// fastest the delay may change, in samples per sample; keeps the Doppler shift within 0.5x to 1.5x
+#define PROPAGATION_MAX_SLEW 0.5f
+
+/*
+	PropagationDelay
+	Delays one source by the time its sound takes to reach the listener. The distance is smoothed
+	once per block and the delay ramps linearly over the block, so a moving source comes out
+	Doppler shifted. Its output is what the convolvers and bus renderers are fed.
+	A CDDLModule per source, two seconds long (686 m at most), read with a 3rd order Lagrange
+	interpolator by default.
+ */
+class PropagationDelay {
+public:
+
+    PropagationDelay() {
+        m_fSampleRate = 44100.0f;
+        m_fMaxDelay = 0.0f;
+        m_fDelay = 0.0f;
+        m_bStarted = false;
+    }
+
+    // Allocates the delay line. Not real-time safe.
+    void init(float sampleRate) {
+        m_fSampleRate = sampleRate;
+        m_DelayLine.m_nSampleRate = int(sampleRate);
+        m_DelayLine.m_fWetLevel = 1.0f;
+        m_DelayLine.m_fFeedback = 0.0f;
+        m_DelayLine.m_nInterpolation = DDLInterpolationLagrange3;
+        m_DelayLine.prepare();
+        m_fMaxDelay = 2.0f * sampleRate - 2.0f * BUFFER_MARGIN;
+        m_bStarted = false;
+    }
+
+    // Forgets the input and jumps straight to the next distance it is given
+    void reset() {
+        m_DelayLine.resetDelay();
+        m_bStarted = false;
+    }
+
+    // A DDLInterpolation, see DDLModule.hpp for what each costs
+    void setInterpolation(int interpolation) {
+        m_DelayLine.m_nInterpolation = interpolation;
+    }
+
+    // distance in metres; pInput and pOutput may be the same buffer
+    void process(const float* pInput, float* pOutput, float distance, int numSamples) {
+        float target = std::min(std::max(distance, 0.0f) / SPEED_OF_SOUND * m_fSampleRate, m_fMaxDelay);
+        if(!m_bStarted) {
+            m_fDelay = target;
+            m_DelayLine.m_fDelayInSamples = m_fDelay;
+            m_DelayLine.resetDelay();
+            m_bStarted = true;
+        }
+        else {
+            float blockTime = 1000.0f * numSamples / m_fSampleRate;
+            float smoothed = m_fDelay + (1.0f - expf(-blockTime / PROPAGATION_SMOOTHING_MS)) * (target - m_fDelay);
+            float maxStep = PROPAGATION_MAX_SLEW * numSamples;
+            m_fDelay = std::min(std::max(smoothed, m_fDelay - maxStep), m_fDelay + maxStep);
+            m_DelayLine.m_fDelayInSamples = m_fDelay;
+        }
+        m_DelayLine.processBlock(pInput, pOutput, numSamples);
+    }
+
+    // Where the delay ended up after the last block, in samples
+    float delayInSamples() const { return m_fDelay; }
+
+private:
+
+    // kept free at the far end of the line for the interpolator and the block writes
+    enum { BUFFER_MARGIN = DDL_CHUNK + DDL_MAX_TAPS };
+
+    CDDLModule m_DelayLine;
+    float m_fSampleRate;
+    float m_fMaxDelay;
+    float m_fDelay;
+    bool m_bStarted;
+};
+
+#endif /* PropagationDelay_hpp */
@@ -0,0 +1,154 @@
+//
+//  QualityGovernor.hpp
+//  Capstone
+//
+
+#ifndef QualityGovernor_hpp
+#define QualityGovernor_hpp
+
+#include <chrono>
+#include <atomic>
+#include <algorithm>
+
+#define QUALITY_LEVELS 5
+
+// step down as soon as a block leaves less than this fraction of the deadline free
+#define QUALITY_MIN_HEADROOM 0.3f
+// step back up once the smoothed load has left this much free for QUALITY_RESTORE_BLOCKS
+#define QUALITY_RESTORE_HEADROOM 0.6f
+#define QUALITY_RESTORE_BLOCKS 100
+// blocks to wait after a change before judging the new level
+#define QUALITY_SETTLE_BLOCKS 2
+
+/*
+	QualitySettings
+	What the direct render path may spend at one quality level.
+ */
+struct QualitySettings {
+    // taps of each HRIR that are convolved
+    int nIRLength;
+    // crossfade on HRIR switches, or cut at the block boundary
+    bool bCrossfade;
+    // render the sources through one shared cluster instead of one HRIR pair each
+    bool bCluster;
+    // azimuth step positions are snapped to, in degrees; 0 uses the measured grid (3°/6°)
+    float fGridStep;
+};
+
+/*
+	QualityGovernor
+	Times the render blocks it can act on against their deadline (block size / sample rate) and trades
+	localisation detail for CPU before the block runs late: a single block with too little
+	headroom steps the quality down a level straight away, and it only steps back up after a
+	long run of comfortable blocks, so the level does not oscillate.
+	beginBlock/endBlock/reset/level are called from the render thread; setEnabled and the getters
+	are safe to call from any thread.
+ */
+class QualityGovernor {
+public:
+
+    QualityGovernor() {
+        m_fDeadline = 0.0;
+        m_fLoad = 0.0f;
+        m_fSmoothedLoad = 0.0f;
+        m_nLevel = 0;
+        m_nHoldBlocks = 0;
+        m_nCalmBlocks = 0;
+        m_bEnabled = true;
+    }
+
+    void init(double sampleRate, int blockSize) {
+        m_fDeadline = double(blockSize) / sampleRate;
+        reset();
+    }
+
+    // Back to full quality with no load history, for a render path that starts over
+    void reset() {
+        m_fLoad = 0.0f;
+        m_fSmoothedLoad = 0.0f;
+        m_nLevel = 0;
+        // the first blocks after a restart run on cold caches
+        m_nHoldBlocks = QUALITY_SETTLE_BLOCKS;
+        m_nCalmBlocks = 0;
+    }
+
+    // Disabled, the level stays at full quality
+    void setEnabled(bool enabled) {
+        m_bEnabled = enabled;
+        if(!enabled)
+            m_nLevel = 0;
+    }
+
+    bool enabled() const { return m_bEnabled; }
+
+    // 0 is full quality, QUALITY_LEVELS - 1 the cheapest
+    int level() const { return m_bEnabled ? m_nLevel.load() : 0; }
+
+    const QualitySettings& settings() const { return settingsForLevel(level()); }
+
+    // Render time of the last block as a fraction of its deadline
+    float load() const { return m_fLoad; }
+
+    static const QualitySettings& settingsForLevel(int level) {
+        static const QualitySettings levels[QUALITY_LEVELS] = {
+            {8192, true,  false, 0.0f},
+            {4096, true,  false, 0.0f},
+            {2048, false, false, 0.0f},
+            {2048, false, false, 12.0f},
+            {1024, false, true,  12.0f}
+        };
+        return levels[std::min(std::max(level, 0), QUALITY_LEVELS - 1)];
+    }
+
+    void beginBlock() {
+        m_Start = std::chrono::steady_clock::now();
+    }
+
+    void endBlock() {
+        if(m_fDeadline <= 0.0)
+            return;
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_Start).count();
+        float load = float(elapsed / m_fDeadline);
+        m_fLoad = load;
+        // follows rises at once and falls over a few dozen blocks
+        m_fSmoothedLoad = load > m_fSmoothedLoad ? load : m_fSmoothedLoad + 0.05f*(load - m_fSmoothedLoad);
+
+        if(!m_bEnabled)
+            return;
+        if(m_nHoldBlocks > 0) {
+            m_nHoldBlocks--;
+            return;
+        }
+
+        int level = m_nLevel.load();
+        if(1.0f - load < QUALITY_MIN_HEADROOM) {
+            m_nCalmBlocks = 0;
+            if(level < QUALITY_LEVELS - 1) {
+                m_nLevel = level + 1;
+                m_nHoldBlocks = QUALITY_SETTLE_BLOCKS;
+            }
+        }
+        else if(1.0f - m_fSmoothedLoad > QUALITY_RESTORE_HEADROOM) {
+            if(++m_nCalmBlocks >= QUALITY_RESTORE_BLOCKS && level > 0) {
+                m_nLevel = level - 1;
+                m_nCalmBlocks = 0;
+                m_nHoldBlocks = QUALITY_SETTLE_BLOCKS;
+            }
+        }
+        else {
+            m_nCalmBlocks = 0;
+        }
+    }
+
+private:
+    double m_fDeadline;
+    std::chrono::steady_clock::time_point m_Start;
+    std::atomic<float> m_fLoad;
+    float m_fSmoothedLoad;
+    std::atomic<int> m_nLevel;
+    int m_nHoldBlocks;
+    int m_nCalmBlocks;
+    std::atomic<bool> m_bEnabled;
+};
+
+#endif /* QualityGovernor_hpp */
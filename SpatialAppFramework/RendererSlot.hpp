@@ -0,0 +1,84 @@
+//
+//  RendererSlot.hpp
+//  Capstone
+//
+
+#ifndef RendererSlot_hpp
+#define RendererSlot_hpp
+
+#include <atomic>
+#include <cstddef>
+
+/*
+	RendererSlot
+	Hands renderer instances built off the render thread to the render thread.
+	A builder publishes a fully set up instance; the render thread adopts it at the start of a
+	block and lets go of the one it replaces, which the builder frees on its next pass. One
+	instance is in flight at a time. Nothing is built or freed on the render thread and the
+	render thread never waits.
+ */
+template<class Renderer>
+class RendererSlot {
+public:
+
+    RendererSlot() : m_pPending(NULL), m_pLive(NULL), m_pRetired(NULL) {}
+
+    ~RendererSlot() {
+        clear();
+    }
+
+    // Frees every instance. Not while the render thread may be using the slot.
+    void clear() {
+        delete m_pPending.exchange(NULL);
+        delete m_pLive.exchange(NULL);
+        delete m_pRetired.exchange(NULL);
+    }
+
+    // Builder: whether the render thread has picked up the last instance; only then is the next
+    // one published
+    bool ready() const {
+        return m_pPending.load(std::memory_order_acquire) == NULL;
+    }
+
+    void publish(Renderer* renderer) {
+        m_pPending.store(renderer, std::memory_order_release);
+    }
+
+    // Builder: frees the instance the render thread let go of. Returns whether a swap is still
+    // in flight, so the builder knows to come back.
+    bool collect() {
+        if(!ready())
+            return true;
+        delete m_pRetired.exchange(NULL, std::memory_order_acq_rel);
+        return false;
+    }
+
+    // Render thread: swaps in a published instance. The one it replaces is retired before the
+    // published one is cleared, so a builder that sees nothing pending also sees what to free.
+    // Returns whether it swapped.
+    bool adopt() {
+        Renderer* renderer = m_pPending.load(std::memory_order_acquire);
+        if(!renderer || m_pRetired.load(std::memory_order_acquire))
+            return false;
+        Renderer* old = m_pLive.load(std::memory_order_relaxed);
+        m_pLive.store(renderer, std::memory_order_relaxed);
+        if(old)
+            m_pRetired.store(old, std::memory_order_release);
+        m_pPending.store(NULL, std::memory_order_release);
+        return true;
+    }
+
+    // Render thread: the instance to render with, NULL until one has been adopted
+    Renderer* live() const {
+        return m_pLive.load(std::memory_order_relaxed);
+    }
+
+private:
+
+    // built by the builder, in use by the render thread, waiting for the builder to free it
+    std::atomic<Renderer*> m_pPending;
+    std::atomic<Renderer*> m_pLive;
+    std::atomic<Renderer*> m_pRetired;
+};
+
+#endif /* RendererSlot_hpp */
@@ -0,0 +1,218 @@
+//
+//  SceneRotator.hpp
+//  Capstone
+//
+
+#ifndef SceneRotator_hpp
+#define SceneRotator_hpp
+
+#include "SphericalHarmonics.hpp"
+#include "VectorOps.hpp"
+#include <atomic>
+#include <vector>
+#include <cstring>
+
+#define QUATERNION_QUEUE_SIZE 64
+
+// Unit quaternion, axes are x front, y left, z up (same frame as HRIRGrid)
+struct Quaternion {
+    float w, x, y, z;
+};
+
+/*
+	QuaternionQueue
+	Single producer (sensor / UI thread), single consumer (render thread) ring.
+	Never blocks or allocates; when full, new orientations are dropped until the render thread catches up.
+ */
+class QuaternionQueue {
+public:
+
+    QuaternionQueue() : m_nWriteIndex(0), m_nReadIndex(0) {}
+
+    bool push(const Quaternion& q) {
+        unsigned write = m_nWriteIndex.load(std::memory_order_relaxed);
+        unsigned next = (write + 1) % QUATERNION_QUEUE_SIZE;
+        if(next == m_nReadIndex.load(std::memory_order_acquire))
+            return false;
+        m_pQueue[write] = q;
+        m_nWriteIndex.store(next, std::memory_order_release);
+        return true;
+    }
+
+    // Drains the queue and keeps only the newest orientation
+    bool popLatest(Quaternion& q) {
+        unsigned read = m_nReadIndex.load(std::memory_order_relaxed);
+        unsigned write = m_nWriteIndex.load(std::memory_order_acquire);
+        if(read == write)
+            return false;
+        q = m_pQueue[(write + QUATERNION_QUEUE_SIZE - 1) % QUATERNION_QUEUE_SIZE];
+        m_nReadIndex.store(write, std::memory_order_release);
+        return true;
+    }
+
+private:
+    Quaternion m_pQueue[QUATERNION_QUEUE_SIZE];
+    std::atomic<unsigned> m_nWriteIndex;
+    std::atomic<unsigned> m_nReadIndex;
+};
+
+/*
+	SceneRotator
+	Rotates a whole spherical-harmonic bus by the listener's head orientation.
+	The per-order rotation matrices come from the Ivanic-Ruedenberg recursion, so an orientation
+	update costs O(order³) per block and applying it O(order²) per sample, independent of source count.
+	Matrix entries are ramped across the block so head movement does not zipper.
+ */
+class SceneRotator {
+public:
+
+    SceneRotator() {
+        m_nOrder = 0;
+        m_nBlockSize = 0;
+        m_bIdentity = true;
+    }
+
+    void init(int order, int blockSize) {
+        m_nOrder = clampAmbisonicOrder(order);
+        m_nBlockSize = blockSize;
+        m_pScratch.assign((2*m_nOrder + 1) * m_nBlockSize, 0.0f);
+        Quaternion identity = {1.0f, 0.0f, 0.0f, 0.0f};
+        setOrientation(identity);
+        memcpy(m_pPreviousMatrix, m_pMatrix, sizeof(m_pMatrix));
+        m_bIdentity = true;
+    }
+
+    // Head orientation in the world; the scene is rotated the opposite way
+    void setOrientation(const Quaternion& head) {
+        float norm = sqrtf(head.w*head.w + head.x*head.x + head.y*head.y + head.z*head.z);
+        if(norm <= 0.0f)
+            return;
+        float w = head.w/norm, x = head.x/norm, y = head.y/norm, z = head.z/norm;
+
+        // Transpose of the head rotation matrix, rows/cols are x, y, z
+        float r[3][3];
+        r[0][0] = 1 - 2*(y*y + z*z); r[1][0] = 2*(x*y - w*z);     r[2][0] = 2*(x*z + w*y);
+        r[0][1] = 2*(x*y + w*z);     r[1][1] = 1 - 2*(x*x + z*z); r[2][1] = 2*(y*z - w*x);
+        r[0][2] = 2*(x*z - w*y);     r[1][2] = 2*(y*z + w*x);     r[2][2] = 1 - 2*(x*x + y*y);
+
+        computeMatrices(r);
+        m_bIdentity = false;
+    }
+
+    /*
+     Rotates the bus in place. pBus is channel-major with m_nBlockSize samples per channel.
+     Each order only mixes with itself, so the bus is rotated one order at a time.
+     */
+    void process(float* pBus, int numSamples) {
+        if(m_bIdentity)
+            return;
+
+        float inverseLength = 1.0f / float(numSamples);
+        for(int l = 1; l <= m_nOrder; l++) {
+            int size = 2*l + 1;
+            float* pBand = pBus + l*l*m_nBlockSize;
+            memcpy(&m_pScratch[0], pBand, sizeof(float)*size*m_nBlockSize);
+            memset(pBand, 0, sizeof(float)*size*m_nBlockSize);
+
+            const float* pOld = m_pPreviousMatrix + bandOffset(l);
+            const float* pNew = m_pMatrix + bandOffset(l);
+            for(int row = 0; row < size; row++) {
+                float* pOut = pBand + row*m_nBlockSize;
+                for(int col = 0; col < size; col++) {
+                    float gain = pOld[row*size + col];
+                    float step = (pNew[row*size + col] - gain) * inverseLength;
+                    if(gain == 0.0f && step == 0.0f)
+                        continue;
+                    vectorRampedMultiplyAccumulate(pOut, &m_pScratch[col*m_nBlockSize], gain, step, numSamples);
+                }
+            }
+        }
+        memcpy(m_pPreviousMatrix, m_pMatrix, sizeof(m_pMatrix));
+    }
+
+private:
+
+    // Offset of order l's (2l+1)x(2l+1) block in the packed matrix storage
+    static int bandOffset(int l) {
+        int offset = 0;
+        for(int k = 0; k < l; k++)
+            offset += (2*k + 1)*(2*k + 1);
+        return offset;
+    }
+
+    float& entry(int l, int m, int n) {
+        return m_pMatrix[bandOffset(l) + (m + l)*(2*l + 1) + (n + l)];
+    }
+
+    void computeMatrices(const float r[3][3]) {
+        entry(0, 0, 0) = 1.0f;
+
+        // Order 1 harmonics are proportional to (y, z, x)
+        static const int axis[3] = {1, 2, 0};
+        for(int m = -1; m <= 1; m++)
+            for(int n = -1; n <= 1; n++)
+                entry(1, m, n) = r[axis[m+1]][axis[n+1]];
+
+        for(int l = 2; l <= m_nOrder; l++) {
+            for(int m = -l; m <= l; m++) {
+                for(int n = -l; n <= l; n++) {
+                    int absM = m < 0 ? -m : m;
+                    float d = (m == 0) ? 1.0f : 0.0f;
+                    float denom = (n == l || n == -l) ? float((2*l)*(2*l - 1)) : float((l + n)*(l - n));
+                    float u = sqrtf((l + m)*(l - m) / denom);
+                    float v = 0.5f * sqrtf((1 + d)*(l + absM - 1)*(l + absM) / denom) * (1 - 2*d);
+                    float w = -0.5f * sqrtf((l - absM - 1)*(l - absM) / denom) * (1 - d);
+
+                    float value = 0.0f;
+                    if(u != 0.0f)
+                        value += u * P(0, l, m, n);
+                    if(v != 0.0f)
+                        value += v * V(l, m, n);
+                    if(w != 0.0f)
+                        value += w * W(l, m, n);
+                    entry(l, m, n) = value;
+                }
+            }
+        }
+    }
+
+    float P(int i, int l, int a, int b) {
+        float ri1 = entry(1, i, 1);
+        float rim1 = entry(1, i, -1);
+        float ri0 = entry(1, i, 0);
+        if(b == l)
+            return ri1*entry(l-1, a, l-1) - rim1*entry(l-1, a, -l+1);
+        if(b == -l)
+            return ri1*entry(l-1, a, -l+1) + rim1*entry(l-1, a, l-1);
+        return ri0*entry(l-1, a, b);
+    }
+
+    float V(int l, int m, int n) {
+        if(m == 0)
+            return P(1, l, 1, n) + P(-1, l, -1, n);
+        if(m > 0) {
+            float d = (m == 1) ? 1.0f : 0.0f;
+            return P(1, l, m - 1, n)*sqrtf(1 + d) - P(-1, l, -m + 1, n)*(1 - d);
+        }
+        float d = (m == -1) ? 1.0f : 0.0f;
+        return P(1, l, m + 1, n)*(1 - d) + P(-1, l, -m - 1, n)*sqrtf(1 + d);
+    }
+
+    float W(int l, int m, int n) {
+        if(m > 0)
+            return P(1, l, m + 1, n) + P(-1, l, -m - 1, n);
+        return P(1, l, m - 1, n) - P(-1, l, -m + 1, n);
+    }
+
+    int m_nOrder;
+    int m_nBlockSize;
+    bool m_bIdentity;
+
+    // Packed per-order blocks, 286 entries for order 5
+    float m_pMatrix[1 + 9 + 25 + 49 + 81 + 121];
+    float m_pPreviousMatrix[1 + 9 + 25 + 49 + 81 + 121];
+
+    std::vector<float> m_pScratch;
+};
+
+#endif /* SceneRotator_hpp */
@@ -0,0 +1,379 @@
+//
+//  SourceClusterer.hpp
+//  Capstone
+//
+
+#ifndef SourceClusterer_hpp
+#define SourceClusterer_hpp
+
+#include "HRTFBank.hpp"
+#include "SpatialSource.hpp"
+#include "VectorOps.hpp"
+#include <vector>
+#include <algorithm>
+#include <cstring>
+
+#define MIN_SOURCE_CLUSTERS 1
+#define MAX_SOURCE_CLUSTERS 16
+
+// k-means passes per block, starting from the previous block's clusters
+#define CLUSTER_ITERATIONS 3
+// a source only leaves its cluster for one that is this much closer (in cosine)
+#define CLUSTER_HYSTERESIS 0.02f
+
+/*
+	SourceClusterer
+	Level of detail for dense scenes. Every block the sources are grouped into at most K clusters
+	by direction with an importance-weighted k-means (importance is the 1/distance gain times the
+	source's smoothed loudness), and each cluster is rendered with the HRIR pair nearest to its
+	centroid. The number of binaural convolutions is bounded by K however many sources there are;
+	with K or fewer sources every source gets a cluster of its own.
+	A source that changes cluster is faded out of the old cluster bus and into the new one over
+	the block, and a cluster whose centroid moves onto another HRIR crossfades inside its
+	convolver, so reassignments do not click.
+ */
+class SourceClusterer {
+public:
+
+    SourceClusterer() {
+        m_pBank = NULL;
+        m_nClusters = 0;
+        m_nBlockSize = 0;
+        m_nIRLength = 0;
+        m_nMaxSources = 0;
+        m_bStarted = false;
+    }
+
+    // Points every cluster at a front-facing HRIR from the bank. Not real-time safe.
+    // blockSize has to be the bank's, and the bank has to outlive the clusterer. irLength
+    // truncates the HRIRs to their first taps, 0 convolves them whole.
+    void init(const HRTFBank& bank, int numClusters, int blockSize, int maxSources, int irLength = 0) {
+        m_pBank = &bank;
+        m_nClusters = clampClusterCount(numClusters);
+        m_nBlockSize = blockSize;
+        m_nIRLength = irLength > 0 ? std::min(irLength, bank.grid().irLength()) : bank.grid().irLength();
+        m_nMaxSources = maxSources;
+        m_bStarted = false;
+
+        // straight ahead is on the home rail, which is always prepared
+        int front = bank.sphericalGrid().nearest(0.0f, 0.0f);
+        for(int k = 0; k < MAX_SOURCE_CLUSTERS; k++) {
+            m_pClusterPosition[k] = front;
+            m_pClusterRail[k].init(bank);
+            if(k < m_nClusters) {
+                m_pCluster_L[k].init(m_nBlockSize, bank.leftSpectra(front), m_nIRLength);
+                m_pCluster_R[k].init(m_nBlockSize, bank.rightSpectra(front), m_nIRLength);
+            }
+            else {
+                m_pCluster_L[k].reset();
+                m_pCluster_R[k].reset();
+            }
+        }
+
+        m_pCentroids.assign(MAX_SOURCE_CLUSTERS * 3, 0.0f);
+        m_pClusterBus.assign(m_nClusters * m_nBlockSize, 0.0f);
+        m_pScratch.assign(m_nBlockSize, 0.0f);
+
+        m_pDirections.assign(m_nMaxSources * 3, 0.0f);
+        m_pLoudness.assign(m_nMaxSources, 0.0f);
+        m_pWeights.assign(m_nMaxSources, 0.0f);
+        m_pSourceCluster.assign(m_nMaxSources, -1);
+        m_pAssignment.assign(m_nMaxSources, 0);
+        m_pSourceGains.assign(m_nMaxSources * MAX_SOURCE_CLUSTERS, 0.0f);
+        m_pSourceStarted.assign(m_nMaxSources, false);
+    }
+
+    int clusters() const { return m_nClusters; }
+
+    // Lets go of the bank's rails, before the bank goes away. init() has to be called again
+    // before the next process().
+    void release() {
+        for(int k = 0; k < MAX_SOURCE_CLUSTERS; k++)
+            m_pClusterRail[k].release();
+    }
+
+    static int clampClusterCount(int numClusters) {
+        return std::min(std::max(numClusters, MIN_SOURCE_CLUSTERS), MAX_SOURCE_CLUSTERS);
+    }
+
+    // Drops the cluster tails and starts every source without a gain ramp, for when
+    // process() has not been called for a while
+    void silence() {
+        for(int k = 0; k < m_nClusters; k++) {
+            m_pCluster_L[k].silence();
+            m_pCluster_R[k].silence();
+        }
+        m_pSourceStarted.assign(m_nMaxSources, false);
+    }
+
+    // Cluster a source was put in by the last process() call
+    int clusterOf(int sourceIndex) const { return m_pSourceCluster[sourceIndex]; }
+
+    void process(const SpatialSource* pSources, int numSources, float* pOutLeft, float* pOutRight, int numSamples) {
+        numSources = std::min(numSources, m_nMaxSources);
+        measure(pSources, numSources, numSamples);
+        cluster(numSources);
+        updateFilters(numSources);
+
+        memset(&m_pClusterBus[0], 0, sizeof(float)*m_pClusterBus.size());
+        for(int s = 0; s < numSources; s++)
+            mix(pSources[s], s, numSamples);
+
+        // clusters that have been empty for a while are idle in their convolvers
+        memset(pOutLeft, 0, sizeof(float)*numSamples);
+        memset(pOutRight, 0, sizeof(float)*numSamples);
+        for(int k = 0; k < m_nClusters; k++) {
+            const float* pBus = &m_pClusterBus[k * m_nBlockSize];
+            m_pCluster_L[k].process(pBus, &m_pScratch[0], numSamples);
+            vectorAdd(pOutLeft, &m_pScratch[0], numSamples);
+            m_pCluster_R[k].process(pBus, &m_pScratch[0], numSamples);
+            vectorAdd(pOutRight, &m_pScratch[0], numSamples);
+        }
+    }
+
+private:
+
+    // Directions and clustering weights for this block
+    void measure(const SpatialSource* pSources, int numSources, int numSamples) {
+        float loudest = 0.0f;
+        for(int s = 0; s < numSources; s++) {
+            directionToVector(pSources[s].fAzimuth, pSources[s].fElevation, &m_pDirections[s * 3]);
+
+            float power = 0.0f;
+            for(int i = 0; i < numSamples; i++)
+                power += pSources[s].pInput[i] * pSources[s].pInput[i];
+            float level = sqrtf(power / float(numSamples));
+            // rise fast, fall over a few blocks so transients don't reshuffle the clusters
+            m_pLoudness[s] = level > m_pLoudness[s] ? level : 0.7f*m_pLoudness[s] + 0.3f*level;
+
+            m_pWeights[s] = pSources[s].fGain * m_pLoudness[s];
+            loudest = std::max(loudest, m_pWeights[s]);
+        }
+
+        // relative importance, with a floor so silent sources still pull on their cluster a little
+        float scale = loudest > 0.0f ? 1.0f / loudest : 0.0f;
+        for(int s = 0; s < numSources; s++)
+            m_pWeights[s] = m_pWeights[s] * scale + 0.01f;
+    }
+
+    void cluster(int numSources) {
+        if(numSources == 0)
+            return;
+        if(!m_bStarted) {
+            seed(numSources);
+            m_bStarted = true;
+        }
+
+        for(int iteration = 0; iteration < CLUSTER_ITERATIONS; iteration++) {
+            assign(numSources);
+            fillEmptyClusters(numSources);
+            updateCentroids(numSources);
+        }
+        assign(numSources);
+        fillEmptyClusters(numSources);
+    }
+
+    // Farthest-point start: the most important source, then whichever fits worst so far
+    void seed(int numSources) {
+        int first = 0;
+        for(int s = 1; s < numSources; s++)
+            if(m_pWeights[s] > m_pWeights[first])
+                first = s;
+        memcpy(&m_pCentroids[0], &m_pDirections[first * 3], sizeof(float)*3);
+
+        for(int k = 1; k < m_nClusters; k++) {
+            int worst = first;
+            float worstError = -1.0f;
+            for(int s = 0; s < numSources; s++) {
+                float error = m_pWeights[s] * (1.0f - dot(&m_pDirections[s * 3], &m_pCentroids[nearestCluster(&m_pDirections[s * 3], k) * 3]));
+                if(error > worstError) {
+                    worstError = error;
+                    worst = s;
+                }
+            }
+            memcpy(&m_pCentroids[k * 3], &m_pDirections[worst * 3], sizeof(float)*3);
+        }
+    }
+
+    void assign(int numSources) {
+        for(int s = 0; s < numSources; s++) {
+            const float* pDirection = &m_pDirections[s * 3];
+            int best = nearestCluster(pDirection, m_nClusters);
+            int previous = m_pSourceCluster[s];
+            if(previous >= 0 && previous < m_nClusters &&
+               dot(pDirection, &m_pCentroids[previous * 3]) >= dot(pDirection, &m_pCentroids[best * 3]) - CLUSTER_HYSTERESIS)
+                best = previous;
+            m_pAssignment[s] = best;
+        }
+    }
+
+    // Every empty cluster takes the worst-represented source from a cluster that has several,
+    // so sources only share a cluster once there are more of them than clusters
+    void fillEmptyClusters(int numSources) {
+        int members[MAX_SOURCE_CLUSTERS];
+        memset(members, 0, sizeof(members));
+        for(int s = 0; s < numSources; s++)
+            members[m_pAssignment[s]]++;
+
+        for(int k = 0; k < m_nClusters; k++) {
+            if(members[k] > 0)
+                continue;
+            int worst = -1;
+            float worstError = -1.0f;
+            for(int s = 0; s < numSources; s++) {
+                int c = m_pAssignment[s];
+                if(members[c] < 2)
+                    continue;
+                float error = m_pWeights[s] * (1.0f - dot(&m_pDirections[s * 3], &m_pCentroids[c * 3]));
+                if(error > worstError) {
+                    worstError = error;
+                    worst = s;
+                }
+            }
+            if(worst < 0)
+                break;
+            members[m_pAssignment[worst]]--;
+            members[k]++;
+            m_pAssignment[worst] = k;
+            memcpy(&m_pCentroids[k * 3], &m_pDirections[worst * 3], sizeof(float)*3);
+        }
+    }
+
+    // Importance-weighted mean direction of each cluster's sources
+    void updateCentroids(int numSources) {
+        float sums[MAX_SOURCE_CLUSTERS * 3];
+        memset(sums, 0, sizeof(sums));
+        for(int s = 0; s < numSources; s++) {
+            float* pSum = &sums[m_pAssignment[s] * 3];
+            for(int i = 0; i < 3; i++)
+                pSum[i] += m_pWeights[s] * m_pDirections[s * 3 + i];
+        }
+        for(int k = 0; k < m_nClusters; k++) {
+            float* pSum = &sums[k * 3];
+            float norm = sqrtf(dot(pSum, pSum));
+            // empty or opposing sources cancelling out: keep the old direction
+            if(norm < 1e-6f)
+                continue;
+            for(int i = 0; i < 3; i++)
+                m_pCentroids[k * 3 + i] = pSum[i] / norm;
+        }
+    }
+
+    // Points each occupied cluster at the HRIR nearest its centroid; empty ones keep theirs
+    // so their tails ring out with the filter they were using
+    void updateFilters(int numSources) {
+        bool occupied[MAX_SOURCE_CLUSTERS];
+        memset(occupied, 0, sizeof(occupied));
+        for(int s = 0; s < numSources; s++) {
+            m_pSourceCluster[s] = m_pAssignment[s];
+            occupied[m_pAssignment[s]] = true;
+        }
+
+        for(int k = 0; k < m_nClusters; k++) {
+            if(!occupied[k])
+                continue;
+            const float* c = &m_pCentroids[k * 3];
+            float azimuth = atan2f(c[1], c[0]) * float(180.0 / M_PI);
+            float elevation = asinf(std::min(std::max(c[2], -1.0f), 1.0f)) * float(180.0 / M_PI);
+            int position = m_pBank->sphericalGrid().nearest(azimuth, elevation);
+
+            // a rail that is not prepared yet is requested, and the cluster uses the same
+            // azimuth on the closest prepared rail until it is
+            m_pClusterRail[k].anticipate(elevation);
+            int rail = HRTFBank::railOf(position);
+            m_pClusterRail[k].follow(rail);
+            position = rail*NUM_OF_IRS + position % NUM_OF_IRS;
+
+            if(position != m_pClusterPosition[k]) {
+                m_pCluster_L[k].switchTo(m_pBank->leftSpectra(position), m_nIRLength);
+                m_pCluster_R[k].switchTo(m_pBank->rightSpectra(position), m_nIRLength);
+                m_pClusterPosition[k] = position;
+            }
+        }
+    }
+
+    // Ramps the source out of clusters it left and into the one it is in now
+    void mix(const SpatialSource& source, int sourceIndex, int numSamples) {
+        float target[MAX_SOURCE_CLUSTERS];
+        memset(target, 0, sizeof(target));
+        target[m_pSourceCluster[sourceIndex]] = 1.0f;
+
+        float* pGains = &m_pSourceGains[sourceIndex * MAX_SOURCE_CLUSTERS];
+        if(!m_pSourceStarted[sourceIndex]) {
+            memcpy(pGains, target, sizeof(target));
+            m_pSourceStarted[sourceIndex] = true;
+        }
+
+        for(int i = 0; i < numSamples; i++)
+            m_pScratch[i] = source.fGain * source.pInput[i];
+
+        float inverseLength = 1.0f / float(numSamples);
+        for(int k = 0; k < m_nClusters; k++) {
+            if(pGains[k] == 0.0f && target[k] == 0.0f)
+                continue;
+            float step = (target[k] - pGains[k]) * inverseLength;
+            vectorRampedMultiplyAccumulate(&m_pClusterBus[k * m_nBlockSize], &m_pScratch[0], pGains[k], step, numSamples);
+            pGains[k] = target[k];
+        }
+    }
+
+    int nearestCluster(const float* pDirection, int numClusters) const {
+        int best = 0;
+        float bestDot = -2.0f;
+        for(int k = 0; k < numClusters; k++) {
+            float d = dot(pDirection, &m_pCentroids[k * 3]);
+            if(d > bestDot) {
+                bestDot = d;
+                best = k;
+            }
+        }
+        return best;
+    }
+
+    static float dot(const float* a, const float* b) {
+        return a[0]*b[0] + a[1]*b[1] + a[2]*b[2];
+    }
+
+    static void directionToVector(float azimuth, float elevation, float* v) {
+        float az = degreesToRadians(azimuth);
+        float el = degreesToRadians(elevation);
+        v[0] = cosf(el)*cosf(az);
+        v[1] = cosf(el)*sinf(az);
+        v[2] = sinf(el);
+    }
+
+    const HRTFBank* m_pBank;
+    int m_nClusters;
+    int m_nBlockSize;
+    int m_nMaxSources;
+    // taps of each HRIR that are convolved
+    int m_nIRLength;
+    bool m_bStarted;
+
+    // unit centroid, current grid position and pinned bank rail of every cluster
+    std::vector<float> m_pCentroids;
+    int m_pClusterPosition[MAX_SOURCE_CLUSTERS];
+    RailTracker m_pClusterRail[MAX_SOURCE_CLUSTERS];
+
+    // cluster-major bus, m_nClusters * m_nBlockSize
+    std::vector<float> m_pClusterBus;
+    std::vector<float> m_pScratch;
+
+    // per source: unit direction, smoothed RMS, clustering weight
+    std::vector<float> m_pDirections;
+    std::vector<float> m_pLoudness;
+    std::vector<float> m_pWeights;
+
+    // cluster used for the last block, and the one being worked out for this block
+    std::vector<int> m_pSourceCluster;
+    std::vector<int> m_pAssignment;
+
+    // last gain of every source into every cluster, for ramping
+    std::vector<float> m_pSourceGains;
+    std::vector<bool> m_pSourceStarted;
+
+    fftconvolver::SwitchingConvolver m_pCluster_L[MAX_SOURCE_CLUSTERS];
+    fftconvolver::SwitchingConvolver m_pCluster_R[MAX_SOURCE_CLUSTERS];
+};
+
+#endif /* SourceClusterer_hpp */
@@ -0,0 +1,89 @@
+//
+//  SourceStream.hpp
+//  Capstone
+//
+
+#ifndef SourceStream_hpp
+#define SourceStream_hpp
+
+#include "PolyphaseResampler.hpp"
+#include <vector>
+#include <cstring>
+#include <algorithm>
+
+// Fills samples with up to numSamples of a source at its own rate and returns how many it
+// wrote. Called on the render thread, so it must not block.
+typedef int (*SourcePullFunction)(void* context, float* samples, int numSamples);
+
+/*
+	SourceStream
+	A source pulled at its own sample rate rather than taken from the input bus, the way the
+	host pulls the audio unit. Each block asks the source for exactly the samples the block
+	needs at the render rate and runs them through the source's own resampler, so sources at
+	different rates are mixed without resampling them beforehand. Samples the source cannot
+	provide in time are silence.
+ */
+class SourceStream {
+public:
+
+    SourceStream() {
+        m_pPull = NULL;
+        m_pContext = NULL;
+        m_bResampling = false;
+    }
+
+    // Attaches a source at sourceRate to a render running at renderRate; a NULL pull detaches.
+    // Not real-time safe.
+    void init(SourcePullFunction pull, void* context, int sourceRate, int renderRate, int blockSize, int quality) {
+        m_pPull = pull;
+        m_pContext = context;
+        m_bResampling = pull != NULL && sourceRate != renderRate;
+        if(m_bResampling) {
+            // a block's worth of source samples, plus at most the taps the first block waits for
+            // (the filter is longer by the downsampling ratio)
+            int taps = PolyphaseResampler::tapsForQuality(quality) * ((sourceRate + renderRate - 1) / renderRate) + 4;
+            int maxInput = int((long long)blockSize * sourceRate / renderRate) + 2 + taps;
+            m_Resampler.init(sourceRate, renderRate, maxInput, quality);
+            m_pInput.assign(maxInput, 0.0f);
+        }
+        else
+            m_pInput.clear();
+    }
+
+    bool isAttached() const { return m_pPull != NULL; }
+
+    void reset() {
+        if(m_bResampling)
+            m_Resampler.reset();
+    }
+
+    // The next numFrames samples of the source at the render rate
+    void render(float* out, int numFrames) {
+        if(!m_bResampling) {
+            pull(out, numFrames);
+            return;
+        }
+        int needed = std::min(m_Resampler.inputNeeded(numFrames), int(m_pInput.size()));
+        pull(&m_pInput[0], needed);
+        int written = m_Resampler.process(&m_pInput[0], needed, out, numFrames);
+        if(written < numFrames)
+            memset(out + written, 0, (numFrames - written) * sizeof(float));
+    }
+
+private:
+
+    // Whatever the source has, the rest silence
+    void pull(float* samples, int numSamples) {
+        int pulled = std::min(std::max(m_pPull(m_pContext, samples, numSamples), 0), numSamples);
+        if(pulled < numSamples)
+            memset(samples + pulled, 0, (numSamples - pulled) * sizeof(float));
+    }
+
+    SourcePullFunction m_pPull;
+    void* m_pContext;
+    bool m_bResampling;
+    PolyphaseResampler m_Resampler;
+    std::vector<float> m_pInput;
+};
+
+#endif /* SourceStream_hpp */
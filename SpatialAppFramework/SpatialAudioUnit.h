@@ -8,6 +8,10 @@
 
 #import <AudioToolbox/AudioToolbox.h>
 
+// Writes up to count samples of a source at its own rate and returns how many it wrote.
+// Called on the render thread.
+typedef NSInteger (^SpatialSourceProvider)(float *samples, NSInteger count);
+
 @interface SpatialAudioUnit : AUAudioUnit
 
 -(void)setAzimuthLeftAngle:(float)newAzimuthLeftAngle;
@@ -19,5 +23,35 @@
 -(void)setGain:(float)newGain;
 
 -(void)toggleHRTFMode:(bool)mode;
+-(void)setRenderMode:(int)mode;
+-(void)setAmbisonicOrder:(int)order;
+-(void)setVirtualSpeakerCount:(int)count;
+-(void)setPCAComponentCount:(int)count;
+-(void)setSourceClusterCount:(int)count;
+-(BOOL)isSourceActive:(int)source;
+-(void)setAdaptiveQuality:(BOOL)enabled;
+-(int)qualityLevel;
+-(float)renderLoad;
+-(void)setSpectrumPrecision:(int)precision;
+-(void)setPropagationDelay:(BOOL)enabled;
+-(void)setPropagationInterpolation:(int)interpolation;
+-(void)setReverb:(BOOL)enabled;
+-(void)setReverbSend:(float)send forSource:(int)source;
+-(void)setReverbTime:(float)seconds;
+-(void)setReverbDamping:(float)damping;
+-(void)setReverbLines:(int)lines;
+-(void)setEarlyReflections:(BOOL)enabled;
+-(void)setRoomLength:(float)length width:(float)width height:(float)height absorption:(float)absorption;
+-(void)setListenerPositionX:(float)x y:(float)y z:(float)z;
+-(void)setReflectionOrder:(int)order;
+-(void)setBRIR:(BOOL)enabled;
+-(BOOL)loadBRIRLeft:(const float *)left right:(const float *)right length:(int)length forSource:(int)source;
+-(int)brirDeadlineMisses;
+-(void)setNearField:(BOOL)enabled;
+-(void)setAirAbsorption:(BOOL)enabled;
+-(void)setHRIRCacheDirectory:(NSString *)path;
+-(void)setSource:(int)source sampleRate:(double)sampleRate provider:(SpatialSourceProvider)provider;
+-(void)setResamplerQuality:(int)quality;
+-(void)setHeadOrientationW:(float)w x:(float)x y:(float)y z:(float)z;
 
 @end
@@ -30,12 +30,23 @@
 @end
 
 
+// Calls a source's provider from the render thread
+static int pullSourceProvider(void *context, float *samples, int numSamples) {
+    SpatialSourceProvider provider = (__bridge SpatialSourceProvider)context;
+    return (int)provider(samples, numSamples);
+}
+
 @implementation SpatialAudioUnit {
     // C++ members need to be ivars; they would be copied on access if they were properties.
     // these provide objective-c wrappers to C++ objects
     SpatialDSPKernel _kernel;
     
     BufferedInputBus _inputBus;
+    
+    // source providers set for the next allocation, and the ones the kernel pulls from now
+    SpatialSourceProvider _sourceProviders[2];
+    double _sourceRates[2];
+    SpatialSourceProvider _liveSourceProviders[2];
 }
 @synthesize parameterTree = _parameterTree;
 
@@ -46,6 +57,12 @@
         return nil;
     }
     
+    // HRIRs resampled to the host rate are kept in the caches directory between launches
+    NSString *cachesPath = NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES).firstObject;
+    if (cachesPath != nil) {
+        _kernel.setHRIRCacheDirectory(cachesPath.fileSystemRepresentation);
+    }
+    
     // Initialize a default format for the busses.
     AVAudioFormat *defaultFormat = [[AVAudioFormat alloc] initStandardFormatWithSampleRate:44100. channels:2];
     
@@ -194,6 +211,12 @@
     
     _inputBus.allocateRenderResources(self.maximumFramesToRender);
     
+    // The kernel is not rendering, so the providers it pulls from can be swapped
+    for (int source = 0; source < 2; source++) {
+        _liveSourceProviders[source] = _sourceProviders[source];
+        _kernel.setSourceStream(source, _liveSourceProviders[source] ? pullSourceProvider : NULL, (__bridge void *)_liveSourceProviders[source], int(_sourceRates[source] + 0.5));
+    }
+    
     _kernel.init(self.outputBus.format.channelCount, self.outputBus.format.sampleRate);
     _kernel.reset();
     
@@ -217,6 +240,7 @@
     [super deallocateRenderResources];
     
     _inputBus.deallocateRenderResources();
+    _kernel.deallocate();
     
     // Make a local pointer to the kernel to avoid capturing self.
     __block SpatialDSPKernel *spatialKernel = &_kernel;
@@ -314,5 +338,141 @@
     _kernel.setGain(newGain);
 }
 
+-(void)setRenderMode:(int)mode {
+    _kernel.setRenderMode(mode);
+}
+
+-(void)setAmbisonicOrder:(int)order {
+    _kernel.setAmbisonicOrder(order);
+}
+
+-(void)setVirtualSpeakerCount:(int)count {
+    _kernel.setVirtualSpeakerCount(count);
+}
+
+-(void)setPCAComponentCount:(int)count {
+    _kernel.setPCAComponentCount(count);
+}
+
+-(void)setSourceClusterCount:(int)count {
+    _kernel.setSourceClusterCount(count);
+}
+
+-(BOOL)isSourceActive:(int)source {
+    return _kernel.isSourceActive(source != 0);
+}
+
+-(void)setAdaptiveQuality:(BOOL)enabled {
+    _kernel.setAdaptiveQuality(enabled);
+}
+
+-(int)qualityLevel {
+    return _kernel.qualityLevel();
+}
+
+-(float)renderLoad {
+    return _kernel.renderLoad();
+}
+
+// 0 float32, 1 float16, 2 bfloat16; applied when render resources are next allocated
+-(void)setSpectrumPrecision:(int)precision {
+    _kernel.setSpectrumPrecision(precision);
+}
+
+-(void)setPropagationDelay:(BOOL)enabled {
+    _kernel.setPropagationDelay(enabled);
+}
+
+// 0 linear, 1 and 2 Lagrange 3rd/5th order, 3 Thiran, 4 windowed sinc
+-(void)setPropagationInterpolation:(int)interpolation {
+    _kernel.setPropagationInterpolation(interpolation);
+}
+
+-(void)setReverb:(BOOL)enabled {
+    _kernel.setReverb(enabled);
+}
+
+// source 0 is the left input, 1 the right one
+-(void)setReverbSend:(float)send forSource:(int)source {
+    _kernel.setReverbSend(source, send);
+}
+
+-(void)setReverbTime:(float)seconds {
+    _kernel.setReverbTime(seconds);
+}
+
+-(void)setReverbDamping:(float)damping {
+    _kernel.setReverbDamping(damping);
+}
+
+// 8 or 16
+-(void)setReverbLines:(int)lines {
+    _kernel.setReverbLines(lines);
+}
+
+-(void)setEarlyReflections:(BOOL)enabled {
+    _kernel.setEarlyReflections(enabled);
+}
+
+// metres, x front, y left, z up
+-(void)setRoomLength:(float)length width:(float)width height:(float)height absorption:(float)absorption {
+    _kernel.setRoom(length, width, height, absorption);
+}
+
+-(void)setListenerPositionX:(float)x y:(float)y z:(float)z {
+    _kernel.setListenerPosition(x, y, z);
+}
+
+// 1 to 3
+-(void)setReflectionOrder:(int)order {
+    _kernel.setReflectionOrder(order);
+}
+
+-(void)setBRIR:(BOOL)enabled {
+    _kernel.setBRIR(enabled);
+}
+
+// one impulse response per ear, at the render sample rate; source 0 is the left input, 1 the right one
+-(BOOL)loadBRIRLeft:(const float *)left right:(const float *)right length:(int)length forSource:(int)source {
+    return _kernel.loadBRIR(source, left, right, length);
+}
+
+-(int)brirDeadlineMisses {
+    return _kernel.brirDeadlineMisses();
+}
+
+// direct rendering only
+-(void)setNearField:(BOOL)enabled {
+    _kernel.setNearField(enabled);
+}
+
+-(void)setAirAbsorption:(BOOL)enabled {
+    _kernel.setAirAbsorption(enabled);
+}
+
+// takes effect from the next allocateRenderResources
+-(void)setHRIRCacheDirectory:(NSString *)path {
+    _kernel.setHRIRCacheDirectory(path.fileSystemRepresentation);
+}
+
+// source 0 is the left input, 1 the right one; a nil provider goes back to the input bus.
+// takes effect from the next allocateRenderResources
+-(void)setSource:(int)source sampleRate:(double)sampleRate provider:(SpatialSourceProvider)provider {
+    if (source < 0 || source > 1) {
+        return;
+    }
+    _sourceProviders[source] = [provider copy];
+    _sourceRates[source] = sampleRate;
+}
+
+// takes effect from the next allocateRenderResources
+-(void)setResamplerQuality:(int)quality {
+    _kernel.setResamplerQuality(quality);
+}
+
+-(void)setHeadOrientationW:(float)w x:(float)x y:(float)y z:(float)z {
+    _kernel.setHeadOrientation(w, x, y, z);
+}
+
 @end
 
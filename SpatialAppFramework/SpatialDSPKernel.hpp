@@ -12,13 +12,33 @@
 #import "DSPKernel.hpp"
 #import "ParameterRamper.hpp"
 #import "FFTConvolver.hpp"
-#import "IRArraySetter.hpp"
+#import "SwitchingConvolver.hpp"
+#import "HRTFBank.hpp"
+#import "HRIRGrid.hpp"
+#import "SphericalGrid.hpp"
+#import "AmbisonicRenderer.hpp"
+#import "VirtualSpeakerRenderer.hpp"
+#import "PCARenderer.hpp"
+#import "SourceClusterer.hpp"
+#import "QualityGovernor.hpp"
+#import "PropagationDelay.hpp"
+#import "FDNReverb.hpp"
+#import "EarlyReflections.hpp"
+#import "BRIRRenderer.hpp"
+#import "NearFieldCorrection.hpp"
+#import "AirAbsorption.hpp"
+#import "SourceStream.hpp"
+#import "RendererSlot.hpp"
 #import <vector>
+#import <atomic>
+#import <thread>
+#import <mutex>
+#import <condition_variable>
 
-#define NUM_OF_IRS 90
 #define BUFFER_SIZE 1024
-#define IR_SIZE 8192
-#define ELEV_RAILS 4
+#define NUM_OF_SOURCES 2
+// how often the renderer builder looks again while a renderer waits to be picked up or freed
+#define RENDERER_COLLECT_MS 20
 
 static inline float convertBadValuesToZero(float x) {
     /*
@@ -38,6 +58,19 @@ static inline float convertBadValuesToZero(float x) {
 }
 
 
+enum RenderMode {
+    // one HRIR pair per source, switched with a crossfade
+    RenderModeDirect = 0,
+    // sources share a spherical-harmonic bus with one decoder
+    RenderModeAmbisonic,
+    // sources are VBAP-panned onto a few virtual loudspeakers
+    RenderModeVirtualSpeakers,
+    // sources are mixed into principal-component basis buses; saves CPU, not memory
+    RenderModePCA,
+    // sources are grouped by direction, one HRIR pair per group
+    RenderModeClustered
+};
+
 enum {
     ParamAzimuthLeft,
     ParamAzimuthRight,
@@ -61,6 +94,11 @@ public:
     
     SpatialDSPKernel() {}
     
+    ~SpatialDSPKernel() {
+        stopRendererBuilder();
+        deallocate();
+    }
+    
     void init(int channelCount, double inSampleRate) {
         numChans = channelCount;
         sampleRate = float(inSampleRate);
@@ -68,78 +106,52 @@ public:
         // Set Convolution Length
         m_nConvolutionLength = 8192;
 
-        // Set IRs for Elevation = 0°
-        m_IRArraySetter.setIRsForE0(m_pIRs_E0_L,m_pIRs_E0_R);
-        m_IRArraySetter.setIRsForE45(m_pIRs_E45_L,m_pIRs_E45_R);
-        m_IRArraySetter.setIRsForE75(m_pIRs_E75_L,m_pIRs_E75_R);
-        m_IRArraySetter.setIRsForE315(m_pIRs_E315_L,m_pIRs_E315_R);
-
-        m_ppIRs_L_AziRails[0] = m_pIRs_E315_L;
-        m_ppIRs_L_AziRails[1] = m_pIRs_E0_L;
-        m_ppIRs_L_AziRails[2] = m_pIRs_E45_L;
-        m_ppIRs_L_AziRails[3] = m_pIRs_E75_L;
-        
-        m_ppIRs_R_AziRails[0] = m_pIRs_E315_R;
-        m_ppIRs_R_AziRails[1] = m_pIRs_E0_R;
-        m_ppIRs_R_AziRails[2] = m_pIRs_E45_R;
-        m_ppIRs_R_AziRails[3] = m_pIRs_E75_R;
-        
-        // Set fftConvolvers Left and Right
-        fftConvolver_srcL_L.init(m_nConvolutionLength,m_pIRs_E0_L[60],m_nConvolutionLength);
-        fftConvolver_srcL_R.init(m_nConvolutionLength,m_pIRs_E0_R[60],m_nConvolutionLength);
-        fftConvolver_srcR_L.init(m_nConvolutionLength,m_pIRs_E0_L[60],m_nConvolutionLength);
-        fftConvolver_srcR_R.init(m_nConvolutionLength,m_pIRs_E0_R[60],m_nConvolutionLength);
-        
-        fftConvolverPrev_srcL_L.init(m_nConvolutionLength,m_pIRs_E0_L[60],m_nConvolutionLength);
-        fftConvolverPrev_srcL_R.init(m_nConvolutionLength,m_pIRs_E0_R[60],m_nConvolutionLength);
-        fftConvolverPrev_srcR_L.init(m_nConvolutionLength,m_pIRs_E0_L[60],m_nConvolutionLength);
-        fftConvolverPrev_srcR_R.init(m_nConvolutionLength,m_pIRs_E0_R[60],m_nConvolutionLength);
+        // HRIRs, their directions and spectra are shared by every instance in the process,
+        // resampled to this rate when the bank for it loads
+        std::shared_ptr<const HRTFBank> sharedBank = HRTFBank::shared(BUFFER_SIZE, m_nSpectrumPrecision, int(inSampleRate + 0.5));
+        // the bus renderers are rebuilt for this bank and block, so they go while the old bank is alive
+        stopRendererBuilder();
+        clearRenderers();
+        if(sharedBank != m_pHRTFBank) {
+            // rails pinned in the old bank are let go while it is still alive
+            m_RailTracker_srcL.release();
+            m_RailTracker_srcR.release();
+            m_FallbackClusterer.release();
+            deallocate();
+            m_pHRTFBank = sharedBank;
+        }
+        const HRTFBank& bank = *m_pHRTFBank;
+        // the bank's prefetcher polls for this kernel's rails until deallocate()
+        if(!m_bRendering) {
+            bank.beginRendering();
+            m_bRendering = true;
+        }
+        
+        // Each source keeps the rail it is on prepared, starting on the home (E0) rail
+        m_RailTracker_srcL.init(bank);
+        m_RailTracker_srcR.init(bank);
+        
+        // Set fftConvolvers Left and Right to index 60 of the home rail (315° azimuth, 0° elevation)
+        // until the first block looks the sources up; they only reference the bank's spectra
+        int start = HRTFBank::homeRail()*NUM_OF_IRS + 60;
+        fftConvolver_srcL_L.init(BUFFER_SIZE,bank.leftSpectra(start),m_nConvolutionLength);
+        fftConvolver_srcL_R.init(BUFFER_SIZE,bank.rightSpectra(start),m_nConvolutionLength);
+        fftConvolver_srcR_L.init(BUFFER_SIZE,bank.leftSpectra(start),m_nConvolutionLength);
+        fftConvolver_srcR_R.init(BUFFER_SIZE,bank.rightSpectra(start),m_nConvolutionLength);
 
         m_bPosChanged_srcL = false;
         m_bPosChanged_srcR = false;
         
         m_fGain = 1.0;
     
-        m_pCurrentIR_srcL_L = NULL;
-        m_pCurrentIR_srcL_R = NULL;
-        m_pCurrentIR_srcR_L = NULL;
-        m_pCurrentIR_srcR_L = NULL;
-        
-        m_pPreviousIR_srcL_L = NULL;
-        m_pPreviousIR_srcL_R = NULL;
-        m_pPreviousIR_srcR_L = NULL;
-        m_pPreviousIR_srcR_R = NULL;
-        
         m_pCurrentOutput_srcL_L = NULL;
         m_pCurrentOutput_srcL_R = NULL;
         m_pCurrentOutput_srcR_L = NULL;
         m_pCurrentOutput_srcR_R = NULL;
         
-        m_pPreviousOutput_srcL_L = NULL;
-        m_pPreviousOutput_srcL_R = NULL;
-        m_pPreviousOutput_srcR_L = NULL;
-        m_pPreviousOutput_srcR_R = NULL;
-        
-        
-        //Clearing IRs
-        if (m_pCurrentIR_srcL_L)
-            delete [] m_pCurrentIR_srcL_L;
-        if (m_pCurrentIR_srcL_R)
-            delete [] m_pCurrentIR_srcL_R;
-        if (m_pCurrentIR_srcR_L)
-            delete [] m_pCurrentIR_srcR_L;
-        if (m_pCurrentIR_srcR_R)
-            delete [] m_pCurrentIR_srcR_R;
-        
-        if (m_pPreviousIR_srcL_L)
-            delete [] m_pPreviousIR_srcL_L;
-        if (m_pPreviousIR_srcL_R)
-            delete [] m_pPreviousIR_srcL_R;
-        if (m_pPreviousIR_srcR_L)
-            delete [] m_pPreviousIR_srcR_L;
-        if (m_pPreviousIR_srcR_R)
-            delete [] m_pPreviousIR_srcR_R;
         
+        
+        //Clearing output buffers
         if (m_pCurrentOutput_srcL_L)
             delete [] m_pCurrentOutput_srcL_L;
         if (m_pCurrentOutput_srcL_R)
@@ -149,56 +161,20 @@ public:
         if (m_pCurrentOutput_srcR_R)
             delete [] m_pCurrentOutput_srcR_R;
         
-        if (m_pPreviousOutput_srcL_L)
-            delete [] m_pPreviousOutput_srcL_L;
-        if (m_pPreviousOutput_srcL_R)
-            delete [] m_pPreviousOutput_srcL_R;
-        if (m_pPreviousOutput_srcR_L)
-            delete [] m_pPreviousOutput_srcR_L;
-        if (m_pPreviousOutput_srcR_R)
-            delete [] m_pPreviousOutput_srcR_R;
-        
-        //Allocating memory based on convolution length
-        m_pCurrentIR_srcL_L = new float[IR_SIZE];
-        m_pCurrentIR_srcL_R = new float[IR_SIZE];
-        m_pCurrentIR_srcR_L = new float[IR_SIZE];
-        m_pCurrentIR_srcR_R = new float[IR_SIZE];
-        
-        m_pPreviousIR_srcL_L = new float[IR_SIZE];
-        m_pPreviousIR_srcL_R = new float[IR_SIZE];
-        m_pPreviousIR_srcR_L = new float[IR_SIZE];
-        m_pPreviousIR_srcR_R = new float[IR_SIZE];
         
+        //Allocating memory based on buffer size
         m_pCurrentOutput_srcL_L = new float[BUFFER_SIZE];
         m_pCurrentOutput_srcL_R = new float[BUFFER_SIZE];
         m_pCurrentOutput_srcR_L = new float[BUFFER_SIZE];
         m_pCurrentOutput_srcR_R = new float[BUFFER_SIZE];
         
-        m_pPreviousOutput_srcL_L = new float[BUFFER_SIZE];
-        m_pPreviousOutput_srcL_R = new float[BUFFER_SIZE];
-        m_pPreviousOutput_srcR_L = new float[BUFFER_SIZE];
-        m_pPreviousOutput_srcR_R = new float[BUFFER_SIZE];
 
         //Setting to 0
-        memset(m_pCurrentIR_srcL_L, 0, sizeof(float)*IR_SIZE);
-        memset(m_pCurrentIR_srcL_R, 0, sizeof(float)*IR_SIZE);
-        memset(m_pCurrentIR_srcR_L, 0, sizeof(float)*IR_SIZE);
-        memset(m_pCurrentIR_srcR_R, 0, sizeof(float)*IR_SIZE);
-        
-        memset(m_pPreviousIR_srcL_L, 0, sizeof(float)*IR_SIZE);
-        memset(m_pPreviousIR_srcL_R, 0, sizeof(float)*IR_SIZE);
-        memset(m_pPreviousIR_srcR_L, 0, sizeof(float)*IR_SIZE);
-        memset(m_pPreviousIR_srcR_R, 0, sizeof(float)*IR_SIZE);
-        
         memset(m_pCurrentOutput_srcL_L, 0, sizeof(float)*BUFFER_SIZE);
         memset(m_pCurrentOutput_srcL_R, 0, sizeof(float)*BUFFER_SIZE);
         memset(m_pCurrentOutput_srcR_L, 0, sizeof(float)*BUFFER_SIZE);
         memset(m_pCurrentOutput_srcR_R, 0, sizeof(float)*BUFFER_SIZE);
         
-        memset(m_pPreviousOutput_srcL_L, 0, sizeof(float)*BUFFER_SIZE);
-        memset(m_pPreviousOutput_srcL_R, 0, sizeof(float)*BUFFER_SIZE);
-        memset(m_pPreviousOutput_srcR_L, 0, sizeof(float)*BUFFER_SIZE);
-        memset(m_pPreviousOutput_srcR_R, 0, sizeof(float)*BUFFER_SIZE);
         
         // Set Variables
         // GUI-> Variables
@@ -219,19 +195,71 @@ public:
         m_bSwitching = true;
         m_bTwoSources = true;
         
-        // call any necessary functions
-        createFaders();
+        // The requested bus renderer is built off this thread; the direct path renders until it is ready
+        m_nRenderMode = RenderModeDirect;
+        if(m_nRequestedRenderMode != RenderModeDirect)
+            requestRenderer();
+        
+        // Load shedding for the direct path, level applied on the first block
+        m_QualityGovernor.init(inSampleRate, BUFFER_SIZE);
+        m_nQualityLevel = -1;
+        m_fGridStep = 0.0f;
+        m_bClusteredFallback = false;
+        m_bPathWarming = false;
+        // the clustered fallback only runs at the cheapest level, so it convolves that level's taps
+        m_FallbackClusterer.init(bank, 1, BUFFER_SIZE, NUM_OF_SOURCES, QualityGovernor::settingsForLevel(QUALITY_LEVELS - 1).nIRLength);
+        m_pTransition_L.assign(BUFFER_SIZE, 0.0f);
+        m_pTransition_R.assign(BUFFER_SIZE, 0.0f);
+        
+        // Sources pulled at their own rates, resampled to this one ahead of everything else
+        int renderRate = int(inSampleRate + 0.5);
+        m_SourceStream_srcL.init(m_pSourcePull[0], m_pSourceContext[0], m_pSourceRate[0], renderRate, BUFFER_SIZE, m_nResamplerQuality);
+        m_SourceStream_srcR.init(m_pSourcePull[1], m_pSourceContext[1], m_pSourceRate[1], renderRate, BUFFER_SIZE, m_nResamplerQuality);
+        m_pStreamed_srcL.assign(BUFFER_SIZE, 0.0f);
+        m_pStreamed_srcR.assign(BUFFER_SIZE, 0.0f);
+        
+        // Propagation delay ahead of every render path, picked up on the next block when enabled
+        m_PropagationDelay_srcL.init(sampleRate);
+        m_PropagationDelay_srcR.init(sampleRate);
+        m_pDelayed_srcL.assign(BUFFER_SIZE, 0.0f);
+        m_pDelayed_srcR.assign(BUFFER_SIZE, 0.0f);
+        m_bPropagationActive = false;
+        
+        // Air absorption after the propagation delay, its distance table fitted for this rate
+        m_AirAbsorption.init(sampleRate, BUFFER_SIZE, NUM_OF_SOURCES);
+        m_pAbsorbed_srcL.assign(BUFFER_SIZE, 0.0f);
+        m_pAbsorbed_srcR.assign(BUFFER_SIZE, 0.0f);
+        m_bAirAbsorptionActive = false;
+        
+        // Late reverb shared by all sources, fed through their send gains
+        m_Reverb.init(sampleRate, m_nReverbLines);
+        m_pReverbBus.assign(BUFFER_SIZE, 0.0f);
+        m_bReverbActive = false;
+        
+        // Early reflections, their paths computed on their own thread
+        m_EarlyReflections.init(bank.grid(), sampleRate, BUFFER_SIZE, NUM_OF_SOURCES);
+        m_pEarly_L.assign(BUFFER_SIZE, 0.0f);
+        m_pEarly_R.assign(BUFFER_SIZE, 0.0f);
+        m_bEarlyReflectionsActive = false;
+        
+        // Room responses, their tails convolved on their own thread; loaded ones are dropped
+        m_BRIRRenderer.init(BUFFER_SIZE, NUM_OF_SOURCES);
+        
+        // Near-field shelves on the direct path, one lane per source and ear
+        m_NearField.init(sampleRate, BUFFER_SIZE, NUM_OF_SOURCES);
+        m_bNearFieldActive = false;
     }
     
     void reset() {
         // reset and state variables here (eg, filter delays)
     }
     
-    void createFaders() {
-        for(int i = 0; i < BUFFER_SIZE; i++) {
-            m_pFadingVector_1[i] = i/(float)(BUFFER_SIZE-1);
-            m_pFadingVector_2[i] = 1 - (i/(float)(BUFFER_SIZE-1));
-        }
+    // Rendering stopped until the next init(); the bank's prefetcher can stop polling for us
+    void deallocate() {
+        if(!m_bRendering)
+            return;
+        m_pHRTFBank->endRendering();
+        m_bRendering = false;
     }
     
     void setParameter(AUParameterAddress address, AUValue value) {
@@ -322,85 +350,37 @@ public:
     
     void quantize2D(int elevIndex, int aziIndex, bool source) {
         // bool source is 0 for Left, 1 for Right
+        // The convolvers keep the outgoing IR and the input history, so only the new IR is handed over
+        
+        const HRTFBank& bank = *m_pHRTFBank;
+        int position = elevIndex*NUM_OF_IRS + aziIndex;
         
         // Left Source
         if(!source) {
-            fftConvolver_srcL_L.reset();
-            fftConvolver_srcL_R.reset();
-            fftConvolverPrev_srcL_L.reset();
-            fftConvolverPrev_srcL_R.reset();
-            
-            // Find Correct Azimuth Rail (based on elevation)
-            float** pAziRail_srcL_L = m_ppIRs_L_AziRails[elevIndex];
-            float** pAziRail_srcL_R = m_ppIRs_R_AziRails[elevIndex];
-            float** pPreviousAziRail_srcL_L = m_ppIRs_L_AziRails[m_nIndex_PrevElev_srcL];
-            float** pPreviousAziRail_srcL_R = m_ppIRs_R_AziRails[m_nIndex_PrevElev_srcL];
-
-            // Left ear
-            fftConvolver_srcL_L.init(m_nConvolutionLength,pAziRail_srcL_L[aziIndex],m_nConvolutionLength);
-            fftConvolverPrev_srcL_L.init(m_nConvolutionLength,pPreviousAziRail_srcL_L[m_nIndex_PrevAzi_srcL],m_nConvolutionLength);
-            // Right ear
-            fftConvolver_srcL_R.init(m_nConvolutionLength,pAziRail_srcL_R[aziIndex],m_nConvolutionLength);
-            fftConvolverPrev_srcL_R.init(m_nConvolutionLength,pPreviousAziRail_srcL_R[m_nIndex_PrevAzi_srcL],m_nConvolutionLength);
+            fftConvolver_srcL_L.switchTo(bank.leftSpectra(position),m_nConvolutionLength);
+            fftConvolver_srcL_R.switchTo(bank.rightSpectra(position),m_nConvolutionLength);
             // Set current IR index to previous
             m_nIndex_PrevElev_srcL = elevIndex;
             m_nIndex_PrevAzi_srcL = aziIndex;
-            
         }
         
         // Right Source
         else {
-            fftConvolver_srcR_L.reset();
-            fftConvolver_srcR_R.reset();
-            fftConvolverPrev_srcR_L.reset();
-            fftConvolverPrev_srcR_R.reset();
-            
-            // Find Correct Azimuth Rail (based on elevation)
-            float** pAziRail_srcR_L = m_ppIRs_L_AziRails[elevIndex];
-            float** pAziRail_srcR_R = m_ppIRs_R_AziRails[elevIndex];
-            float** pPreviousAziRail_srcR_L = m_ppIRs_L_AziRails[m_nIndex_PrevElev_srcL];
-            float** pPreviousAziRail_srcR_R = m_ppIRs_R_AziRails[m_nIndex_PrevElev_srcL];
-            
-            // Left ear
-            fftConvolver_srcR_L.init(m_nConvolutionLength,pAziRail_srcR_L[aziIndex],m_nConvolutionLength);
-            fftConvolverPrev_srcR_L.init(m_nConvolutionLength,pPreviousAziRail_srcR_L[m_nIndex_PrevAzi_srcR],m_nConvolutionLength);
-            // Right ear
-            fftConvolver_srcR_R.init(m_nConvolutionLength,pAziRail_srcR_R[aziIndex],m_nConvolutionLength);
-            fftConvolverPrev_srcR_R.init(m_nConvolutionLength,pPreviousAziRail_srcR_R[m_nIndex_PrevAzi_srcR],m_nConvolutionLength);
+            fftConvolver_srcR_L.switchTo(bank.leftSpectra(position),m_nConvolutionLength);
+            fftConvolver_srcR_R.switchTo(bank.rightSpectra(position),m_nConvolutionLength);
             // Set current IR index to previous
             m_nIndex_PrevElev_srcR = elevIndex;
             m_nIndex_PrevAzi_srcR = aziIndex;
         }
     }
     
-    void sumWithSwitching(float* leftOutput,float* rightOutput,bool source) {
-        // should be switching between previous IR output (sum of sources at left ear and same for right ear)
-        // and the current IR output
-        // Left Source
-        if(!source) {
-            for(int i = 0; i < BUFFER_SIZE; i++) {
-                // everything that goes to the left ear
-                leftOutput[i] = (m_pFadingVector_2[i]*m_pPreviousOutput_srcL_L[i]) + (m_pFadingVector_1[i]*m_pCurrentOutput_srcL_L[i]);
-                // everything that goes to the right ear
-                rightOutput[i] = (m_pFadingVector_2[i]*m_pPreviousOutput_srcL_R[i]) + (m_pFadingVector_1[i]*m_pCurrentOutput_srcL_R[i]);
-            }
-        }
-        // Right Source
-        else {
-            for(int i = 0; i < BUFFER_SIZE; i++) {
-    
-                leftOutput[i] = (m_pFadingVector_2[i]*m_pPreviousOutput_srcR_L[i]) + (m_pFadingVector_1[i]*m_pCurrentOutput_srcR_L[i]);
-                rightOutput[i] = (m_pFadingVector_2[i]*m_pPreviousOutput_srcR_R[i]) + (m_pFadingVector_1[i]*m_pCurrentOutput_srcR_R[i]);
-            }
-        }
-    }
-    
     void sumOutput(float* leftOutput, float* rightOutput) {
         
         float gain_left = 1.0 / (m_fDistance_srcL);
         float gain_right = 1.0 / (m_fDistance_srcR);
         
-        if(m_bTwoSources) {
+        // an idle right source only contributes silence
+        if(m_bTwoSources && isSourceActive(true)) {
             for(int i = 0; i < BUFFER_SIZE; i++) {
                 // everything that goes to the left ear
                 leftOutput[i] = gain_left*m_pCurrentOutput_srcL_L[i] + gain_right*m_pCurrentOutput_srcR_L[i];
@@ -409,91 +389,65 @@ public:
             }
         }
         
-        // Only using left source (srcL)
+        // Only using left source (srcL), at its own distance in both ears
         else {
             for(int i = 0; i < BUFFER_SIZE; i++) {
                 leftOutput[i] = gain_left*m_pCurrentOutput_srcL_L[i];
-                rightOutput[i] = gain_right*m_pCurrentOutput_srcL_R[i];
+                rightOutput[i] = gain_left*m_pCurrentOutput_srcL_R[i];
             }
         }
     }
 
+    // False once a source's input has been silent for longer than its IRs; its
+    // convolvers then skip all FFT work until the input comes back
+    bool isSourceActive(bool source) {
+        if(!source)
+            return fftConvolver_srcL_L.isActive() || fftConvolver_srcL_R.isActive();
+        return fftConvolver_srcR_L.isActive() || fftConvolver_srcR_R.isActive();
+    }
+
     void process(AUAudioFrameCount frameCount, AUAudioFrameCount bufferOffset) override {
         
-        // initialize any variables
-        int index_IR_srcL=0,index_IR_srcR=0;
-        float indexWithDec_srcL,indexWithDec_srcR;
-        float remainder_srcL=0,remainder_srcR=0;
-        
-        // For 2D
-        int aziIndex_srcL=0,aziIndex_srcR=0;
-        int elevIndex_srcL=0,elevIndex_srcR=0;
-        
         if(m_bHRTFMode) {
-        //         Check if position changed for either or both sources
-            if(m_bPosChanged_srcL) {
+            adoptRenderer();
+            // only the direct path sheds load, so only its blocks are timed
+            if(m_nRenderMode == RenderModeDirect)
+                m_QualityGovernor.beginBlock();
+            streamSources();
+            delaySources();
+            absorbSources();
+        }
+        
+        if(m_bHRTFMode && m_nRenderMode == RenderModeAmbisonic) {
+            processAmbisonic();
+        }
+        else if(m_bHRTFMode && m_nRenderMode == RenderModeVirtualSpeakers) {
+            processVirtualSpeakers();
+        }
+        else if(m_bHRTFMode && m_nRenderMode == RenderModePCA) {
+            processPCA();
+        }
+        else if(m_bHRTFMode && m_nRenderMode == RenderModeClustered) {
+            processClustered();
+        }
+        else if(m_bHRTFMode) {
+            applyQuality();
             
-                indexWithDec_srcL = m_fCurrentAzimuth_srcL*(NUM_OF_IRS-1);
-                index_IR_srcL = floor(indexWithDec_srcL);
-                aziIndex_srcL = index_IR_srcL;
-                elevIndex_srcL = findClosetElevation(m_fCurrentElevation_srcL);
-                remainder_srcL = indexWithDec_srcL - index_IR_srcL;
-                
-                // Quantize to nearest IR
-                if(elevIndex_srcL != m_nIndex_PrevElev_srcL || aziIndex_srcL != m_nIndex_PrevAzi_srcL)
-                    quantize2D(elevIndex_srcL,aziIndex_srcL,false);
-
-            }
-            if(m_bPosChanged_srcR) {
-                
-                indexWithDec_srcR = m_fCurrentAzimuth_srcR*(NUM_OF_IRS-1);
-                index_IR_srcR = floor(indexWithDec_srcR);
-                aziIndex_srcR = index_IR_srcR;
-                elevIndex_srcR = findClosetElevation(m_fCurrentElevation_srcR);
-                remainder_srcR = indexWithDec_srcR - index_IR_srcR;
-                
-                // Quantize to nearest IR
-                if(elevIndex_srcR != m_nIndex_PrevElev_srcR || aziIndex_srcR != m_nIndex_PrevAzi_srcR)
-                    quantize2D(elevIndex_srcR,aziIndex_srcR,true);
-
-            }
-    
-            // DO LEFT CHANNEL
-            // Set pointers to input/output LEFT buffer
-            float* xSrcL = (float*)inBufferListPtr->mBuffers[0].mData;
             float* ySrcL = (float*)outBufferListPtr->mBuffers[0].mData;
-            // Set pointers to input/output RIGHT buffer
-            float* xSrcR = (float*)inBufferListPtr->mBuffers[1].mData;
             float* ySrcR = (float*)outBufferListPtr->mBuffers[1].mData;
             
-            fftConvolver_srcL_L.process(xSrcL,m_pCurrentOutput_srcL_L,BUFFER_SIZE);
-            fftConvolver_srcL_R.process(xSrcL,m_pCurrentOutput_srcL_R,BUFFER_SIZE);
-            
-            if(m_bPosChanged_srcL) {
-                // Need to process previous IR
-                fftConvolverPrev_srcL_L.process(xSrcL,m_pPreviousOutput_srcL_L,BUFFER_SIZE);
-                fftConvolverPrev_srcL_R.process(xSrcL,m_pPreviousOutput_srcL_R,BUFFER_SIZE);
-                m_bPosChanged_srcL = false;
-                
-                sumWithSwitching(m_pCurrentOutput_srcL_L,m_pCurrentOutput_srcL_R,false);
+            bool clustered = m_QualityGovernor.settings().bCluster;
+            if(clustered != m_bClusteredFallback) {
+                switchRenderPath(clustered, ySrcL, ySrcR);
             }
-
-            if(m_bTwoSources) {
-                // DO RIGHT CHANNEL
-                fftConvolver_srcR_L.process(xSrcR,m_pCurrentOutput_srcR_L,BUFFER_SIZE);
-                fftConvolver_srcR_R.process(xSrcR,m_pCurrentOutput_srcR_R,BUFFER_SIZE);
-                
-                if(m_bPosChanged_srcR) {
-                    // Need to process previous IR
-                    fftConvolverPrev_srcR_L.process(xSrcR,m_pPreviousOutput_srcR_L,BUFFER_SIZE);
-                    fftConvolverPrev_srcR_R.process(xSrcR,m_pPreviousOutput_srcR_R,BUFFER_SIZE);
-                    m_bPosChanged_srcR = false;
-                    
-                    sumWithSwitching(m_pCurrentOutput_srcR_L,m_pCurrentOutput_srcR_R,true);
-                }
+            else {
+                if(m_bPathWarming)
+                    abandonRenderPathSwitch();
+                if(clustered)
+                    processFallbackClusters(ySrcL, ySrcR);
+                else
+                    processDirect(ySrcL, ySrcR);
             }
-            
-            sumOutput(ySrcL,ySrcR);
         }
         
         // ELSE just pass audio through, unprocessed
@@ -502,6 +456,10 @@ public:
             outBufferListPtr->mBuffers[1] = inBufferListPtr->mBuffers[1];
         }
         if(m_bHRTFMode) {
+            processEarlyReflections((float*)outBufferListPtr->mBuffers[0].mData, (float*)outBufferListPtr->mBuffers[1].mData);
+            processBRIR((float*)outBufferListPtr->mBuffers[0].mData, (float*)outBufferListPtr->mBuffers[1].mData);
+            processReverb((float*)outBufferListPtr->mBuffers[0].mData, (float*)outBufferListPtr->mBuffers[1].mData);
+            
             // Gain (in addition to distance) should tune this
             for(int frameIndex = 0; frameIndex < frameCount; frameIndex++) {
                 int frameOffset = int(frameIndex + bufferOffset);
@@ -510,7 +468,499 @@ public:
                 *yLeft = *yLeft * 2.0;
                 *yRight = *yRight * 2.0;
             }
+            if(m_nRenderMode == RenderModeDirect)
+                m_QualityGovernor.endBlock();
+        }
+    }
+    
+    // One HRIR pair per source
+    void processDirect(float* ySrcL, float* ySrcR) {
+        
+        // For 2D
+        int aziIndex_srcL=0,aziIndex_srcR=0;
+        int elevIndex_srcL=0,elevIndex_srcR=0;
+        
+        // Have the rails the sources are heading for prepared before they get there
+        m_RailTracker_srcL.anticipate(railElevationInDegrees(m_fCurrentElevation_srcL));
+        m_RailTracker_srcR.anticipate(railElevationInDegrees(m_fCurrentElevation_srcR));
+        
+        //         Check if position changed for either or both sources
+        if(m_bPosChanged_srcL) {
+        
+            findClosestIR(m_fCurrentAzimuth_srcL,m_fCurrentElevation_srcL,elevIndex_srcL,aziIndex_srcL);
+            // Until its rail is prepared the source stays on the closest prepared one, looked up again next block
+            bool settled = m_RailTracker_srcL.follow(elevIndex_srcL);
+            
+            // Quantize to nearest IR
+            if(elevIndex_srcL != m_nIndex_PrevElev_srcL || aziIndex_srcL != m_nIndex_PrevAzi_srcL)
+                quantize2D(elevIndex_srcL,aziIndex_srcL,false);
+            m_bPosChanged_srcL = !settled;
+
+        }
+        if(m_bPosChanged_srcR) {
+            
+            findClosestIR(m_fCurrentAzimuth_srcR,m_fCurrentElevation_srcR,elevIndex_srcR,aziIndex_srcR);
+            bool settled = m_RailTracker_srcR.follow(elevIndex_srcR);
+            
+            // Quantize to nearest IR
+            if(elevIndex_srcR != m_nIndex_PrevElev_srcR || aziIndex_srcR != m_nIndex_PrevAzi_srcR)
+                quantize2D(elevIndex_srcR,aziIndex_srcR,true);
+            m_bPosChanged_srcR = !settled;
+
+        }
+    
+        // DO LEFT CHANNEL
+        // Set pointers to input LEFT buffer
+        const float* xSrcL = sourceInput(false);
+        // Set pointers to input RIGHT buffer
+        const float* xSrcR = sourceInput(true);
+        
+        // The convolvers crossfade to a new IR themselves, in the frequency domain
+        fftConvolver_srcL_L.process(xSrcL,m_pCurrentOutput_srcL_L,BUFFER_SIZE);
+        fftConvolver_srcL_R.process(xSrcL,m_pCurrentOutput_srcL_R,BUFFER_SIZE);
+
+        if(m_bTwoSources) {
+            // DO RIGHT CHANNEL
+            fftConvolver_srcR_L.process(xSrcR,m_pCurrentOutput_srcR_L,BUFFER_SIZE);
+            fftConvolver_srcR_R.process(xSrcR,m_pCurrentOutput_srcR_R,BUFFER_SIZE);
+        }
+        
+        correctNearField();
+        sumOutput(ySrcL,ySrcR);
+    }
+    
+    // What the HRIRs miss for sources nearer or farther than they were measured, filtered into
+    // the convolvers' outputs before they are summed
+    void correctNearField() {
+        if(!m_bNearField) {
+            m_bNearFieldActive = false;
+            return;
+        }
+        if(!m_bNearFieldActive) {
+            m_NearField.reset();
+            m_bNearFieldActive = true;
+        }
+        
+        m_NearField.setSource(0, azimuthInDegrees(m_fCurrentAzimuth_srcL), railElevationInDegrees(m_fCurrentElevation_srcL), m_fDistance_srcL);
+        m_NearField.setSource(1, azimuthInDegrees(m_fCurrentAzimuth_srcR), railElevationInDegrees(m_fCurrentElevation_srcR), m_fDistance_srcR);
+        float* ears[2*NUM_OF_SOURCES] = {m_pCurrentOutput_srcL_L, m_pCurrentOutput_srcL_R, m_pCurrentOutput_srcR_L, m_pCurrentOutput_srcR_R};
+        m_NearField.process(ears, m_bTwoSources ? 2 : 1, BUFFER_SIZE);
+    }
+    
+    // Both sources through one shared HRIR pair, the governor's cheapest level
+    void processFallbackClusters(float* ySrcL, float* ySrcR) {
+        SpatialSource sources[NUM_OF_SOURCES];
+        int numSources = fillSources(sources);
+        for(int s = 0; s < numSources; s++)
+            sources[s].fAzimuth = snapAzimuth(sources[s].fAzimuth);
+        
+        m_FallbackClusterer.process(sources, numSources, ySrcL, ySrcR, BUFFER_SIZE);
+    }
+    
+    // Moves between the direct and the clustered path over two blocks. Both paths render
+    // both blocks; the first only builds up the new path's input history (it starts from
+    // silence, and would otherwise fade in its onset transient), the second crossfades.
+    void switchRenderPath(bool clustered, float* ySrcL, float* ySrcR) {
+        float* pNewL = &m_pTransition_L[0];
+        float* pNewR = &m_pTransition_R[0];
+        if(clustered) {
+            processDirect(ySrcL, ySrcR);
+            processFallbackClusters(pNewL, pNewR);
+        }
+        else {
+            processFallbackClusters(ySrcL, ySrcR);
+            processDirect(pNewL, pNewR);
+        }
+        
+        if(!m_bPathWarming) {
+            m_bPathWarming = true;
+            return;
+        }
+        
+        for(int i = 0; i < BUFFER_SIZE; i++) {
+            float fade = (i + 0.5f) / BUFFER_SIZE;
+            ySrcL[i] = (1.0f - fade)*ySrcL[i] + fade*pNewL[i];
+            ySrcR[i] = (1.0f - fade)*ySrcR[i] + fade*pNewR[i];
+        }
+        
+        // the path left behind stops being fed, so drop its history now
+        silenceRenderPath(!clustered);
+        m_bClusteredFallback = clustered;
+        m_bPathWarming = false;
+    }
+    
+    // The level went back before the switch completed, the half-warmed path is left behind
+    void abandonRenderPathSwitch() {
+        silenceRenderPath(!m_bClusteredFallback);
+        m_bPathWarming = false;
+    }
+    
+    // A bus mode took over; the direct path starts again at full quality from silence when it
+    // is back, rather than on the level and histories it was left with
+    void leaveDirectPath() {
+        m_QualityGovernor.reset();
+        m_nQualityLevel = -1;
+        silenceRenderPath(false);
+        silenceRenderPath(true);
+        m_bClusteredFallback = false;
+        m_bPathWarming = false;
+    }
+    
+    void silenceRenderPath(bool clustered) {
+        if(clustered) {
+            m_FallbackClusterer.silence();
+        }
+        else {
+            fftConvolver_srcL_L.silence();
+            fftConvolver_srcL_R.silence();
+            fftConvolver_srcR_L.silence();
+            fftConvolver_srcR_R.silence();
+        }
+    }
+    
+    // Picks up a level change from the governor at the start of a block
+    void applyQuality() {
+        int level = m_QualityGovernor.level();
+        if(level == m_nQualityLevel)
+            return;
+        m_nQualityLevel = level;
+        const QualitySettings& quality = QualityGovernor::settingsForLevel(level);
+        
+        fftConvolver_srcL_L.setCrossfade(quality.bCrossfade);
+        fftConvolver_srcL_R.setCrossfade(quality.bCrossfade);
+        fftConvolver_srcR_L.setCrossfade(quality.bCrossfade);
+        fftConvolver_srcR_R.setCrossfade(quality.bCrossfade);
+        
+        if(quality.nIRLength != m_nConvolutionLength) {
+            // the same IRs again, truncated (or restored) to the new length
+            m_nConvolutionLength = quality.nIRLength;
+            quantize2D(m_nIndex_PrevElev_srcL,m_nIndex_PrevAzi_srcL,false);
+            quantize2D(m_nIndex_PrevElev_srcR,m_nIndex_PrevAzi_srcR,true);
+        }
+        
+        // positions are looked up again on the (possibly) new grid step
+        m_fGridStep = quality.fGridStep;
+        m_bPosChanged_srcL = true;
+        m_bPosChanged_srcR = true;
+    }
+    
+    // Under load, positions snap to a coarser azimuth step so moving sources switch IRs less often
+    float snapAzimuth(float azimuth) {
+        if(m_fGridStep <= 0.0f)
+            return azimuth;
+        return roundf(azimuth / m_fGridStep) * m_fGridStep;
+    }
+    
+    // The block of each source that is pulled at its own rate rather than taken from the input bus
+    void streamSources() {
+        if(m_SourceStream_srcL.isAttached())
+            m_SourceStream_srcL.render(&m_pStreamed_srcL[0], BUFFER_SIZE);
+        if(m_bTwoSources && m_SourceStream_srcR.isAttached())
+            m_SourceStream_srcR.render(&m_pStreamed_srcR[0], BUFFER_SIZE);
+    }
+    
+    // A source pulled and resampled, or its channel of the input bus
+    const float* streamedInput(bool source) {
+        if(!source)
+            return m_SourceStream_srcL.isAttached() ? &m_pStreamed_srcL[0] : (const float*)inBufferListPtr->mBuffers[0].mData;
+        return m_SourceStream_srcR.isAttached() ? &m_pStreamed_srcR[0] : (const float*)inBufferListPtr->mBuffers[1].mData;
+    }
+    
+    // Each source through its propagation delay, when enabled. The lines start from silence
+    // when it is switched on, at the sources' current distances.
+    void delaySources() {
+        if(!m_bPropagationDelay) {
+            m_bPropagationActive = false;
+            return;
+        }
+        if(!m_bPropagationActive) {
+            m_PropagationDelay_srcL.reset();
+            m_PropagationDelay_srcR.reset();
+            m_bPropagationActive = true;
         }
+        m_PropagationDelay_srcL.setInterpolation(m_nPropagationInterpolation);
+        m_PropagationDelay_srcR.setInterpolation(m_nPropagationInterpolation);
+        m_PropagationDelay_srcL.process(streamedInput(false), &m_pDelayed_srcL[0], m_fDistance_srcL, BUFFER_SIZE);
+        if(m_bTwoSources)
+            m_PropagationDelay_srcR.process(streamedInput(true), &m_pDelayed_srcR[0], m_fDistance_srcR, BUFFER_SIZE);
+    }
+    
+    // Each source's high frequencies absorbed by the air over its distance, when enabled. The
+    // filters start empty when it is switched on.
+    void absorbSources() {
+        if(!m_bAirAbsorption) {
+            m_bAirAbsorptionActive = false;
+            return;
+        }
+        if(!m_bAirAbsorptionActive) {
+            m_AirAbsorption.reset();
+            m_bAirAbsorptionActive = true;
+        }
+        memcpy(&m_pAbsorbed_srcL[0], delayedInput(false), BUFFER_SIZE * sizeof(float));
+        if(m_bTwoSources)
+            memcpy(&m_pAbsorbed_srcR[0], delayedInput(true), BUFFER_SIZE * sizeof(float));
+        m_AirAbsorption.setDistance(0, m_fDistance_srcL);
+        m_AirAbsorption.setDistance(1, m_fDistance_srcR);
+        float* sources[NUM_OF_SOURCES] = {&m_pAbsorbed_srcL[0], &m_pAbsorbed_srcR[0]};
+        m_AirAbsorption.process(sources, m_bTwoSources ? 2 : 1, BUFFER_SIZE);
+    }
+    
+    // A source delayed or straight from its input
+    const float* delayedInput(bool source) {
+        if(!m_bPropagationActive)
+            return streamedInput(source);
+        return !source ? &m_pDelayed_srcL[0] : &m_pDelayed_srcR[0];
+    }
+    
+    // What a source's convolvers or bus renderer are fed this block, absorbed, delayed or straight
+    // from the input
+    const float* sourceInput(bool source) {
+        if(m_bAirAbsorptionActive)
+            return !source ? &m_pAbsorbed_srcL[0] : &m_pAbsorbed_srcR[0];
+        return delayedInput(source);
+    }
+    
+    // The room's early reflections added to both ears on top of the render path. The sources'
+    // positions are handed to the reflections' thread, which recomputes the paths of those that moved.
+    void processEarlyReflections(float* yLeft, float* yRight) {
+        if(!m_bEarlyReflections) {
+            m_bEarlyReflectionsActive = false;
+            return;
+        }
+        if(!m_bEarlyReflectionsActive) {
+            m_EarlyReflections.reset();
+            m_bEarlyReflectionsActive = true;
+        }
+        
+        m_EarlyReflections.setSourcePosition(0, azimuthInDegrees(m_fCurrentAzimuth_srcL), elevationInDegrees(m_fCurrentElevation_srcL), m_fDistance_srcL);
+        m_EarlyReflections.setSourcePosition(1, azimuthInDegrees(m_fCurrentAzimuth_srcR), elevationInDegrees(m_fCurrentElevation_srcR), m_fDistance_srcR);
+        
+        // the reflections turn with the head only where the direct sound does
+        Quaternion head = {1.0f, 0.0f, 0.0f, 0.0f};
+        if(m_nRenderMode == RenderModeAmbisonic)
+            head = m_HeadOrientation;
+        m_EarlyReflections.setHeadOrientation(head);
+        
+        const float* inputs[NUM_OF_SOURCES] = {sourceInput(false), sourceInput(true)};
+        m_EarlyReflections.process(inputs, m_bTwoSources ? 2 : 1, &m_pEarly_L[0], &m_pEarly_R[0], BUFFER_SIZE);
+        vectorAdd(yLeft, &m_pEarly_L[0], BUFFER_SIZE);
+        vectorAdd(yRight, &m_pEarly_R[0], BUFFER_SIZE);
+    }
+    
+    // Every source through its loaded room response, added to both ears on top of the render path
+    void processBRIR(float* yLeft, float* yRight) {
+        if(!m_bBRIR)
+            return;
+        const float* inputs[NUM_OF_SOURCES] = {sourceInput(false), sourceInput(true)};
+        m_BRIRRenderer.process(inputs, m_bTwoSources ? 2 : 1, yLeft, yRight, BUFFER_SIZE);
+    }
+    
+    // Every source's send into the reverb bus, the reverb added to both ears on top of the
+    // render path. Settings changed from the main thread are picked up here.
+    void processReverb(float* yLeft, float* yRight) {
+        if(!m_bReverb) {
+            m_bReverbActive = false;
+            return;
+        }
+        if(m_Reverb.lines() != m_nReverbLines)
+            m_Reverb.setLines(m_nReverbLines);
+        else if(!m_bReverbActive)
+            m_Reverb.reset();
+        m_bReverbActive = true;
+        m_Reverb.setDecayTime(m_fReverbTime);
+        m_Reverb.setDamping(m_fReverbDamping);
+        
+        memset(&m_pReverbBus[0], 0, sizeof(float)*BUFFER_SIZE);
+        int numSources = m_bTwoSources ? 2 : 1;
+        for(int s = 0; s < numSources; s++)
+            vectorMultiplyAccumulate(&m_pReverbBus[0], sourceInput(s == 1), m_pReverbSend[s], BUFFER_SIZE);
+        m_Reverb.process(&m_pReverbBus[0], yLeft, yRight, BUFFER_SIZE);
+    }
+    
+    // Both inputs as bus-renderer sources, returns how many are active
+    int fillSources(SpatialSource* sources) {
+        sources[0].pInput = sourceInput(false);
+        sources[0].fAzimuth = azimuthInDegrees(m_fCurrentAzimuth_srcL);
+        sources[0].fElevation = elevationInDegrees(m_fCurrentElevation_srcL);
+        sources[0].fGain = 1.0 / (m_fDistance_srcL);
+        sources[1].pInput = sourceInput(true);
+        sources[1].fAzimuth = azimuthInDegrees(m_fCurrentAzimuth_srcR);
+        sources[1].fElevation = elevationInDegrees(m_fCurrentElevation_srcR);
+        sources[1].fGain = 1.0 / (m_fDistance_srcR);
+        
+        return m_bTwoSources ? 2 : 1;
+    }
+    
+    void processAmbisonic() {
+        float* ySrcL = (float*)outBufferListPtr->mBuffers[0].mData;
+        float* ySrcR = (float*)outBufferListPtr->mBuffers[1].mData;
+        
+        SpatialSource sources[NUM_OF_SOURCES];
+        int numSources = fillSources(sources);
+        
+        // Only the newest head orientation matters, older ones are skipped
+        AmbisonicRenderer* renderer = m_AmbisonicSlot.live();
+        if(m_HeadOrientationQueue.popLatest(m_HeadOrientation))
+            renderer->setHeadOrientation(m_HeadOrientation);
+        
+        renderer->process(sources, numSources, ySrcL, ySrcR, BUFFER_SIZE);
+    }
+    
+    void processVirtualSpeakers() {
+        float* ySrcL = (float*)outBufferListPtr->mBuffers[0].mData;
+        float* ySrcR = (float*)outBufferListPtr->mBuffers[1].mData;
+        
+        SpatialSource sources[NUM_OF_SOURCES];
+        int numSources = fillSources(sources);
+        
+        m_VirtualSpeakerSlot.live()->process(sources, numSources, ySrcL, ySrcR, BUFFER_SIZE);
+    }
+    
+    void processPCA() {
+        float* ySrcL = (float*)outBufferListPtr->mBuffers[0].mData;
+        float* ySrcR = (float*)outBufferListPtr->mBuffers[1].mData;
+        
+        SpatialSource sources[NUM_OF_SOURCES];
+        int numSources = fillSources(sources);
+        
+        m_PCASlot.live()->process(sources, numSources, ySrcL, ySrcR, BUFFER_SIZE);
+    }
+    
+    void processClustered() {
+        float* ySrcL = (float*)outBufferListPtr->mBuffers[0].mData;
+        float* ySrcR = (float*)outBufferListPtr->mBuffers[1].mData;
+        
+        SpatialSource sources[NUM_OF_SOURCES];
+        int numSources = fillSources(sources);
+        
+        m_SourceClustererSlot.live()->process(sources, numSources, ySrcL, ySrcR, BUFFER_SIZE);
+    }
+    
+    // Render thread: the requested mode and any renderer built for it, picked up at the start of
+    // a block. A mode whose renderer is not ready yet renders through the direct path.
+    void adoptRenderer() {
+        int mode = m_nRequestedRenderMode.load(std::memory_order_acquire);
+        bool ready = true;
+        if(mode == RenderModeAmbisonic) {
+            if(m_AmbisonicSlot.adopt())
+                m_AmbisonicSlot.live()->setHeadOrientation(m_HeadOrientation);
+            ready = m_AmbisonicSlot.live() != NULL;
+        }
+        else if(mode == RenderModeVirtualSpeakers) {
+            m_VirtualSpeakerSlot.adopt();
+            ready = m_VirtualSpeakerSlot.live() != NULL;
+        }
+        else if(mode == RenderModePCA) {
+            m_PCASlot.adopt();
+            ready = m_PCASlot.live() != NULL;
+        }
+        else if(mode == RenderModeClustered) {
+            m_SourceClustererSlot.adopt();
+            ready = m_SourceClustererSlot.live() != NULL;
+        }
+        int renderMode = ready ? mode : int(RenderModeDirect);
+        if(renderMode != m_nRenderMode && m_nRenderMode == RenderModeDirect)
+            leaveDirectPath();
+        m_nRenderMode = renderMode;
+    }
+    
+    // Wakes the renderer builder, starting it on the first request
+    void requestRenderer() {
+        {
+            std::lock_guard<std::mutex> lock(m_BuilderMutex);
+            m_bBuildRequested = true;
+        }
+        if(!m_RendererBuilder.joinable()) {
+            m_bBuilderStopping = false;
+            m_RendererBuilder = std::thread(&SpatialDSPKernel::buildRenderers, this);
+        }
+        else
+            m_BuilderWake.notify_one();
+    }
+    
+    void stopRendererBuilder() {
+        if(!m_RendererBuilder.joinable())
+            return;
+        {
+            std::lock_guard<std::mutex> lock(m_BuilderMutex);
+            m_bBuilderStopping = true;
+        }
+        m_BuilderWake.notify_one();
+        m_RendererBuilder.join();
+    }
+    
+    // Drops every bus renderer, with the builder stopped and the render thread not running
+    void clearRenderers() {
+        m_AmbisonicSlot.clear();
+        m_VirtualSpeakerSlot.clear();
+        m_PCASlot.clear();
+        m_SourceClustererSlot.clear();
+        m_nBuiltAmbisonicOrder = 0;
+        m_nBuiltVirtualSpeakers = 0;
+        m_nBuiltPCAComponents = 0;
+        m_nBuiltSourceClusters = 0;
+    }
+    
+    // Builder thread: a pass per request, parked in between. While a renderer waits to be picked
+    // up or freed it comes back every RENDERER_COLLECT_MS instead.
+    void buildRenderers() {
+        std::unique_lock<std::mutex> lock(m_BuilderMutex);
+        while(!m_bBuilderStopping) {
+            m_bBuildRequested = false;
+            lock.unlock();
+            bool inFlight = buildRenderer();
+            lock.lock();
+            if(m_bBuildRequested || m_bBuilderStopping)
+                continue;
+            if(inFlight)
+                m_BuilderWake.wait_for(lock, std::chrono::milliseconds(RENDERER_COLLECT_MS));
+            else
+                m_BuilderWake.wait(lock);
+        }
+    }
+    
+    // Frees what the render thread let go of, then builds the requested mode's renderer if its
+    // settings changed and the last one has been picked up. Returns whether a swap is in flight.
+    bool buildRenderer() {
+        bool ambisonicBusy = m_AmbisonicSlot.collect();
+        bool speakersBusy = m_VirtualSpeakerSlot.collect();
+        bool pcaBusy = m_PCASlot.collect();
+        bool clustersBusy = m_SourceClustererSlot.collect();
+        bool inFlight = ambisonicBusy || speakersBusy || pcaBusy || clustersBusy;
+        if(!m_pHRTFBank)
+            return inFlight;
+        
+        const HRTFBank& bank = *m_pHRTFBank;
+        int mode = m_nRequestedRenderMode;
+        if(mode == RenderModeAmbisonic && !ambisonicBusy && m_nBuiltAmbisonicOrder != m_nAmbisonicOrder) {
+            m_nBuiltAmbisonicOrder = m_nAmbisonicOrder;
+            AmbisonicRenderer* renderer = new AmbisonicRenderer;
+            renderer->init(bank.grid(), m_nBuiltAmbisonicOrder, BUFFER_SIZE, NUM_OF_SOURCES);
+            m_AmbisonicSlot.publish(renderer);
+            inFlight = true;
+        }
+        else if(mode == RenderModeVirtualSpeakers && !speakersBusy && m_nBuiltVirtualSpeakers != m_nVirtualSpeakers) {
+            m_nBuiltVirtualSpeakers = m_nVirtualSpeakers;
+            VirtualSpeakerRenderer* renderer = new VirtualSpeakerRenderer;
+            renderer->init(bank, m_nBuiltVirtualSpeakers, BUFFER_SIZE, NUM_OF_SOURCES);
+            m_VirtualSpeakerSlot.publish(renderer);
+            inFlight = true;
+        }
+        else if(mode == RenderModePCA && !pcaBusy && m_nBuiltPCAComponents != m_nPCAComponents) {
+            m_nBuiltPCAComponents = m_nPCAComponents;
+            PCARenderer* renderer = new PCARenderer;
+            renderer->init(bank.grid(), m_nBuiltPCAComponents, BUFFER_SIZE, NUM_OF_SOURCES);
+            m_PCASlot.publish(renderer);
+            inFlight = true;
+        }
+        else if(mode == RenderModeClustered && !clustersBusy && m_nBuiltSourceClusters != m_nSourceClusters) {
+            m_nBuiltSourceClusters = m_nSourceClusters;
+            SourceClusterer* renderer = new SourceClusterer;
+            renderer->init(bank, m_nBuiltSourceClusters, BUFFER_SIZE, NUM_OF_SOURCES);
+            m_SourceClustererSlot.publish(renderer);
+            inFlight = true;
+        }
+        return inFlight;
     }
     
     // Get/Set Methods
@@ -518,15 +968,234 @@ public:
         m_bHRTFMode = mode;
     }
     
+    // The bus renderer a mode needs is built on the builder thread and picked up by the render
+    // thread at the start of a block; the direct path renders until it is ready.
+    void setRenderMode(int mode) {
+        m_nRequestedRenderMode = clamp(mode, int(RenderModeDirect), int(RenderModeClustered));
+        if(m_nRequestedRenderMode != RenderModeDirect)
+            requestRenderer();
+    }
+    
+    // Listener head orientation (x front, y left, z up). Lock-free, may be called from a
+    // sensor thread while rendering; only used by the ambisonic mode.
+    void setHeadOrientation(float w, float x, float y, float z) {
+        Quaternion q = {w, x, y, z};
+        m_HeadOrientationQueue.push(q);
+    }
+    
+    // The decoder is rebuilt off the render thread, the current one renders until then
+    void setAmbisonicOrder(int order) {
+        m_nAmbisonicOrder = AmbisonicRenderer::clampOrder(order);
+        if(m_nRequestedRenderMode == RenderModeAmbisonic)
+            requestRenderer();
+    }
+    
+    // 8 to 24 virtual loudspeakers; more gives sharper images at more convolutions
+    void setVirtualSpeakerCount(int count) {
+        m_nVirtualSpeakers = VirtualSpeakerRenderer::clampSpeakerCount(count);
+        if(m_nRequestedRenderMode == RenderModeVirtualSpeakers)
+            requestRenderer();
+    }
+    
+    // Number of principal components kept per ear (4 to 32). The decomposition takes about a
+    // second and runs on the renderer builder; the current renderer plays until it is done.
+    void setPCAComponentCount(int count) {
+        m_nPCAComponents = PCARenderer::clampComponentCount(count);
+        if(m_nRequestedRenderMode == RenderModePCA)
+            requestRenderer();
+    }
+    
+    // Upper bound on HRIR pairs in clustered mode (1 to 16), whatever the source count
+    void setSourceClusterCount(int count) {
+        m_nSourceClusters = SourceClusterer::clampClusterCount(count);
+        if(m_nRequestedRenderMode == RenderModeClustered)
+            requestRenderer();
+    }
+    
+    // Storage format of the HRIR spectra (fftconvolver::SpectrumPrecision). The 16-bit formats
+    // halve the bank's memory and the convolvers' memory traffic. Takes effect from the next init().
+    void setSpectrumPrecision(int precision) {
+        m_nSpectrumPrecision = fftconvolver::SpectrumPrecision(clamp(precision, int(fftconvolver::SpectrumFloat32), int(fftconvolver::SpectrumBFloat16)));
+    }
+    
+    // Pulls a source (0 or 1) at its own sample rate instead of taking it from the input bus,
+    // resampled to the render rate; a NULL pull goes back to the bus. Takes effect from the next
+    // init(), the pull function and context must stay valid until the one after.
+    void setSourceStream(int source, SourcePullFunction pull, void* context, int sourceRate) {
+        if(source < 0 || source >= NUM_OF_SOURCES)
+            return;
+        m_pSourcePull[source] = sourceRate > 0 ? pull : NULL;
+        m_pSourceContext[source] = context;
+        m_pSourceRate[source] = sourceRate;
+    }
+    
+    // Filter length of the source resamplers, a ResamplerQuality. Takes effect from the next init().
+    void setResamplerQuality(int quality) {
+        m_nResamplerQuality = clamp(quality, int(ResamplerQualityLow), int(ResamplerQualityHigh));
+    }
+    
+    // Directory the HRIRs resampled to a host rate are cached in across launches, used by
+    // banks loaded from the next init() on
+    void setHRIRCacheDirectory(const char* directory) {
+        HRTFBank::setCacheDirectory(directory ? directory : "");
+    }
+    
+    // Lets the kernel trade direct-mode quality for CPU under load (on by default)
+    void setAdaptiveQuality(bool enabled) {
+        m_QualityGovernor.setEnabled(enabled);
+    }
+    
+    // 0 is full quality, see QualityGovernor::settingsForLevel
+    int qualityLevel() {
+        return m_QualityGovernor.level();
+    }
+    
+    // Last direct-mode block's render time as a fraction of its deadline, 0 in the bus modes
+    float renderLoad() {
+        return m_QualityGovernor.load();
+    }
+    
+    // Delays each source by its distance over the speed of sound, so moving sources are
+    // Doppler shifted (off by default, it adds that much latency)
+    void setPropagationDelay(bool enabled) {
+        m_bPropagationDelay = enabled;
+    }
+    
+    // Interpolator of the propagation delay lines, a DDLInterpolation
+    // (picked up at the start of the next block, like the reverb settings)
+    void setPropagationInterpolation(int interpolation) {
+        m_nPropagationInterpolation = clamp(interpolation, int(DDLInterpolationLinear), int(DDLInterpolationSinc));
+    }
+    
+    // High-frequency loss of the air between each source and the listener, by distance (off by
+    // default). Ahead of every render path, so reflections and reverb are absorbed too.
+    void setAirAbsorption(bool enabled) {
+        m_bAirAbsorption = enabled;
+    }
+    
+    // Shared late reverb on top of every render mode (off by default)
+    void setReverb(bool enabled) {
+        m_bReverb = enabled;
+    }
+    
+    // How much of a source (0 left, 1 right) goes to the reverb
+    void setReverbSend(int source, float send) {
+        m_pReverbSend[clamp(source, 0, NUM_OF_SOURCES-1)] = std::max(send, 0.0f);
+    }
+    
+    // 60 dB decay time in seconds
+    void setReverbTime(float seconds) {
+        m_fReverbTime = seconds;
+    }
+    
+    // 0 to 1, how much faster high frequencies decay
+    void setReverbDamping(float damping) {
+        m_fReverbDamping = damping;
+    }
+    
+    // 8 or 16 delay lines; 16 gives a denser tail for twice the cost
+    void setReverbLines(int lines) {
+        m_nReverbLines = FDNReverb::clampLineCount(lines);
+    }
+    
+    // Shoebox early reflections on top of every render mode (off by default)
+    void setEarlyReflections(bool enabled) {
+        m_bEarlyReflections = enabled;
+        m_EarlyReflections.setActive(enabled);
+    }
+    
+    // Room size in metres (x front, y left, z up, 1 to EARLY_MAX_ROOM_SIZE each) and the fraction
+    // of energy each wall absorbs
+    void setRoom(float length, float width, float height, float absorption) {
+        RoomSettings room = m_EarlyReflections.room();
+        room.pSize[0] = length;
+        room.pSize[1] = width;
+        room.pSize[2] = height;
+        room.fAbsorption = absorption;
+        m_EarlyReflections.setRoom(room);
+    }
+    
+    // Where the listener stands, in metres from the room's back right floor corner
+    void setListenerPosition(float x, float y, float z) {
+        RoomSettings room = m_EarlyReflections.room();
+        room.pListener[0] = x;
+        room.pListener[1] = y;
+        room.pListener[2] = z;
+        m_EarlyReflections.setRoom(room);
+    }
+    
+    // Highest reflection order rendered, 1 to 3
+    void setReflectionOrder(int order) {
+        RoomSettings room = m_EarlyReflections.room();
+        room.nOrder = order;
+        m_EarlyReflections.setRoom(room);
+    }
+    
+    // Binaural room responses on top of every render mode (off by default)
+    void setBRIR(bool enabled) {
+        m_bBRIR = enabled;
+        m_BRIRRenderer.setActive(enabled);
+    }
+    
+    // A source's (0 left, 1 right) room response, one impulse response per ear. Partitions it on
+    // the calling thread, so not from the render thread; rendering switches over on its next block.
+    bool loadBRIR(int source, const float* left, const float* right, int length) {
+        return m_BRIRRenderer.load(source, left, right, length);
+    }
+    
+    // Tail blocks the room responses' background thread delivered too late (and left silent)
+    int brirDeadlineMisses() {
+        return int(m_BRIRRenderer.deadlineMisses());
+    }
+    
+    // Distance-dependent ILD and head shadow for the direct path (off by default). The bus
+    // modes mix the sources before the ears, so they are not corrected.
+    void setNearField(bool enabled) {
+        m_bNearField = enabled;
+    }
+    
     void setGain(float gainValue) {
         m_fGain = gainValue;
     }
     
     
-    int findClosetElevation(float elevation) {
-        float indexWithDec = elevation * (ELEV_RAILS - 1);
-
-        return round(indexWithDec);
+    // Nearest measured IR to a slider position, as a rail and an index on that rail. The
+    // elevation slider picks the rail the way the direct path always has, spread evenly over the
+    // rails; the azimuth is the nearest measured one on that rail. The grid is built rail by
+    // rail, so its index splits straight into the two.
+    void findClosestIR(float azimuth, float elevation, int& elevIndex, int& aziIndex) {
+        elevIndex = (int)roundf(clamp(elevation, 0.0f, 1.0f)*(ELEV_RAILS-1));
+        int position = m_pHRTFBank->sphericalGrid().nearest(snapAzimuth(azimuthInDegrees(azimuth)), HRTFBank::elevationForRail(elevIndex));
+        aziIndex = position % NUM_OF_IRS;
+    }
+    
+    // Slider value (0 to 1) -> degrees, following the same index mapping as quantize2D
+    float azimuthInDegrees(float azimuth) {
+        float indexWithDec = clamp(azimuth, 0.0f, 1.0f)*(NUM_OF_IRS-1);
+        int index = std::min((int)floor(indexWithDec), NUM_OF_IRS-2);
+        float remainder = indexWithDec - index;
+        float a0 = HRTFBank::azimuthForIndex(index);
+        float a1 = HRTFBank::azimuthForIndex(index+1);
+        // indices run clockwise, so the next one may wrap through 0°
+        if(a1 - a0 > 180.0f)
+            a1 -= 360.0f;
+        return a0 + remainder*(a1 - a0);
+    }
+    
+    // Slider value (0 to 1) -> degrees, the UI maps -45° to 75°
+    float elevationInDegrees(float elevation) {
+        return clamp(elevation, 0.0f, 1.0f)*120.0f - 45.0f;
+    }
+    
+    // Slider value (0 to 1) -> degrees along the rails, following the same mapping as
+    // findClosestIR, so the rail nearest the result is (ties aside) the one the direct path is on
+    float railElevationInDegrees(float elevation) {
+        float indexWithDec = clamp(elevation, 0.0f, 1.0f)*(ELEV_RAILS-1);
+        int index = std::min((int)floor(indexWithDec), ELEV_RAILS-2);
+        float remainder = indexWithDec - index;
+        float e0 = HRTFBank::elevationForRail(index);
+        float e1 = HRTFBank::elevationForRail(index+1);
+        return e0 + remainder*(e1 - e0);
     }
 
     
@@ -543,63 +1212,111 @@ private:
     AudioBufferList* inBufferListPtr = nullptr;
     AudioBufferList* outBufferListPtr = nullptr;
     
-    // Quantization Method
-    // requires 2 IRs (L+R) for each source
-    // if using one source, use left
-    // m_pCurrentIR_<source>_<ear>
-    float* m_pCurrentIR_srcL_L;
-    float* m_pCurrentIR_srcL_R;
-    // if using two sources, right source
-    float* m_pCurrentIR_srcR_L;
-    float* m_pCurrentIR_srcR_R;
-    
-    // Previous IRs for implementing switching technique
-    float* m_pPreviousIR_srcL_L;
-    float* m_pPreviousIR_srcL_R;
-    // right source
-    float* m_pPreviousIR_srcR_L;
-    float* m_pPreviousIR_srcR_R;
-    
     // Output pointers
     float* m_pCurrentOutput_srcL_L;
     float* m_pCurrentOutput_srcL_R;
     float* m_pCurrentOutput_srcR_L;
     float* m_pCurrentOutput_srcR_R;
+    // ------------------------
     
-    float* m_pPreviousOutput_srcL_L;
-    float* m_pPreviousOutput_srcL_R;
-    float* m_pPreviousOutput_srcR_L;
-    float* m_pPreviousOutput_srcR_R;
+    // HRIRs, their directions and spectra, shared with every other instance
+    std::shared_ptr<const HRTFBank> m_pHRTFBank;
+    fftconvolver::SpectrumPrecision m_nSpectrumPrecision = fftconvolver::SpectrumFloat32;
+    // between init() and deallocate(), counted by the bank as rendering from it
+    bool m_bRendering = false;
+    // The bank rail each source's convolvers are on (declared after the bank, so released before it)
+    RailTracker m_RailTracker_srcL;
+    RailTracker m_RailTracker_srcR;
     
-    float m_pFadingVector_1[BUFFER_SIZE];
-    float m_pFadingVector_2[BUFFER_SIZE];
-    // ------------------------
+    // Render mode the render thread is on, and what the main thread asked for
+    int m_nRenderMode = RenderModeDirect;
+    std::atomic<int> m_nRequestedRenderMode{RenderModeDirect};
+    std::atomic<int> m_nAmbisonicOrder{3};
+    std::atomic<int> m_nVirtualSpeakers{16};
+    std::atomic<int> m_nPCAComponents{12};
+    std::atomic<int> m_nSourceClusters{8};
+    // The bus renderers (declared after the bank, so freed before it) and what the builder last
+    // built for each
+    RendererSlot<AmbisonicRenderer> m_AmbisonicSlot;
+    RendererSlot<VirtualSpeakerRenderer> m_VirtualSpeakerSlot;
+    RendererSlot<PCARenderer> m_PCASlot;
+    RendererSlot<SourceClusterer> m_SourceClustererSlot;
+    int m_nBuiltAmbisonicOrder = 0;
+    int m_nBuiltVirtualSpeakers = 0;
+    int m_nBuiltPCAComponents = 0;
+    int m_nBuiltSourceClusters = 0;
+    // Builder thread, started by the first request and parked while there is nothing to build
+    bool m_bBuilderStopping = false;
+    bool m_bBuildRequested = false;
+    std::mutex m_BuilderMutex;
+    std::condition_variable m_BuilderWake;
+    std::thread m_RendererBuilder;
+    
+    // Quality governor and what the direct path is currently running at
+    QualityGovernor m_QualityGovernor;
+    int m_nQualityLevel;
+    float m_fGridStep;
+    bool m_bClusteredFallback;
+    bool m_bPathWarming;
+    SourceClusterer m_FallbackClusterer;
+    std::vector<float> m_pTransition_L;
+    std::vector<float> m_pTransition_R;
     
-    // Sets up HRIRs to arrays
-    IRArraySetter m_IRArraySetter;
-    
-    // Pointer Array to IRS
-    float* m_pIRs_E0_L[NUM_OF_IRS];
-    float* m_pIRs_E0_R[NUM_OF_IRS];
-//    float* m_pIRs_E15_L[NUM_OF_IRS];
-//    float* m_pIRs_E15_R[NUM_OF_IRS];
-//    float* m_pIRs_E30_L[NUM_OF_IRS];
-//    float* m_pIRs_E30_R[NUM_OF_IRS];
-    float* m_pIRs_E45_L[NUM_OF_IRS];
-    float* m_pIRs_E45_R[NUM_OF_IRS];
-//    float* m_pIRs_E60_L[NUM_OF_IRS];
-//    float* m_pIRs_E60_R[NUM_OF_IRS];
-    float* m_pIRs_E75_L[NUM_OF_IRS];
-    float* m_pIRs_E75_R[NUM_OF_IRS];
-    float* m_pIRs_E315_L[NUM_OF_IRS];
-    float* m_pIRs_E315_R[NUM_OF_IRS];
-//    float* m_pIRs_E330_L[NUM_OF_IRS];
-//    float* m_pIRs_E330_R[NUM_OF_IRS];
-//    float* m_pIRs_E345_L[NUM_OF_IRS];
-//    float* m_pIRs_E345_R[NUM_OF_IRS];
-    
-    float** m_ppIRs_L_AziRails[ELEV_RAILS];
-    float** m_ppIRs_R_AziRails[ELEV_RAILS];
+    // Sources pulled at their own rates, and what they were set to for the next init()
+    SourceStream m_SourceStream_srcL;
+    SourceStream m_SourceStream_srcR;
+    std::vector<float> m_pStreamed_srcL;
+    std::vector<float> m_pStreamed_srcR;
+    SourcePullFunction m_pSourcePull[NUM_OF_SOURCES] = {NULL, NULL};
+    void* m_pSourceContext[NUM_OF_SOURCES] = {NULL, NULL};
+    int m_pSourceRate[NUM_OF_SOURCES] = {0, 0};
+    int m_nResamplerQuality = ResamplerQualityMedium;
+    
+    // Propagation delay per source and what it hands the renderers
+    bool m_bPropagationDelay = false;
+    bool m_bPropagationActive = false;
+    int m_nPropagationInterpolation = DDLInterpolationLagrange3;
+    PropagationDelay m_PropagationDelay_srcL;
+    PropagationDelay m_PropagationDelay_srcR;
+    std::vector<float> m_pDelayed_srcL;
+    std::vector<float> m_pDelayed_srcR;
+    
+    // Air absorption per source, after the delay
+    bool m_bAirAbsorption = false;
+    bool m_bAirAbsorptionActive = false;
+    AirAbsorption m_AirAbsorption;
+    std::vector<float> m_pAbsorbed_srcL;
+    std::vector<float> m_pAbsorbed_srcR;
+    
+    // Late reverb, its settings and the bus the sources send to
+    bool m_bReverb = false;
+    bool m_bReverbActive = false;
+    int m_nReverbLines = FDN_MIN_LINES;
+    float m_fReverbTime = 1.5f;
+    float m_fReverbDamping = 0.3f;
+    float m_pReverbSend[NUM_OF_SOURCES] = {0.3f, 0.3f};
+    FDNReverb m_Reverb;
+    std::vector<float> m_pReverbBus;
+    
+    // Early reflections and their share of the two ears
+    bool m_bEarlyReflections = false;
+    bool m_bEarlyReflectionsActive = false;
+    EarlyReflections m_EarlyReflections;
+    std::vector<float> m_pEarly_L;
+    std::vector<float> m_pEarly_R;
+    
+    // Near-field correction of the direct path
+    bool m_bNearField = false;
+    bool m_bNearFieldActive = false;
+    NearFieldCorrection m_NearField;
+    
+    // Binaural room responses per source
+    bool m_bBRIR = false;
+    BRIRRenderer m_BRIRRenderer;
+    
+    // Head tracking, written by the sensor thread and drained once per block
+    QuaternionQueue m_HeadOrientationQueue;
+    Quaternion m_HeadOrientation = {1.0f, 0.0f, 0.0f, 0.0f};
     
     // float values for current azimuth angles
     float m_fCurrentAzimuth_srcL;
@@ -627,7 +1344,7 @@ private:
     // gain
     float m_fGain;
     
-    // convolution length (8192)
+    // convolution length (8192, shorter when the governor truncates)
     int m_nConvolutionLength;
     
     
@@ -645,15 +1362,11 @@ public:
     // Public variables
     bool m_bHRTFMode;
     
-    fftconvolver::FFTConvolver fftConvolver_srcL_L;
-    fftconvolver::FFTConvolver fftConvolver_srcL_R;
-    fftconvolver::FFTConvolver fftConvolver_srcR_L;
-    fftconvolver::FFTConvolver fftConvolver_srcR_R;
-    
-    fftconvolver::FFTConvolver fftConvolverPrev_srcL_L;
-    fftconvolver::FFTConvolver fftConvolverPrev_srcL_R;
-    fftconvolver::FFTConvolver fftConvolverPrev_srcR_L;
-    fftconvolver::FFTConvolver fftConvolverPrev_srcR_R;
+    // Each one holds the current and the outgoing IR of a source/ear pair
+    fftconvolver::SwitchingConvolver fftConvolver_srcL_L;
+    fftconvolver::SwitchingConvolver fftConvolver_srcL_R;
+    fftconvolver::SwitchingConvolver fftConvolver_srcR_L;
+    fftconvolver::SwitchingConvolver fftConvolver_srcR_R;
 
 };
 
@@ -0,0 +1,21 @@
+//
+//  SpatialSource.hpp
+//  Capstone
+//
+
+#ifndef SpatialSource_hpp
+#define SpatialSource_hpp
+
+/*
+	SpatialSource
+	One mono emitter handed to the bus renderers for a single block.
+	Angles use the same convention as HRIRGrid (degrees, azimuth counter-clockwise from the front).
+ */
+struct SpatialSource {
+    const float* pInput;
+    float fAzimuth;
+    float fElevation;
+    float fGain;
+};
+
+#endif /* SpatialSource_hpp */
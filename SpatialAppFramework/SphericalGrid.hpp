@@ -0,0 +1,407 @@
+//
+//  SphericalGrid.hpp
+//  Capstone
+//
+
+#ifndef SphericalGrid_hpp
+#define SphericalGrid_hpp
+
+#include "HRIRGrid.hpp"
+#include <vector>
+#include <map>
+#include <utility>
+#include <algorithm>
+
+// Coarse direction table used to start point-location walks, in 5° cells
+#define GRID_LOOKUP_AZIMUTHS 72
+#define GRID_LOOKUP_ELEVATIONS 36
+
+/*
+	SphericalGrid
+	Delaunay triangulation of an arbitrary set of directions on the sphere, built as the convex
+	hull of their unit vectors. Imaginary vertices are added at the poles when the set does not
+	cover them, so every direction falls inside some triangle.
+	Queries start from a precomputed 5° table and walk across neighbouring triangles, which is
+	a couple of steps for any sensibly sampled grid, so lookup is effectively O(1).
+ */
+class SphericalGrid {
+public:
+
+    SphericalGrid() {
+        m_nPoints = 0;
+    }
+
+    // Triangulates the directions (degrees, same convention as HRIRGrid). Not real-time safe.
+    void build(const std::vector<float>& azimuths, const std::vector<float>& elevations) {
+        m_nPoints = (int)azimuths.size();
+        m_pVectors.clear();
+        bool hasZenith = false, hasNadir = false;
+        for(int i = 0; i < m_nPoints; i++) {
+            float v[3];
+            directionToVector(azimuths[i], elevations[i], v);
+            m_pVectors.insert(m_pVectors.end(), v, v + 3);
+            hasZenith |= elevations[i] > 89.0f;
+            hasNadir |= elevations[i] < -89.0f;
+        }
+        if(!hasZenith) {
+            float zenith[3] = {0.0f, 0.0f, 1.0f};
+            m_pVectors.insert(m_pVectors.end(), zenith, zenith + 3);
+        }
+        if(!hasNadir) {
+            float nadir[3] = {0.0f, 0.0f, -1.0f};
+            m_pVectors.insert(m_pVectors.end(), nadir, nadir + 3);
+        }
+
+        buildHull();
+        connectTriangles();
+        buildLookup();
+        findPhantomNeighbours();
+    }
+
+    void build(const HRIRGrid& grid) {
+        std::vector<float> azimuths(grid.size()), elevations(grid.size());
+        for(int d = 0; d < grid.size(); d++) {
+            azimuths[d] = grid.azimuth(d);
+            elevations[d] = grid.elevation(d);
+        }
+        build(azimuths, elevations);
+    }
+
+    // Number of real (measured) points; phantom pole vertices come after them
+    int size() const { return m_nPoints; }
+    int triangles() const { return (int)m_pTriangles.size(); }
+    bool isPhantom(int vertex) const { return vertex >= m_nPoints; }
+
+    // Real points that share a triangle with a phantom pole vertex
+    const std::vector<int>& phantomNeighbours(int vertex) const {
+        return m_pPhantomNeighbours[vertex - m_nPoints];
+    }
+
+    /*
+     Triangle enclosing the direction and the raw gains g that solve p = g0*a + g1*b + g2*c
+     (VBAP gains, clamped to be non-negative). Returns the triangle index.
+     */
+    int locate(float azimuth, float elevation, int* pVertices, float* pGains) const {
+        float p[3];
+        directionToVector(azimuth, elevation, p);
+
+        int t = m_pLookup[lookupCell(azimuth, elevation)];
+        float g[3];
+        for(int steps = 0; steps < triangles(); steps++) {
+            gains(m_pTriangles[t], p, g);
+            int worst = 0;
+            if(g[1] < g[worst]) worst = 1;
+            if(g[2] < g[worst]) worst = 2;
+            if(g[worst] >= -1e-5f)
+                break;
+            t = m_pTriangles[t].neighbour[worst];
+        }
+
+        const Triangle& tri = m_pTriangles[t];
+        for(int k = 0; k < 3; k++) {
+            pVertices[k] = tri.vertex[k];
+            pGains[k] = std::max(g[k], 0.0f);
+        }
+        return t;
+    }
+
+    /*
+     Interpolation weights over real points only, summing to one. A phantom pole's share goes
+     to the other corners, i.e. beyond the outermost ring the ring itself is used.
+     Returns how many points were written (at most 3).
+     */
+    int interpolate(float azimuth, float elevation, int* pPoints, float* pWeights) const {
+        int vertices[3];
+        float g[3];
+        locate(azimuth, elevation, vertices, g);
+
+        int count = 0;
+        float total = 0.0f;
+        for(int k = 0; k < 3; k++) {
+            if(isPhantom(vertices[k]))
+                continue;
+            pPoints[count] = vertices[k];
+            pWeights[count] = g[k];
+            total += g[k];
+            count++;
+        }
+        for(int k = 0; k < count; k++)
+            pWeights[k] = total > 0.0f ? pWeights[k] / total : 1.0f / count;
+        return count;
+    }
+
+    // Closest real corner of the enclosing triangle (by angle, not by weight: the triangles
+    // between rails are long and thin, so the largest weight can be the far rail)
+    int nearest(float azimuth, float elevation) const {
+        int points[3];
+        float weights[3];
+        int count = interpolate(azimuth, elevation, points, weights);
+        float p[3];
+        directionToVector(azimuth, elevation, p);
+        int best = 0;
+        float bestDot = -2.0f;
+        for(int k = 0; k < count; k++) {
+            const float* v = &m_pVectors[3*points[k]];
+            float dot = p[0]*v[0] + p[1]*v[1] + p[2]*v[2];
+            if(dot > bestDot) {
+                bestDot = dot;
+                best = k;
+            }
+        }
+        return points[best];
+    }
+
+private:
+
+    struct Triangle {
+        int vertex[3];
+        // triangle across the edge opposite each vertex
+        int neighbour[3];
+        float inverse[3][3];
+    };
+
+    /*
+     Incremental convex hull, in double precision on slightly jittered copies of the points:
+     measured grids are full of coplanar rings and co-circular quadruples (two rails at matching
+     azimuths), and either diagonal is a valid Delaunay split of those. Points are inserted in
+     a scrambled order so a whole ring is never added in a row.
+     */
+    void buildHull() {
+        int numVertices = (int)m_pVectors.size() / 3;
+        std::vector<double> jittered(m_pVectors.begin(), m_pVectors.end());
+        unsigned seed = 12345u;
+        for(int i = 0; i < numVertices * 3; i++) {
+            seed = seed * 1664525u + 1013904223u;
+            jittered[i] += 1e-6 * (double(seed >> 8) / double(1 << 24) - 0.5);
+        }
+        std::vector<int> order(numVertices);
+        for(int i = 0; i < numVertices; i++)
+            order[i] = i;
+        for(int i = numVertices - 1; i > 0; i--) {
+            seed = seed * 1664525u + 1013904223u;
+            std::swap(order[i], order[(seed >> 8) % (i + 1)]);
+        }
+
+        m_pTriangles.clear();
+        std::vector<Face> faces;
+
+        // Start from a tetrahedron of well separated points
+        int a = 0, b = 0, c = 0, d = 0;
+        double best = -1.0;
+        for(int i = 1; i < numVertices; i++) {
+            double distance = squaredDistance(&jittered[3*a], &jittered[3*i]);
+            if(distance > best) { best = distance; b = i; }
+        }
+        best = -1.0;
+        for(int i = 0; i < numVertices; i++) {
+            double n[3];
+            triangleNormal(&jittered[3*a], &jittered[3*b], &jittered[3*i], n);
+            double area = n[0]*n[0] + n[1]*n[1] + n[2]*n[2];
+            if(area > best) { best = area; c = i; }
+        }
+        best = -1.0;
+        for(int i = 0; i < numVertices; i++) {
+            double distance = fabs(planeDistance(&jittered[3*a], &jittered[3*b], &jittered[3*c], &jittered[3*i]));
+            if(distance > best) { best = distance; d = i; }
+        }
+        if(planeDistance(&jittered[3*a], &jittered[3*b], &jittered[3*c], &jittered[3*d]) > 0.0f)
+            std::swap(b, c);
+        addFace(faces, a, b, c);
+        addFace(faces, a, d, b);
+        addFace(faces, b, d, c);
+        addFace(faces, c, d, a);
+
+        for(int i = 0; i < numVertices; i++) {
+            int p = order[i];
+            if(p == a || p == b || p == c || p == d)
+                continue;
+
+            // Faces the new point can see, and the horizon around them
+            std::vector<bool> visible(faces.size(), false);
+            std::map<std::pair<int, int>, bool> edges;
+            bool anyVisible = false;
+            for(size_t f = 0; f < faces.size(); f++) {
+                if(!faces[f].alive)
+                    continue;
+                const int* v = faces[f].vertex;
+                if(planeDistance(&jittered[3*v[0]], &jittered[3*v[1]], &jittered[3*v[2]], &jittered[3*p]) > 1e-15) {
+                    visible[f] = true;
+                    anyVisible = true;
+                    for(int k = 0; k < 3; k++)
+                        edges[std::make_pair(v[k], v[(k+1)%3])] = true;
+                }
+            }
+            if(!anyVisible)
+                continue;
+
+            for(size_t f = 0; f < visible.size(); f++) {
+                if(!visible[f])
+                    continue;
+                faces[f].alive = false;
+                // copied, addFace may reallocate
+                int v[3] = {faces[f].vertex[0], faces[f].vertex[1], faces[f].vertex[2]};
+                for(int k = 0; k < 3; k++) {
+                    int from = v[k], to = v[(k+1)%3];
+                    if(edges.find(std::make_pair(to, from)) == edges.end())
+                        addFace(faces, from, to, p);
+                }
+            }
+        }
+
+        for(size_t f = 0; f < faces.size(); f++) {
+            if(!faces[f].alive)
+                continue;
+            Triangle tri;
+            for(int k = 0; k < 3; k++) {
+                tri.vertex[k] = faces[f].vertex[k];
+                tri.neighbour[k] = -1;
+            }
+            computeInverse(tri);
+            m_pTriangles.push_back(tri);
+        }
+    }
+
+    void connectTriangles() {
+        std::map<std::pair<int, int>, int> owner;
+        for(int t = 0; t < triangles(); t++) {
+            const int* v = m_pTriangles[t].vertex;
+            for(int k = 0; k < 3; k++)
+                owner[std::make_pair(v[k], v[(k+1)%3])] = t;
+        }
+        for(int t = 0; t < triangles(); t++) {
+            Triangle& tri = m_pTriangles[t];
+            for(int k = 0; k < 3; k++) {
+                // the edge opposite vertex k, seen from the other side
+                int from = tri.vertex[(k+1)%3], to = tri.vertex[(k+2)%3];
+                std::map<std::pair<int, int>, int>::const_iterator it = owner.find(std::make_pair(to, from));
+                tri.neighbour[k] = it == owner.end() ? t : it->second;
+            }
+        }
+    }
+
+    void buildLookup() {
+        m_pLookup.assign(GRID_LOOKUP_AZIMUTHS * GRID_LOOKUP_ELEVATIONS, 0);
+        for(int e = 0; e < GRID_LOOKUP_ELEVATIONS; e++) {
+            for(int a = 0; a < GRID_LOOKUP_AZIMUTHS; a++) {
+                float azimuth = (a + 0.5f) * 360.0f / GRID_LOOKUP_AZIMUTHS;
+                float elevation = (e + 0.5f) * 180.0f / GRID_LOOKUP_ELEVATIONS - 90.0f;
+                float p[3];
+                directionToVector(azimuth, elevation, p);
+                int best = 0;
+                float bestMin = -1e9f;
+                for(int t = 0; t < triangles(); t++) {
+                    float g[3];
+                    gains(m_pTriangles[t], p, g);
+                    float smallest = std::min(g[0], std::min(g[1], g[2]));
+                    if(smallest > bestMin) {
+                        bestMin = smallest;
+                        best = t;
+                    }
+                }
+                m_pLookup[e * GRID_LOOKUP_AZIMUTHS + a] = best;
+            }
+        }
+    }
+
+    void findPhantomNeighbours() {
+        int numPhantoms = (int)m_pVectors.size() / 3 - m_nPoints;
+        m_pPhantomNeighbours.assign(numPhantoms, std::vector<int>());
+        for(int t = 0; t < triangles(); t++) {
+            const int* v = m_pTriangles[t].vertex;
+            for(int k = 0; k < 3; k++) {
+                if(!isPhantom(v[k]))
+                    continue;
+                std::vector<int>& ring = m_pPhantomNeighbours[v[k] - m_nPoints];
+                for(int o = 0; o < 3; o++) {
+                    if(!isPhantom(v[o]) && std::find(ring.begin(), ring.end(), v[o]) == ring.end())
+                        ring.push_back(v[o]);
+                }
+            }
+        }
+    }
+
+    int lookupCell(float azimuth, float elevation) const {
+        float wrapped = fmodf(azimuth, 360.0f);
+        if(wrapped < 0.0f)
+            wrapped += 360.0f;
+        int a = std::min((int)(wrapped * GRID_LOOKUP_AZIMUTHS / 360.0f), GRID_LOOKUP_AZIMUTHS - 1);
+        int e = (int)((elevation + 90.0f) * GRID_LOOKUP_ELEVATIONS / 180.0f);
+        e = std::min(std::max(e, 0), GRID_LOOKUP_ELEVATIONS - 1);
+        return e * GRID_LOOKUP_AZIMUTHS + a;
+    }
+
+    // Inverse of the matrix with the triangle's corners as columns
+    void computeInverse(Triangle& tri) const {
+        const float* a = &m_pVectors[3*tri.vertex[0]];
+        const float* b = &m_pVectors[3*tri.vertex[1]];
+        const float* c = &m_pVectors[3*tri.vertex[2]];
+        cross(b, c, tri.inverse[0]);
+        cross(c, a, tri.inverse[1]);
+        cross(a, b, tri.inverse[2]);
+        float det = a[0]*tri.inverse[0][0] + a[1]*tri.inverse[0][1] + a[2]*tri.inverse[0][2];
+        float inv = fabsf(det) > 1e-12f ? 1.0f / det : 0.0f;
+        for(int r = 0; r < 3; r++)
+            for(int col = 0; col < 3; col++)
+                tri.inverse[r][col] *= inv;
+    }
+
+    static void gains(const Triangle& tri, const float* p, float* g) {
+        for(int k = 0; k < 3; k++)
+            g[k] = tri.inverse[k][0]*p[0] + tri.inverse[k][1]*p[1] + tri.inverse[k][2]*p[2];
+    }
+
+    struct Face {
+        int vertex[3];
+        bool alive;
+    };
+
+    static void addFace(std::vector<Face>& faces, int a, int b, int c) {
+        Face face = {{a, b, c}, true};
+        faces.push_back(face);
+    }
+
+    template <typename T>
+    static void cross(const T* a, const T* b, T* out) {
+        out[0] = a[1]*b[2] - a[2]*b[1];
+        out[1] = a[2]*b[0] - a[0]*b[2];
+        out[2] = a[0]*b[1] - a[1]*b[0];
+    }
+
+    template <typename T>
+    static void triangleNormal(const T* a, const T* b, const T* c, T* n) {
+        T ab[3] = {b[0]-a[0], b[1]-a[1], b[2]-a[2]};
+        T ac[3] = {c[0]-a[0], c[1]-a[1], c[2]-a[2]};
+        cross(ab, ac, n);
+    }
+
+    // Signed distance (unnormalised) of p above the plane of the counter-clockwise triangle abc
+    template <typename T>
+    static T planeDistance(const T* a, const T* b, const T* c, const T* p) {
+        T n[3];
+        triangleNormal(a, b, c, n);
+        return n[0]*(p[0]-a[0]) + n[1]*(p[1]-a[1]) + n[2]*(p[2]-a[2]);
+    }
+
+    template <typename T>
+    static T squaredDistance(const T* a, const T* b) {
+        T dx = a[0]-b[0], dy = a[1]-b[1], dz = a[2]-b[2];
+        return dx*dx + dy*dy + dz*dz;
+    }
+
+    static void directionToVector(float azimuth, float elevation, float* v) {
+        float az = degreesToRadians(azimuth);
+        float el = degreesToRadians(elevation);
+        v[0] = cosf(el)*cosf(az);
+        v[1] = cosf(el)*sinf(az);
+        v[2] = sinf(el);
+    }
+
+    int m_nPoints;
+    // unit vectors, real points then phantom poles
+    std::vector<float> m_pVectors;
+    std::vector<Triangle> m_pTriangles;
+    std::vector<int> m_pLookup;
+    std::vector<std::vector<int> > m_pPhantomNeighbours;
+};
+
+#endif /* SphericalGrid_hpp */
@@ -0,0 +1,60 @@
+//
+//  SphericalHarmonics.hpp
+//  Capstone
+//
+
+#ifndef SphericalHarmonics_hpp
+#define SphericalHarmonics_hpp
+
+#include "HRIRGrid.hpp"
+#include <algorithm>
+#include <cmath>
+
+#define MAX_AMBISONIC_ORDER 5
+#define MAX_AMBISONIC_CHANNELS ((MAX_AMBISONIC_ORDER + 1) * (MAX_AMBISONIC_ORDER + 1))
+
+static inline int ambisonicChannelCount(int order) {
+    return (order + 1) * (order + 1);
+}
+
+/*
+	Real spherical harmonics up to the given order in ACN channel order with N3D normalisation
+	(no Condon-Shortley phase). Angles are in degrees, see HRIRGrid for the convention.
+ */
+static inline void evaluateSphericalHarmonics(int order, float azimuth, float elevation, float* pCoeffs) {
+    double az = degreesToRadians(azimuth);
+    double x = sin((double)degreesToRadians(elevation));
+    double cosEl = sqrt(std::max(0.0, 1.0 - x*x));
+
+    // Associated Legendre functions P_n^m(x), filled column by column in m
+    double legendre[MAX_AMBISONIC_ORDER + 1][MAX_AMBISONIC_ORDER + 1];
+    double pmm = 1.0;
+    for(int m = 0; m <= order; m++) {
+        if(m > 0)
+            pmm *= (2*m - 1) * cosEl;
+        legendre[m][m] = pmm;
+        if(m < order)
+            legendre[m+1][m] = x * (2*m + 1) * pmm;
+        for(int n = m + 2; n <= order; n++)
+            legendre[n][m] = ((2*n - 1) * x * legendre[n-1][m] - (n + m - 1) * legendre[n-2][m]) / (n - m);
+    }
+
+    for(int n = 0; n <= order; n++) {
+        for(int m = -n; m <= n; m++) {
+            int absM = m < 0 ? -m : m;
+            // (n-|m|)! / (n+|m|)!
+            double factorialRatio = 1.0;
+            for(int k = n - absM + 1; k <= n + absM; k++)
+                factorialRatio /= k;
+            double norm = sqrt((2*n + 1) * (absM == 0 ? 1.0 : 2.0) * factorialRatio);
+            double trig = (m < 0) ? sin(absM * az) : cos(absM * az);
+            pCoeffs[n*n + n + m] = float(norm * legendre[n][absM] * trig);
+        }
+    }
+}
+
+static inline int clampAmbisonicOrder(int order) {
+    return std::min(std::max(order, 1), MAX_AMBISONIC_ORDER);
+}
+
+#endif /* SphericalHarmonics_hpp */
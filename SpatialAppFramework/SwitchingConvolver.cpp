@@ -0,0 +1,529 @@
+//
+//  SwitchingConvolver.cpp
+//  Capstone
+//
+
+#include "SwitchingConvolver.hpp"
+
+#include <cassert>
+#include <cmath>
+
+
+namespace fftconvolver
+{
+
+// Peak level below which an input block counts as silent (about -140 dBFS)
+static const Sample SilenceThreshold = 0.0000001f;
+
+
+static Sample Peak(const Sample* data, size_t len)
+{
+  Sample peak = 0;
+  for (size_t i=0; i<len; ++i)
+  {
+    peak = std::max(peak, static_cast<Sample>(::fabs(data[i])));
+  }
+  return peak;
+}
+
+
+PartitionedIR::PartitionedIR() :
+  _blockSize(0),
+  _segCount(0),
+  _precision(SpectrumFloat32),
+  _segments(),
+  _compactSegments()
+{
+}
+
+
+PartitionedIR::~PartitionedIR()
+{
+  clear();
+}
+
+
+void PartitionedIR::clear()
+{
+  for (size_t i=0; i<_segments.size(); ++i)
+  {
+    delete _segments[i];
+  }
+  _segments.clear();
+  for (size_t i=0; i<_compactSegments.size(); ++i)
+  {
+    delete _compactSegments[i];
+  }
+  _compactSegments.clear();
+  _blockSize = 0;
+  _segCount = 0;
+  _precision = SpectrumFloat32;
+}
+
+
+bool PartitionedIR::init(size_t blockSize, const Sample* ir, size_t irLen, SpectrumPrecision precision)
+{
+  clear();
+
+  if (blockSize == 0 || irLen == 0)
+  {
+    return false;
+  }
+
+  allocate(NextPowerOf2(blockSize), (irLen + NextPowerOf2(blockSize) - 1) / NextPowerOf2(blockSize));
+
+  audiofft::AudioFFT fft;
+  fft.init(2 * _blockSize);
+  SampleBuffer fftBuffer(2 * _blockSize);
+  partition(fft, fftBuffer, ir, irLen);
+
+  if (precision != SpectrumFloat32)
+  {
+    // Transformed in float, then only the rounded copies are kept
+    for (size_t i=0; i<_segCount; ++i)
+    {
+      _compactSegments.push_back(new CompactSplitComplex());
+      _compactSegments.back()->assign(*_segments[i], precision);
+    }
+    for (size_t i=0; i<_segments.size(); ++i)
+    {
+      delete _segments[i];
+    }
+    _segments.clear();
+    _precision = precision;
+  }
+  return true;
+}
+
+
+void PartitionedIR::allocate(size_t blockSize, size_t maxSegments)
+{
+  clear();
+  _blockSize = blockSize;
+  const size_t complexSize = audiofft::AudioFFT::ComplexSize(2 * _blockSize);
+  for (size_t i=0; i<maxSegments; ++i)
+  {
+    _segments.push_back(new SplitComplex(complexSize));
+  }
+}
+
+
+void PartitionedIR::partition(audiofft::AudioFFT& fft, SampleBuffer& fftBuffer, const Sample* ir, size_t irLen)
+{
+  irLen = std::min(irLen, _segments.size() * _blockSize);
+
+  // Ignore zeros at the end of the impulse response because they only waste computation time
+  while (irLen > 0 && ::fabs(ir[irLen-1]) < 0.000001f)
+  {
+    --irLen;
+  }
+
+  _segCount = (irLen + _blockSize - 1) / _blockSize;
+  for (size_t i=0; i<_segCount; ++i)
+  {
+    const size_t remaining = irLen - (i * _blockSize);
+    const size_t sizeCopy = (remaining >= _blockSize) ? _blockSize : remaining;
+    CopyAndPad(fftBuffer, &ir[i*_blockSize], sizeCopy);
+    fft.fft(fftBuffer.data(), _segments[i]->re(), _segments[i]->im());
+  }
+}
+
+// ===================================================
+
+
+SwitchingConvolver::SwitchingConvolver() :
+  _blockSize(0),
+  _segSize(0),
+  _segCount(0),
+  _fftComplexSize(0),
+  _segments(),
+  _active(0),
+  _switching(false),
+  _crossfade(true),
+  _pendingIR(0),
+  _pendingPartitioned(0),
+  _pendingIRLen(0),
+  _fftBuffer(),
+  _fft(),
+  _conv(),
+  _convPrevious(),
+  _current(0),
+  _inputBuffer(),
+  _inputBufferFill(0),
+  _blockPeak(0),
+  _silentBlocks(0),
+  _idle(false)
+{
+  _slotIR[0] = 0;
+  _slotIR[1] = 0;
+  _segCountIR[0] = 0;
+  _segCountIR[1] = 0;
+}
+
+
+SwitchingConvolver::~SwitchingConvolver()
+{
+  reset();
+}
+
+
+void SwitchingConvolver::reset()
+{
+  for (size_t i=0; i<_segCount; ++i)
+  {
+    delete _segments[i];
+  }
+
+  _blockSize = 0;
+  _segSize = 0;
+  _segCount = 0;
+  _fftComplexSize = 0;
+  _segments.clear();
+  _ownedIR[0].clear();
+  _ownedIR[1].clear();
+  _slotIR[0] = 0;
+  _slotIR[1] = 0;
+  _segCountIR[0] = 0;
+  _segCountIR[1] = 0;
+  _active = 0;
+  _switching = false;
+  _pendingIR = 0;
+  _pendingPartitioned = 0;
+  _pendingIRLen = 0;
+  _fftBuffer.clear();
+  _fft.init(0);
+  _preMultiplied[0].clear();
+  _preMultiplied[1].clear();
+  _conv.clear();
+  _convPrevious.clear();
+  _current = 0;
+  _inputBuffer.clear();
+  _inputBufferFill = 0;
+  _blockPeak = 0;
+  _silentBlocks = 0;
+  _idle = false;
+}
+
+
+bool SwitchingConvolver::init(size_t blockSize, const Sample* ir, size_t irLen)
+{
+  if (!initBuffers(blockSize, irLen))
+  {
+    return false;
+  }
+
+  // Room for two impulse responses of the full length
+  _ownedIR[0].allocate(_blockSize, _segCount);
+  _ownedIR[1].allocate(_blockSize, _segCount);
+  setSlot(_active, ir, irLen);
+
+  return true;
+}
+
+
+bool SwitchingConvolver::init(size_t blockSize, const PartitionedIR& ir, size_t irLen)
+{
+  assert(ir.blockSize() == NextPowerOf2(blockSize));
+  if (!initBuffers(blockSize, irLen))
+  {
+    return false;
+  }
+
+  setSlot(_active, ir, irLen);
+
+  return true;
+}
+
+
+bool SwitchingConvolver::initBuffers(size_t blockSize, size_t irLen)
+{
+  reset();
+
+  if (blockSize == 0 || irLen == 0)
+  {
+    return false;
+  }
+
+  _blockSize = NextPowerOf2(blockSize);
+  _segSize = 2 * _blockSize;
+  _segCount = static_cast<size_t>(::ceil(static_cast<float>(irLen) / static_cast<float>(_blockSize)));
+  _fftComplexSize = audiofft::AudioFFT::ComplexSize(_segSize);
+
+  // FFT
+  _fft.init(_segSize);
+  _fftBuffer.resize(_segSize);
+
+  // Input spectra ring, shared by both slots
+  for (size_t i=0; i<_segCount; ++i)
+  {
+    _segments.push_back(new SplitComplex(_fftComplexSize));
+  }
+
+  // Prepare convolution buffers
+  _preMultiplied[0].resize(_fftComplexSize);
+  _preMultiplied[1].resize(_fftComplexSize);
+  _conv.resize(_fftComplexSize);
+  _convPrevious.resize(_fftComplexSize);
+
+  // Previous block followed by the one being filled
+  _inputBuffer.resize(_segSize);
+  _inputBufferFill = 0;
+
+  _current = 0;
+  _active = 0;
+
+  return true;
+}
+
+
+void SwitchingConvolver::switchTo(const Sample* ir, size_t irLen)
+{
+  // Nowhere to transform it to when the impulse responses are only referenced
+  assert(!_ownedIR[0]._segments.empty());
+  if (_ownedIR[0]._segments.empty())
+  {
+    return;
+  }
+  _pendingIR = ir;
+  _pendingPartitioned = 0;
+  _pendingIRLen = irLen;
+}
+
+
+void SwitchingConvolver::switchTo(const PartitionedIR& ir, size_t irLen)
+{
+  assert(ir.blockSize() == _blockSize);
+  _pendingIR = 0;
+  _pendingPartitioned = &ir;
+  _pendingIRLen = irLen;
+}
+
+
+void SwitchingConvolver::setSlot(size_t slot, const Sample* ir, size_t irLen)
+{
+  _ownedIR[slot].partition(_fft, _fftBuffer, ir, irLen);
+  _slotIR[slot] = &_ownedIR[slot];
+  _segCountIR[slot] = _ownedIR[slot].segmentCount();
+}
+
+
+void SwitchingConvolver::setSlot(size_t slot, const PartitionedIR& ir, size_t irLen)
+{
+  // A shorter irLen just leaves out the last segments
+  const size_t segments = (irLen + _blockSize - 1) / _blockSize;
+  _slotIR[slot] = &ir;
+  _segCountIR[slot] = std::min(std::min(segments, ir.segmentCount()), _segCount);
+}
+
+
+void SwitchingConvolver::multiplyAccumulate(SplitComplex& result, size_t slot, size_t firstSegment)
+{
+  for (size_t i=firstSegment; i<_segCountIR[slot]; ++i)
+  {
+    const size_t indexAudio = (_current + i) % _segCount;
+    _slotIR[slot]->multiplyAccumulate(result, i, *_segments[indexAudio]);
+  }
+}
+
+
+void SwitchingConvolver::crossfade(SplitComplex& result, const SplitComplex& previous)
+{
+  // The output half of the frame gets previous*w + result*(1-w) with
+  // w[n] = 0.5 - 0.5*cos(2*pi*n/segSize), which falls from 1 to 0 over that half.
+  // As a spectrum w is 0.5 at bin 0 and -0.25 at bins +-1, so with D = previous - result
+  // the correction is C[k] = 0.5*D[k] - 0.25*(D[k-1] + D[k+1]).
+  // Only bins 0..segSize/2 are stored; the ones beyond mirror as complex conjugates.
+  Sample* re = result.re();
+  Sample* im = result.im();
+  const Sample* pre = previous.re();
+  const Sample* pim = previous.im();
+  const size_t last = _fftComplexSize - 1;
+
+  Sample dRe0 = pre[1] - re[1];
+  Sample dIm0 = -(pim[1] - im[1]);
+  Sample dRe1 = pre[0] - re[0];
+  Sample dIm1 = pim[0] - im[0];
+  for (size_t k=0; k<=last; ++k)
+  {
+    Sample dRe2, dIm2;
+    if (k < last)
+    {
+      dRe2 = pre[k+1] - re[k+1];
+      dIm2 = pim[k+1] - im[k+1];
+    }
+    else
+    {
+      // bin k-1 has already been corrected, its original difference is dRe0/dIm0
+      dRe2 = dRe0;
+      dIm2 = -dIm0;
+    }
+    re[k] += 0.5f * dRe1 - 0.25f * (dRe0 + dRe2);
+    im[k] += 0.5f * dIm1 - 0.25f * (dIm0 + dIm2);
+    dRe0 = dRe1;
+    dIm0 = dIm1;
+    dRe1 = dRe2;
+    dIm1 = dIm2;
+  }
+}
+
+
+void SwitchingConvolver::process(const Sample* input, Sample* output, size_t len)
+{
+  if (_segCount == 0)
+  {
+    ::memset(output, 0, len * sizeof(Sample));
+    return;
+  }
+
+  size_t processed = 0;
+  while (processed < len)
+  {
+    const bool inputBufferWasEmpty = (_inputBufferFill == 0);
+
+    // Filter switches only happen on block boundaries, so a block never mixes two filters
+    if (inputBufferWasEmpty)
+    {
+      _switching = false;
+      if (_pendingIR || _pendingPartitioned)
+      {
+        _active = 1 - _active;
+        if (_pendingPartitioned)
+        {
+          setSlot(_active, *_pendingPartitioned, _pendingIRLen);
+        }
+        else
+        {
+          setSlot(_active, _pendingIR, _pendingIRLen);
+        }
+        _pendingIR = 0;
+        _pendingPartitioned = 0;
+        // nothing to fade from while idle
+        _switching = _crossfade && !_idle;
+      }
+    }
+
+    const size_t processing = std::min(len-processed, _blockSize-_inputBufferFill);
+    const size_t inputBufferPos = _inputBufferFill;
+    ::memcpy(_inputBuffer.data()+_blockSize+inputBufferPos, input+processed, processing * sizeof(Sample));
+
+    const Sample peak = Peak(input+processed, processing);
+    _blockPeak = std::max(_blockPeak, peak);
+
+    if (_idle && peak < SilenceThreshold)
+    {
+      // Silent input and the tail has died away, the output is silent as well
+      ::memset(output+processed, 0, processing * sizeof(Sample));
+    }
+    else
+    {
+      if (_idle)
+      {
+        wake();
+      }
+
+      // Forward FFT of the previous and the current (zero padded) block
+      _fft.fft(_inputBuffer.data(), _segments[_current]->re(), _segments[_current]->im());
+
+      // Complex multiplication, older segments only change once per block
+      const size_t previous = 1 - _active;
+      if (inputBufferWasEmpty)
+      {
+        _preMultiplied[_active].setZero();
+        multiplyAccumulate(_preMultiplied[_active], _active, 1);
+        if (_switching)
+        {
+          _preMultiplied[previous].setZero();
+          multiplyAccumulate(_preMultiplied[previous], previous, 1);
+        }
+      }
+
+      _conv.copyFrom(_preMultiplied[_active]);
+      if (_segCountIR[_active] > 0)
+      {
+        _slotIR[_active]->multiplyAccumulate(_conv, 0, *_segments[_current]);
+      }
+      if (_switching)
+      {
+        _convPrevious.copyFrom(_preMultiplied[previous]);
+        if (_segCountIR[previous] > 0)
+        {
+          _slotIR[previous]->multiplyAccumulate(_convPrevious, 0, *_segments[_current]);
+        }
+        crossfade(_conv, _convPrevious);
+      }
+
+      // Backward FFT, the second half is free of circular wrap-around
+      _fft.ifft(_fftBuffer.data(), _conv.re(), _conv.im());
+      ::memcpy(output+processed, _fftBuffer.data()+_blockSize+inputBufferPos, processing * sizeof(Sample));
+    }
+
+    // Input buffer full => Next block
+    _inputBufferFill += processing;
+    if (_inputBufferFill == _blockSize)
+    {
+      // The block just finished becomes the first half of the next frame
+      ::memcpy(_inputBuffer.data(), _inputBuffer.data()+_blockSize, _blockSize * sizeof(Sample));
+      ::memset(_inputBuffer.data()+_blockSize, 0, _blockSize * sizeof(Sample));
+      _inputBufferFill = 0;
+
+      // Update current segment
+      _current = (_current > 0) ? (_current - 1) : (_segCount - 1);
+
+      // Every frame spans two blocks, so the last non-silent block leaves the
+      // history after _segCount + 1 silent ones
+      _silentBlocks = (_blockPeak < SilenceThreshold) ? (_silentBlocks + 1) : 0;
+      _blockPeak = 0;
+      if (_silentBlocks > _segCount)
+      {
+        _idle = true;
+      }
+    }
+
+    processed += processing;
+  }
+}
+
+
+bool SwitchingConvolver::isActive() const
+{
+  return (_segCount > 0) && !_idle;
+}
+
+
+void SwitchingConvolver::setCrossfade(bool crossfade)
+{
+  _crossfade = crossfade;
+}
+
+
+void SwitchingConvolver::silence()
+{
+  if (_segCount == 0)
+  {
+    return;
+  }
+  // The spectra ring is cleared by wake() once the input comes back
+  _inputBuffer.setZero();
+  _inputBufferFill = 0;
+  _blockPeak = 0;
+  _silentBlocks = _segCount + 1;
+  _switching = false;
+  _idle = true;
+}
+
+
+void SwitchingConvolver::wake()
+{
+  // Everything the ring held was silence, so start it from zero
+  for (size_t i=0; i<_segCount; ++i)
+  {
+    _segments[i]->setZero();
+  }
+  _preMultiplied[0].setZero();
+  _preMultiplied[1].setZero();
+  _switching = false;
+  _silentBlocks = 0;
+  _idle = false;
+}
+
+} // End of namespace fftconvolver
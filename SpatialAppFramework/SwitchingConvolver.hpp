@@ -0,0 +1,236 @@
+//
+//  SwitchingConvolver.hpp
+//  Capstone
+//
+
+#ifndef _FFTCONVOLVER_SWITCHINGCONVOLVER_H
+#define _FFTCONVOLVER_SWITCHINGCONVOLVER_H
+
+#include "AudioFFT.hpp"
+#include "Utilities.hpp"
+
+#include <cassert>
+#include <vector>
+
+
+namespace fftconvolver
+{
+
+/**
+* @class PartitionedIR
+* @brief Impulse response cut into block-sized segments and transformed once
+*
+* Read-only after init(), so one instance can be shared by any number of
+* SwitchingConvolvers (on any thread) that use the same block size.
+*
+* The segments can be stored as 16-bit floats, which halves their memory and
+* the memory traffic of the convolvers reading them; they are widened back to
+* float inside the multiply-accumulate.
+*/
+class PartitionedIR
+{
+public:
+  PartitionedIR();
+  virtual ~PartitionedIR();
+
+  /**
+  * @brief Partitions and transforms an impulse response (trailing zeros are dropped)
+  * @param blockSize Block size of the convolvers that will use it
+  * @param ir The impulse response
+  * @param irLen Length of the impulse response
+  * @param precision Format the segments are stored in
+  * @return true: Success - false: Failed
+  */
+  bool init(size_t blockSize, const Sample* ir, size_t irLen, SpectrumPrecision precision = SpectrumFloat32);
+
+  void clear();
+
+  size_t blockSize() const { return _blockSize; }
+  size_t segmentCount() const { return _segCount; }
+  SpectrumPrecision precision() const { return _precision; }
+
+  /**
+  * @brief A segment's spectrum, only for SpectrumFloat32 storage
+  */
+  const SplitComplex& segment(size_t index) const
+  {
+    assert(_precision == SpectrumFloat32);
+    return *_segments[index];
+  }
+
+  /**
+  * @brief Adds the product of a segment and a spectrum to result, in any storage format
+  */
+  void multiplyAccumulate(SplitComplex& result, size_t index, const SplitComplex& input) const
+  {
+    if (_precision == SpectrumFloat32)
+    {
+      ComplexMultiplyAccumulate(result, *_segments[index], input);
+    }
+    else
+    {
+      ComplexMultiplyAccumulate(result, *_compactSegments[index], input);
+    }
+  }
+
+private:
+  friend class SwitchingConvolver;
+
+  void allocate(size_t blockSize, size_t maxSegments);
+  void partition(audiofft::AudioFFT& fft, SampleBuffer& fftBuffer, const Sample* ir, size_t irLen);
+
+  size_t _blockSize;
+  size_t _segCount;
+  SpectrumPrecision _precision;
+  std::vector<SplitComplex*> _segments;
+  std::vector<CompactSplitComplex*> _compactSegments;
+
+  // Prevent uncontrolled usage
+  PartitionedIR(const PartitionedIR&);
+  PartitionedIR& operator=(const PartitionedIR&);
+};
+
+
+/**
+* @class SwitchingConvolver
+* @brief Uniformly partitioned convolver whose impulse response can be swapped while running
+*
+* - One ring of input spectra is shared by two impulse response slots. Switching
+*   filters only transforms the new impulse response into the idle slot and swaps
+*   the roles of the slots, so both the incoming and the outgoing filter see the
+*   full input history and neither starts cold.
+*
+* - Uses overlap-save, so the output of a block depends only on the input history
+*   and the filter, never on the filter used for the previous block.
+*
+* - The block in which a switch happens is crossfaded from the outgoing to the
+*   incoming filter with a raised-cosine window. The window is applied in the
+*   frequency domain: a raised cosine over the FFT frame has only three non-zero
+*   bins, so the fade costs one extra spectrum product plus a three-tap pass,
+*   and the block still needs only one inverse FFT.
+*
+* - Tracks the input level per block. Once the input has been silent for longer
+*   than the impulse response, the convolver goes idle and skips the FFTs until
+*   the input comes back; the output during that time is exactly silence.
+*
+* - Impulse responses are either handed over in the time domain and transformed
+*   into one of two slots the convolver owns, or given as a PartitionedIR that is
+*   only referenced. The second way needs no impulse response memory per
+*   convolver and switching costs no FFTs at all.
+*
+* - Like FFTConvolver it has no latency and does not allocate or lock after init().
+*/
+class SwitchingConvolver
+{
+public:
+  SwitchingConvolver();
+  virtual ~SwitchingConvolver();
+
+  /**
+  * @brief Initializes the convolver
+  * @param blockSize Block size internally used by the convolver (partition size)
+  * @param ir The initial impulse response
+  * @param irLen Length of the impulse response, also the longest one switchTo() will accept
+  * @return true: Success - false: Failed
+  */
+  bool init(size_t blockSize, const Sample* ir, size_t irLen);
+
+  /**
+  * @brief Initializes the convolver with an impulse response it only references
+  * @param blockSize Block size internally used by the convolver, has to match ir
+  * @param ir The initial impulse response, has to stay valid while it is in use
+  * @param irLen Longest impulse response (in samples) switchTo() will use
+  * @return true: Success - false: Failed
+  */
+  bool init(size_t blockSize, const PartitionedIR& ir, size_t irLen);
+
+  /**
+  * @brief Requests a new impulse response, taking effect at the start of the next block.
+  *        Only for convolvers set up with the time-domain init().
+  * @param ir The impulse response, has to stay valid until that block is processed
+  * @param irLen Length of the impulse response (longer ones are truncated)
+  */
+  void switchTo(const Sample* ir, size_t irLen);
+
+  /**
+  * @brief Requests a new, referenced impulse response, taking effect at the start of the next block
+  * @param ir The impulse response, has to stay valid while it is in use
+  * @param irLen Number of samples of it to use (longer ones are truncated)
+  */
+  void switchTo(const PartitionedIR& ir, size_t irLen);
+
+  /**
+  * @brief Convolves the given input samples and immediately outputs the result
+  * @param input The input samples
+  * @param output The convolution result
+  * @param len Number of input/output samples
+  */
+  void process(const Sample* input, Sample* output, size_t len);
+
+  /**
+  * @brief Whether the convolver is still producing output (false once the input
+  *        has been silent for longer than the impulse response)
+  */
+  bool isActive() const;
+
+  /**
+  * @brief Enables or disables the crossfade on filter switches (enabled by default).
+  *        Without it a switch is a hard cut at the block boundary, which saves one
+  *        pass over the outgoing filter's segments.
+  */
+  void setCrossfade(bool crossfade);
+
+  /**
+  * @brief Forgets the input history, as if the input had been silent for longer
+  *        than the impulse response. For callers that stop feeding the convolver
+  *        for a while and do not want the stale tail when they resume.
+  */
+  void silence();
+
+  /**
+  * @brief Resets the convolver and discards the set impulse responses
+  */
+  void reset();
+
+private:
+  bool initBuffers(size_t blockSize, size_t irLen);
+  void setSlot(size_t slot, const Sample* ir, size_t irLen);
+  void setSlot(size_t slot, const PartitionedIR& ir, size_t irLen);
+  void multiplyAccumulate(SplitComplex& result, size_t slot, size_t firstSegment);
+  void crossfade(SplitComplex& result, const SplitComplex& previous);
+  void wake();
+
+  size_t _blockSize;
+  size_t _segSize;
+  size_t _segCount;
+  size_t _fftComplexSize;
+  std::vector<SplitComplex*> _segments;
+  PartitionedIR _ownedIR[2];
+  const PartitionedIR* _slotIR[2];
+  size_t _segCountIR[2];
+  size_t _active;
+  bool _switching;
+  bool _crossfade;
+  const Sample* _pendingIR;
+  const PartitionedIR* _pendingPartitioned;
+  size_t _pendingIRLen;
+  SampleBuffer _fftBuffer;
+  audiofft::AudioFFT _fft;
+  SplitComplex _preMultiplied[2];
+  SplitComplex _conv;
+  SplitComplex _convPrevious;
+  size_t _current;
+  SampleBuffer _inputBuffer;
+  size_t _inputBufferFill;
+  Sample _blockPeak;
+  size_t _silentBlocks;
+  bool _idle;
+
+  // Prevent uncontrolled usage
+  SwitchingConvolver(const SwitchingConvolver&);
+  SwitchingConvolver& operator=(const SwitchingConvolver&);
+};
+
+} // End of namespace fftconvolver
+
+#endif // Header guard
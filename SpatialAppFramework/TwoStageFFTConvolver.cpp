@@ -0,0 +1,226 @@
+// ==================================================================================
+// Copyright (c) 2012 HiFi-LoFi
+//
+// This is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+// ==================================================================================
+
+#include "TwoStageFFTConvolver.hpp"
+
+#include <algorithm>
+
+
+namespace fftconvolver
+{
+
+TwoStageFFTConvolver::TwoStageFFTConvolver() :
+  _headBlockSize(0),
+  _tailBlockSize(0),
+  _headConvolver(),
+  _tailConvolver(),
+  _tailSegCount(0),
+  _tailPrecalculated(),
+  _tailInput(),
+  _tailInputFill(0),
+  _precalculatedPos(0),
+  _jobPending(false),
+  _jobsSubmitted(0),
+  _jobsCompleted(0),
+  _flushing(false),
+  _deadlineMisses(0)
+{
+}
+
+
+TwoStageFFTConvolver::~TwoStageFFTConvolver()
+{
+  reset();
+}
+
+
+void TwoStageFFTConvolver::reset()
+{
+  _headBlockSize = 0;
+  _tailBlockSize = 0;
+  _headConvolver.reset();
+  _tailConvolver.reset();
+  _tailSegCount = 0;
+  _tailPrecalculated.clear();
+  _tailInput.clear();
+  _tailInputFill = 0;
+  _precalculatedPos = 0;
+  for (size_t i=0; i<JobSlots; ++i)
+  {
+    _jobInput[i].clear();
+    _jobOutput[i].clear();
+  }
+  _jobPending = false;
+  _jobsSubmitted = 0;
+  _jobsCompleted = 0;
+  _flushing = false;
+  _deadlineMisses = 0;
+}
+
+
+bool TwoStageFFTConvolver::init(size_t headBlockSize, size_t tailBlockSize, const Sample* ir, size_t irLen)
+{
+  reset();
+
+  if (headBlockSize == 0 || tailBlockSize == 0)
+  {
+    return false;
+  }
+
+  _headBlockSize = NextPowerOf2(headBlockSize);
+  _tailBlockSize = std::max(NextPowerOf2(tailBlockSize), _headBlockSize);
+
+  const size_t headIrLen = std::min(irLen, 2 * _tailBlockSize);
+  _headConvolver.init(_headBlockSize, ir, headIrLen);
+
+  if (irLen > 2 * _tailBlockSize)
+  {
+    const size_t tailIrLen = irLen - (2 * _tailBlockSize);
+    _tailConvolver.init(_tailBlockSize, ir + (2 * _tailBlockSize), tailIrLen);
+    _tailSegCount = (tailIrLen + _tailBlockSize - 1) / _tailBlockSize;
+    _tailPrecalculated.resize(_tailBlockSize);
+    _tailInput.resize(_tailBlockSize);
+    for (size_t i=0; i<JobSlots; ++i)
+    {
+      _jobInput[i].resize(_tailBlockSize);
+      _jobOutput[i].resize(_tailBlockSize);
+    }
+  }
+  _tailInputFill = 0;
+  _precalculatedPos = 0;
+
+  return true;
+}
+
+
+void TwoStageFFTConvolver::process(const Sample* input, Sample* output, size_t len)
+{
+  // Head
+  _headConvolver.process(input, output, len);
+
+  // Tail
+  if (_tailInput.size() == 0)
+  {
+    return;
+  }
+
+  size_t processed = 0;
+  while (processed < len)
+  {
+    const size_t processing = std::min(len - processed, _tailBlockSize - _tailInputFill);
+
+    // Sum: the tail block computed in the background
+    const Sample* precalculated = _tailPrecalculated.data() + _precalculatedPos;
+    for (size_t i=0; i<processing; ++i)
+    {
+      output[processed+i] += precalculated[i];
+    }
+    _precalculatedPos += processing;
+
+    // Fill input buffer for tail convolution
+    ::memcpy(_tailInput.data()+_tailInputFill, input+processed, processing * sizeof(Sample));
+    _tailInputFill += processing;
+
+    if (_tailInputFill == _tailBlockSize)
+    {
+      submitTailBlock();
+      _tailInputFill = 0;
+      _precalculatedPos = 0;
+    }
+
+    processed += processing;
+  }
+}
+
+
+// At a tail block boundary: picks up the job submitted at the last one and queues the next
+void TwoStageFFTConvolver::submitTailBlock()
+{
+  const size_t submitted = _jobsSubmitted.load(std::memory_order_relaxed);
+  const size_t completed = _jobsCompleted.load(std::memory_order_acquire);
+
+  if (_jobPending && completed == submitted)
+  {
+    _tailPrecalculated.copyFrom(_jobOutput[(submitted - 1) % JobSlots]);
+  }
+  else
+  {
+    _tailPrecalculated.setZero();
+    if (_jobPending)
+    {
+      _deadlineMisses.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+  _jobPending = false;
+
+  if (_flushing.load(std::memory_order_acquire))
+  {
+    return;
+  }
+
+  // The slot is free unless the background is a whole ring behind
+  if (submitted - completed >= JobSlots)
+  {
+    _flushing.store(true, std::memory_order_release);
+    return;
+  }
+  _jobInput[submitted % JobSlots].copyFrom(_tailInput);
+  _jobsSubmitted.store(submitted + 1, std::memory_order_release);
+  _jobPending = true;
+}
+
+
+bool TwoStageFFTConvolver::processBackground()
+{
+  const size_t submitted = _jobsSubmitted.load(std::memory_order_acquire);
+  size_t completed = _jobsCompleted.load(std::memory_order_relaxed);
+
+  if (completed != submitted)
+  {
+    while (completed != submitted)
+    {
+      const size_t slot = completed % JobSlots;
+      _tailConvolver.process(_jobInput[slot].data(), _jobOutput[slot].data(), _tailBlockSize);
+      ++completed;
+      _jobsCompleted.store(completed, std::memory_order_release);
+    }
+    return true;
+  }
+
+  if (_flushing.load(std::memory_order_acquire))
+  {
+    // Nothing is queued while flushing, so any slot will do: silence through every
+    // segment clears the tail's history and overlap
+    _jobInput[0].setZero();
+    for (size_t i=0; i<_tailSegCount; ++i)
+    {
+      _tailConvolver.process(_jobInput[0].data(), _jobOutput[0].data(), _tailBlockSize);
+    }
+    _flushing.store(false, std::memory_order_release);
+    return true;
+  }
+
+  return false;
+}
+
+
+size_t TwoStageFFTConvolver::deadlineMisses() const
+{
+  return _deadlineMisses.load(std::memory_order_relaxed);
+}
+
+} // End of namespace fftconvolver
@@ -0,0 +1,124 @@
+// ==================================================================================
+// Copyright (c) 2012 HiFi-LoFi
+//
+// This is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+// ==================================================================================
+
+#ifndef _FFTCONVOLVER_TWOSTAGEFFTCONVOLVER_H
+#define _FFTCONVOLVER_TWOSTAGEFFTCONVOLVER_H
+
+#include "FFTConvolver.hpp"
+#include "Utilities.hpp"
+
+#include <atomic>
+
+
+namespace fftconvolver
+{
+
+/**
+* @class TwoStageFFTConvolver
+* @brief FFT convolver for long impulse responses, with the tail computed in the background
+*
+* The impulse response is split into two parts:
+*
+* - Head, the first two tail blocks: uniformly partitioned with the head block
+*   size, convolved in process() without latency.
+*
+* - Tail, the rest: partitioned with the tail block size. Every time a tail block
+*   of input is complete, process() queues it for processBackground(), which is
+*   meant to run on another thread. Its result is needed two tail blocks after
+*   the input started, i.e. from the next tail block boundary on, so each job has
+*   a deadline of one tail block.
+*
+* The two threads only share atomics and a small ring of job buffers, neither
+* ever waits for the other. A job that misses its deadline is still run (so the
+* tail's history stays intact) but its result is dropped and that tail block is
+* silent; see deadlineMisses(). If the background falls a whole ring behind, the
+* tail is flushed and restarts from silence.
+*
+* init() and reset() must not run concurrently with process() or processBackground().
+*/
+class TwoStageFFTConvolver
+{
+public:
+  TwoStageFFTConvolver();
+  virtual ~TwoStageFFTConvolver();
+
+  /**
+  * @brief Initializes the convolver
+  * @param headBlockSize The head block size, best the block size process() is called with
+  * @param tailBlockSize The tail block size, rounded up to a multiple of the head block size
+  * @param ir The impulse response
+  * @param irLen Length of the impulse response
+  * @return true: Success - false: Failed
+  */
+  bool init(size_t headBlockSize, size_t tailBlockSize, const Sample* ir, size_t irLen);
+
+  /**
+  * @brief Convolves the the given input samples and immediately outputs the result
+  * @param input The input samples
+  * @param output The convolution result
+  * @param len Number of input/output samples
+  */
+  void process(const Sample* input, Sample* output, size_t len);
+
+  /**
+  * @brief Runs the tail jobs queued by process(), called from the background thread
+  * @return true if there was anything to do
+  */
+  bool processBackground();
+
+  /**
+  * @brief Number of tail blocks left silent because their job was late
+  */
+  size_t deadlineMisses() const;
+
+  /**
+  * @brief Resets the convolver and discards the set impulse response
+  */
+  void reset();
+
+private:
+  enum { JobSlots = 4 };
+
+  size_t _headBlockSize;
+  size_t _tailBlockSize;
+  FFTConvolver _headConvolver;
+  FFTConvolver _tailConvolver;
+  size_t _tailSegCount;
+  SampleBuffer _tailPrecalculated;
+  SampleBuffer _tailInput;
+  size_t _tailInputFill;
+  size_t _precalculatedPos;
+
+  // Jobs for the background, job n in slot n % JobSlots
+  SampleBuffer _jobInput[JobSlots];
+  SampleBuffer _jobOutput[JobSlots];
+  bool _jobPending;
+  std::atomic<size_t> _jobsSubmitted;
+  std::atomic<size_t> _jobsCompleted;
+  std::atomic<bool> _flushing;
+  std::atomic<size_t> _deadlineMisses;
+
+  void submitTailBlock();
+
+  // Prevent uncontrolled usage
+  TwoStageFFTConvolver(const TwoStageFFTConvolver&);
+  TwoStageFFTConvolver& operator=(const TwoStageFFTConvolver&);
+};
+
+} // End of namespace fftconvolver
+
+#endif // Header guard
@@ -17,6 +17,17 @@
 
 #include "Utilities.hpp"
 
+#if defined(FFTCONVOLVER_USE_SSE) && defined(__F16C__)
+  #include <immintrin.h>
+#elif defined(FFTCONVOLVER_USE_SSE) && defined(__SSE2__)
+  #include <emmintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+  #include <arm_neon.h>
+  #define FFTCONVOLVER_USE_NEON
+#endif
+
 
 namespace fftconvolver
 {
@@ -110,4 +121,290 @@ void ComplexMultiplyAccumulate(Sample* FFTCONVOLVER_RESTRICT re,
 #endif
 }
 
+// ===================================================
+
+
+static uint32_t FloatBits(float value)
+{
+  uint32_t bits;
+  ::memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+
+static float BitsToFloat(uint32_t bits)
+{
+  float value;
+  ::memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+
+// IEEE half, rounded to nearest even
+static uint16_t FloatToHalf(float value)
+{
+  const uint32_t bits = FloatBits(value);
+  const uint16_t sign = static_cast<uint16_t>((bits >> 16) & 0x8000);
+  const uint32_t magnitude = bits & 0x7fffffff;
+
+  if (magnitude >= 0x7f800000)
+  {
+    // Infinity or NaN
+    return sign | 0x7c00 | (magnitude > 0x7f800000 ? 0x200 : 0);
+  }
+  if (magnitude >= 0x477ff000)
+  {
+    // 65520 and up round to infinity
+    return sign | 0x7c00;
+  }
+  if (magnitude < 0x38800000)
+  {
+    // Below the smallest normal half: subnormal or zero
+    if (magnitude < 0x33000000)
+    {
+      return sign;
+    }
+    const uint32_t mantissa = (magnitude & 0x7fffff) | 0x800000;
+    const uint32_t shift = 126 - (magnitude >> 23);
+    uint32_t half = mantissa >> shift;
+    const uint32_t remainder = mantissa & ((1u << shift) - 1);
+    const uint32_t midpoint = 1u << (shift - 1);
+    if (remainder > midpoint || (remainder == midpoint && (half & 1)))
+    {
+      ++half;
+    }
+    return sign | static_cast<uint16_t>(half);
+  }
+
+  // Rebias the exponent; a carry out of the mantissa correctly bumps the exponent
+  uint32_t half = (magnitude - 0x38000000) >> 13;
+  const uint32_t remainder = magnitude & 0x1fff;
+  if (remainder > 0x1000 || (remainder == 0x1000 && (half & 1)))
+  {
+    ++half;
+  }
+  return sign | static_cast<uint16_t>(half);
+}
+
+
+static float HalfToFloat(uint16_t half)
+{
+  const uint32_t sign = static_cast<uint32_t>(half & 0x8000) << 16;
+  uint32_t exponent = (half >> 10) & 0x1f;
+  uint32_t mantissa = half & 0x3ff;
+
+  if (exponent == 0)
+  {
+    if (mantissa == 0)
+    {
+      return BitsToFloat(sign);
+    }
+    // Subnormal, normalize it
+    exponent = 113;
+    while (!(mantissa & 0x400))
+    {
+      mantissa <<= 1;
+      --exponent;
+    }
+    return BitsToFloat(sign | (exponent << 23) | ((mantissa & 0x3ff) << 13));
+  }
+  if (exponent == 31)
+  {
+    return BitsToFloat(sign | 0x7f800000 | (mantissa << 13));
+  }
+  return BitsToFloat(sign | ((exponent + 112) << 23) | (mantissa << 13));
+}
+
+
+// Upper half of a float, rounded to nearest even
+static uint16_t FloatToBFloat16(float value)
+{
+  const uint32_t bits = FloatBits(value);
+  if ((bits & 0x7fffffff) > 0x7f800000)
+  {
+    // Keep NaNs NaN
+    return static_cast<uint16_t>((bits >> 16) | 0x40);
+  }
+  return static_cast<uint16_t>((bits + 0x7fff + ((bits >> 16) & 1)) >> 16);
+}
+
+
+static float BFloat16ToFloat(uint16_t value)
+{
+  return BitsToFloat(static_cast<uint32_t>(value) << 16);
+}
+
+
+static uint16_t Compact(float value, SpectrumPrecision precision)
+{
+  return (precision == SpectrumBFloat16) ? FloatToBFloat16(value) : FloatToHalf(value);
+}
+
+
+static float Widen(uint16_t value, SpectrumPrecision precision)
+{
+  return (precision == SpectrumBFloat16) ? BFloat16ToFloat(value) : HalfToFloat(value);
+}
+
+
+void CompactSplitComplex::assign(const SplitComplex& spectrum, SpectrumPrecision precision)
+{
+  assert(precision != SpectrumFloat32);
+  _precision = precision;
+  _size = spectrum.size();
+  _re.resize(_size);
+  _im.resize(_size);
+  for (size_t i=0; i<_size; ++i)
+  {
+    _re[i] = Compact(spectrum.re()[i], precision);
+    _im[i] = Compact(spectrum.im()[i], precision);
+  }
+}
+
+
+static void ComplexMultiplyAccumulateHalf(Sample* FFTCONVOLVER_RESTRICT re,
+                                          Sample* FFTCONVOLVER_RESTRICT im,
+                                          const uint16_t* FFTCONVOLVER_RESTRICT reA,
+                                          const uint16_t* FFTCONVOLVER_RESTRICT imA,
+                                          const Sample* FFTCONVOLVER_RESTRICT reB,
+                                          const Sample* FFTCONVOLVER_RESTRICT imB,
+                                          const size_t len)
+{
+  size_t end4 = 0;
+#if defined(FFTCONVOLVER_USE_SSE) && defined(__F16C__)
+  end4 = 4 * (len / 4);
+  for (size_t i=0; i<end4; i+=4)
+  {
+    const __m128 ra = _mm_cvtph_ps(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(&reA[i])));
+    const __m128 ia = _mm_cvtph_ps(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(&imA[i])));
+    const __m128 rb = _mm_load_ps(&reB[i]);
+    const __m128 ib = _mm_load_ps(&imB[i]);
+    __m128 real = _mm_load_ps(&re[i]);
+    __m128 imag = _mm_load_ps(&im[i]);
+    real = _mm_add_ps(real, _mm_mul_ps(ra, rb));
+    real = _mm_sub_ps(real, _mm_mul_ps(ia, ib));
+    _mm_store_ps(&re[i], real);
+    imag = _mm_add_ps(imag, _mm_mul_ps(ra, ib));
+    imag = _mm_add_ps(imag, _mm_mul_ps(ia, rb));
+    _mm_store_ps(&im[i], imag);
+  }
+#elif defined(FFTCONVOLVER_USE_NEON)
+  end4 = 4 * (len / 4);
+  for (size_t i=0; i<end4; i+=4)
+  {
+    const float32x4_t ra = vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(&reA[i])));
+    const float32x4_t ia = vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(&imA[i])));
+    const float32x4_t rb = vld1q_f32(&reB[i]);
+    const float32x4_t ib = vld1q_f32(&imB[i]);
+    float32x4_t real = vld1q_f32(&re[i]);
+    float32x4_t imag = vld1q_f32(&im[i]);
+    real = vmlaq_f32(real, ra, rb);
+    real = vmlsq_f32(real, ia, ib);
+    vst1q_f32(&re[i], real);
+    imag = vmlaq_f32(imag, ra, ib);
+    imag = vmlaq_f32(imag, ia, rb);
+    vst1q_f32(&im[i], imag);
+  }
+#endif
+  for (size_t i=end4; i<len; ++i)
+  {
+    const Sample ra = HalfToFloat(reA[i]);
+    const Sample ia = HalfToFloat(imA[i]);
+    re[i] += ra * reB[i] - ia * imB[i];
+    im[i] += ra * imB[i] + ia * reB[i];
+  }
+}
+
+
+static void ComplexMultiplyAccumulateBFloat16(Sample* FFTCONVOLVER_RESTRICT re,
+                                              Sample* FFTCONVOLVER_RESTRICT im,
+                                              const uint16_t* FFTCONVOLVER_RESTRICT reA,
+                                              const uint16_t* FFTCONVOLVER_RESTRICT imA,
+                                              const Sample* FFTCONVOLVER_RESTRICT reB,
+                                              const Sample* FFTCONVOLVER_RESTRICT imB,
+                                              const size_t len)
+{
+  size_t end4 = 0;
+#if defined(FFTCONVOLVER_USE_SSE) && defined(__SSE2__)
+  // Widening is interleaving zeros below each value
+  const __m128i zero = _mm_setzero_si128();
+  end4 = 4 * (len / 4);
+  for (size_t i=0; i<end4; i+=4)
+  {
+    const __m128 ra = _mm_castsi128_ps(_mm_unpacklo_epi16(zero, _mm_loadl_epi64(reinterpret_cast<const __m128i*>(&reA[i]))));
+    const __m128 ia = _mm_castsi128_ps(_mm_unpacklo_epi16(zero, _mm_loadl_epi64(reinterpret_cast<const __m128i*>(&imA[i]))));
+    const __m128 rb = _mm_load_ps(&reB[i]);
+    const __m128 ib = _mm_load_ps(&imB[i]);
+    __m128 real = _mm_load_ps(&re[i]);
+    __m128 imag = _mm_load_ps(&im[i]);
+    real = _mm_add_ps(real, _mm_mul_ps(ra, rb));
+    real = _mm_sub_ps(real, _mm_mul_ps(ia, ib));
+    _mm_store_ps(&re[i], real);
+    imag = _mm_add_ps(imag, _mm_mul_ps(ra, ib));
+    imag = _mm_add_ps(imag, _mm_mul_ps(ia, rb));
+    _mm_store_ps(&im[i], imag);
+  }
+#elif defined(FFTCONVOLVER_USE_NEON)
+  end4 = 4 * (len / 4);
+  for (size_t i=0; i<end4; i+=4)
+  {
+    const float32x4_t ra = vreinterpretq_f32_u32(vshll_n_u16(vld1_u16(&reA[i]), 16));
+    const float32x4_t ia = vreinterpretq_f32_u32(vshll_n_u16(vld1_u16(&imA[i]), 16));
+    const float32x4_t rb = vld1q_f32(&reB[i]);
+    const float32x4_t ib = vld1q_f32(&imB[i]);
+    float32x4_t real = vld1q_f32(&re[i]);
+    float32x4_t imag = vld1q_f32(&im[i]);
+    real = vmlaq_f32(real, ra, rb);
+    real = vmlsq_f32(real, ia, ib);
+    vst1q_f32(&re[i], real);
+    imag = vmlaq_f32(imag, ra, ib);
+    imag = vmlaq_f32(imag, ia, rb);
+    vst1q_f32(&im[i], imag);
+  }
+#endif
+  for (size_t i=end4; i<len; ++i)
+  {
+    const Sample ra = BFloat16ToFloat(reA[i]);
+    const Sample ia = BFloat16ToFloat(imA[i]);
+    re[i] += ra * reB[i] - ia * imB[i];
+    im[i] += ra * imB[i] + ia * reB[i];
+  }
+}
+
+
+void ComplexMultiplyAccumulate(SplitComplex& result, const CompactSplitComplex& a, const SplitComplex& b)
+{
+  assert(result.size() == a.size());
+  assert(result.size() == b.size());
+  if (a.precision() == SpectrumBFloat16)
+  {
+    ComplexMultiplyAccumulateBFloat16(result.re(), result.im(), a.re(), a.im(), b.re(), b.im(), result.size());
+  }
+  else
+  {
+    ComplexMultiplyAccumulateHalf(result.re(), result.im(), a.re(), a.im(), b.re(), b.im(), result.size());
+  }
+}
+
+
+double SpectrumPrecisionError(const SplitComplex& spectrum, SpectrumPrecision precision)
+{
+  if (precision == SpectrumFloat32)
+  {
+    return 0.0;
+  }
+  double error = 0.0;
+  double energy = 0.0;
+  for (size_t i=0; i<spectrum.size(); ++i)
+  {
+    const double re = spectrum.re()[i];
+    const double im = spectrum.im()[i];
+    const double dRe = re - Widen(Compact(spectrum.re()[i], precision), precision);
+    const double dIm = im - Widen(Compact(spectrum.im()[i], precision), precision);
+    error += dRe * dRe + dIm * dIm;
+    energy += re * re + im * im;
+  }
+  return (energy > 0.0) ? error / energy : 0.0;
+}
+
 } // End of namespace fftconvolver
@@ -23,11 +23,9 @@
 #include <cstddef>
 #include <cstring>
 #include <new>
+#include <stdint.h>
 
 
-namespace fftconvolver
-{
-
 #if defined(__SSE__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
   #if !defined(FFTCONVOLVER_USE_SSE) && !defined(FFTCONVOLVER_DONT_USE_SSE)
     #define FFTCONVOLVER_USE_SSE
@@ -40,6 +38,10 @@ namespace fftconvolver
 #endif
 
 
+namespace fftconvolver
+{
+
+
 #if defined(__GNUC__)
   #define FFTCONVOLVER_RESTRICT __restrict__
 #else
@@ -275,6 +277,86 @@ private:
 };
 
 
+/**
+* @brief Storage formats for filter spectra
+*
+* The 16-bit formats halve the memory (and the memory traffic) of a spectrum.
+* Float16 keeps 11 significant bits over a range of about 6e-8 to 65504, BFloat16
+* keeps the float range but only 8 significant bits.
+* Float16 is widened with NEON on ARM64 and F16C on x86 (when compiled with it);
+* anywhere else it is widened in scalar code, which is several times slower than
+* float32. BFloat16 widens with a shift on any target.
+*/
+enum SpectrumPrecision
+{
+  SpectrumFloat32 = 0,
+  SpectrumFloat16 = 1,
+  SpectrumBFloat16 = 2
+};
+
+
+/**
+* @class CompactSplitComplex
+* @brief Split-complex buffer stored with 16 bits per value, for spectra that are
+*        written once and then only read (impulse response segments)
+*/
+class CompactSplitComplex
+{
+public:
+  CompactSplitComplex() :
+    _size(0),
+    _precision(SpectrumFloat16),
+    _re(),
+    _im()
+  {
+  }
+
+  /**
+  * @brief Stores a spectrum, rounded to the nearest value of the format
+  * @param spectrum The spectrum
+  * @param precision SpectrumFloat16 or SpectrumBFloat16
+  */
+  void assign(const SplitComplex& spectrum, SpectrumPrecision precision);
+
+  void clear()
+  {
+    _re.clear();
+    _im.clear();
+    _size = 0;
+  }
+
+  const uint16_t* re() const
+  {
+    return _re.data();
+  }
+
+  const uint16_t* im() const
+  {
+    return _im.data();
+  }
+
+  size_t size() const
+  {
+    return _size;
+  }
+
+  SpectrumPrecision precision() const
+  {
+    return _precision;
+  }
+
+private:
+  size_t _size;
+  SpectrumPrecision _precision;
+  Buffer<uint16_t> _re;
+  Buffer<uint16_t> _im;
+
+  // Prevent uncontrolled usage
+  CompactSplitComplex(const CompactSplitComplex&);
+  CompactSplitComplex& operator=(const CompactSplitComplex&);
+};
+
+
 /**
 * @brief Returns the next power of 2 of a given number
 * @param val The number
@@ -345,6 +427,25 @@ void ComplexMultiplyAccumulate(Sample* FFTCONVOLVER_RESTRICT re,
                                const Sample* FFTCONVOLVER_RESTRICT reB,
                                const Sample* FFTCONVOLVER_RESTRICT imB,
                                const size_t len);
+
+
+/**
+* @brief Adds the complex product of a 16-bit and a float split-complex buffer to a
+*        result buffer. The 16-bit values are widened to float in registers.
+* @param result The result buffer
+* @param a The 1st factor of the complex product (usually the filter)
+* @param b The 2nd factor of the complex product
+*/
+void ComplexMultiplyAccumulate(SplitComplex& result, const CompactSplitComplex& a, const SplitComplex& b);
+
+
+/**
+* @brief Returns the error of storing a spectrum in a format, as the energy of the
+*        rounding error relative to the energy of the spectrum
+* @param spectrum The spectrum
+* @param precision The storage format
+*/
+double SpectrumPrecisionError(const SplitComplex& spectrum, SpectrumPrecision precision);
   
 } // End of namespace fftconvolver
 
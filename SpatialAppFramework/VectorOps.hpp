@@ -0,0 +1,134 @@
+//
+//  VectorOps.hpp
+//  Capstone
+//
+
+#ifndef VectorOps_hpp
+#define VectorOps_hpp
+
+/*
+	Small block helpers used by the bus renderers, the delay lines and the resampler.
+	Four samples at a time with NEON on device and SSE in the simulator, plain loops otherwise.
+	None of them need aligned pointers.
+ */
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+    #include <arm_neon.h>
+    #define VECTOROPS_USE_NEON
+#elif defined(__SSE__)
+    #include <xmmintrin.h>
+    #define VECTOROPS_USE_SSE
+#endif
+
+// out[i] += gain * in[i]
+static inline void vectorMultiplyAccumulate(float* out, const float* in, float gain, int numSamples) {
+    int i = 0;
+#if defined(VECTOROPS_USE_NEON)
+    float32x4_t g = vdupq_n_f32(gain);
+    for(; i + 4 <= numSamples; i += 4)
+        vst1q_f32(out + i, vmlaq_f32(vld1q_f32(out + i), vld1q_f32(in + i), g));
+#elif defined(VECTOROPS_USE_SSE)
+    __m128 g = _mm_set1_ps(gain);
+    for(; i + 4 <= numSamples; i += 4)
+        _mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), _mm_mul_ps(_mm_loadu_ps(in + i), g)));
+#endif
+    for(; i < numSamples; i++)
+        out[i] += gain * in[i];
+}
+
+// out[i] += (gain + step*i) * in[i], a linear gain ramp across the block
+static inline void vectorRampedMultiplyAccumulate(float* out, const float* in, float gain, float step, int numSamples) {
+    int i = 0;
+#if defined(VECTOROPS_USE_NEON)
+    float32x4_t g = {gain, gain + step, gain + 2*step, gain + 3*step};
+    float32x4_t s = vdupq_n_f32(4*step);
+    for(; i + 4 <= numSamples; i += 4) {
+        vst1q_f32(out + i, vmlaq_f32(vld1q_f32(out + i), vld1q_f32(in + i), g));
+        g = vaddq_f32(g, s);
+    }
+#elif defined(VECTOROPS_USE_SSE)
+    __m128 g = _mm_setr_ps(gain, gain + step, gain + 2*step, gain + 3*step);
+    __m128 s = _mm_set1_ps(4*step);
+    for(; i + 4 <= numSamples; i += 4) {
+        _mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), _mm_mul_ps(_mm_loadu_ps(in + i), g)));
+        g = _mm_add_ps(g, s);
+    }
+#endif
+    for(; i < numSamples; i++)
+        out[i] += (gain + step*i) * in[i];
+}
+
+// out[i] = a[i] + frac * (b[i] - a[i]), a fixed-fraction linear interpolation between two runs
+static inline void vectorLerp(float* out, const float* a, const float* b, float frac, int numSamples) {
+    int i = 0;
+#if defined(VECTOROPS_USE_NEON)
+    float32x4_t f = vdupq_n_f32(frac);
+    for(; i + 4 <= numSamples; i += 4) {
+        float32x4_t va = vld1q_f32(a + i);
+        vst1q_f32(out + i, vmlaq_f32(va, vsubq_f32(vld1q_f32(b + i), va), f));
+    }
+#elif defined(VECTOROPS_USE_SSE)
+    __m128 f = _mm_set1_ps(frac);
+    for(; i + 4 <= numSamples; i += 4) {
+        __m128 va = _mm_loadu_ps(a + i);
+        _mm_storeu_ps(out + i, _mm_add_ps(va, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(b + i), va), f)));
+    }
+#endif
+    for(; i < numSamples; i++)
+        out[i] = a[i] + frac * (b[i] - a[i]);
+}
+
+// a[i], b[i] = a[i] + b[i], a[i] - b[i], one butterfly of a Walsh-Hadamard transform
+static inline void vectorButterfly(float* a, float* b, int numSamples) {
+    int i = 0;
+#if defined(VECTOROPS_USE_NEON)
+    for(; i + 4 <= numSamples; i += 4) {
+        float32x4_t va = vld1q_f32(a + i);
+        float32x4_t vb = vld1q_f32(b + i);
+        vst1q_f32(a + i, vaddq_f32(va, vb));
+        vst1q_f32(b + i, vsubq_f32(va, vb));
+    }
+#elif defined(VECTOROPS_USE_SSE)
+    for(; i + 4 <= numSamples; i += 4) {
+        __m128 va = _mm_loadu_ps(a + i);
+        __m128 vb = _mm_loadu_ps(b + i);
+        _mm_storeu_ps(a + i, _mm_add_ps(va, vb));
+        _mm_storeu_ps(b + i, _mm_sub_ps(va, vb));
+    }
+#endif
+    for(; i < numSamples; i++) {
+        float sum = a[i] + b[i];
+        b[i] = a[i] - b[i];
+        a[i] = sum;
+    }
+}
+
+// sum of a[i] * b[i]
+static inline float vectorDotProduct(const float* a, const float* b, int numSamples) {
+    int i = 0;
+    float sum = 0.0f;
+#if defined(VECTOROPS_USE_NEON)
+    float32x4_t acc = vdupq_n_f32(0.0f);
+    for(; i + 4 <= numSamples; i += 4)
+        acc = vmlaq_f32(acc, vld1q_f32(a + i), vld1q_f32(b + i));
+    float32x2_t half = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+    sum = vget_lane_f32(vpadd_f32(half, half), 0);
+#elif defined(VECTOROPS_USE_SSE)
+    __m128 acc = _mm_setzero_ps();
+    for(; i + 4 <= numSamples; i += 4)
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    float lanes[4];
+    _mm_storeu_ps(lanes, acc);
+    sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#endif
+    for(; i < numSamples; i++)
+        sum += a[i] * b[i];
+    return sum;
+}
+
+// out[i] += in[i]
+static inline void vectorAdd(float* out, const float* in, int numSamples) {
+    vectorMultiplyAccumulate(out, in, 1.0f, numSamples);
+}
+
+#endif /* VectorOps_hpp */
@@ -0,0 +1,230 @@
+//
+//  VirtualSpeakerRenderer.hpp
+//  Capstone
+//
+
+#ifndef VirtualSpeakerRenderer_hpp
+#define VirtualSpeakerRenderer_hpp
+
+#include "HRTFBank.hpp"
+#include "SpatialSource.hpp"
+#include "VectorOps.hpp"
+#include <vector>
+#include <algorithm>
+#include <cstring>
+
+#define MIN_VIRTUAL_SPEAKERS 8
+#define MAX_VIRTUAL_SPEAKERS 24
+
+/*
+	VirtualSpeakerRenderer
+	Pans every source onto a fixed layout of virtual loudspeakers with VBAP gains and convolves
+	only the speakers. Moving a source changes three gains, never a filter, so per-source cost
+	is a handful of multiplies per sample.
+	The layout is picked from the measured grid: half the speakers on the horizontal rail, a
+	quarter on the +45° rail and a quarter on the -45° rail, offset by half a step. The speaker
+	filters are the bank's own spectra, so they cost no memory per instance; their rails stay
+	pinned in the bank while the renderer is set up.
+ */
+class VirtualSpeakerRenderer {
+public:
+
+    VirtualSpeakerRenderer() {
+        m_pBank = NULL;
+        m_nSpeakers = 0;
+        m_nBlockSize = 0;
+        m_nMaxSources = 0;
+    }
+
+    ~VirtualSpeakerRenderer() {
+        release();
+    }
+
+    // Picks and triangulates the layout, points the speakers at their HRIRs. Not real-time safe.
+    // blockSize has to be the bank's.
+    void init(const HRTFBank& bank, int numSpeakers, int blockSize, int maxSources) {
+        const HRIRGrid& grid = bank.grid();
+        m_nBlockSize = blockSize;
+        m_nMaxSources = maxSources;
+
+        chooseLayout(grid, clampSpeakerCount(numSpeakers));
+        pinRails(bank);
+
+        m_pSpeakerBus.assign(m_nSpeakers * m_nBlockSize, 0.0f);
+        m_pScratch.assign(m_nBlockSize, 0.0f);
+        m_pSourceGains.assign(m_nMaxSources * MAX_VIRTUAL_SPEAKERS, 0.0f);
+        m_pSourceStarted.assign(m_nMaxSources, false);
+
+        for(int s = 0; s < MAX_VIRTUAL_SPEAKERS; s++) {
+            if(s < m_nSpeakers) {
+                int position = m_pSpeakerPositions[s];
+                m_pSpeaker_L[s].init(m_nBlockSize, bank.leftSpectra(position), grid.irLength());
+                m_pSpeaker_R[s].init(m_nBlockSize, bank.rightSpectra(position), grid.irLength());
+            }
+            else {
+                m_pSpeaker_L[s].reset();
+                m_pSpeaker_R[s].reset();
+            }
+        }
+    }
+
+    int speakers() const { return m_nSpeakers; }
+
+    // Lets go of the bank's rails, before the bank goes away. init() has to be called again
+    // before the next process().
+    void release() {
+        for(size_t r = 0; r < m_pPinnedRails.size(); r++)
+            m_pBank->unpinRail(m_pPinnedRails[r]);
+        m_pPinnedRails.clear();
+    }
+
+    static int clampSpeakerCount(int numSpeakers) {
+        return std::min(std::max(numSpeakers, MIN_VIRTUAL_SPEAKERS), MAX_VIRTUAL_SPEAKERS);
+    }
+
+    void process(const SpatialSource* pSources, int numSources, float* pOutLeft, float* pOutRight, int numSamples) {
+        memset(&m_pSpeakerBus[0], 0, sizeof(float)*m_pSpeakerBus.size());
+        for(int s = 0; s < numSources && s < m_nMaxSources; s++)
+            pan(pSources[s], s, numSamples);
+
+        memset(pOutLeft, 0, sizeof(float)*numSamples);
+        memset(pOutRight, 0, sizeof(float)*numSamples);
+        for(int s = 0; s < m_nSpeakers; s++) {
+            const float* pSpeaker = &m_pSpeakerBus[s * m_nBlockSize];
+            m_pSpeaker_L[s].process(pSpeaker, &m_pScratch[0], numSamples);
+            vectorAdd(pOutLeft, &m_pScratch[0], numSamples);
+            m_pSpeaker_R[s].process(pSpeaker, &m_pScratch[0], numSamples);
+            vectorAdd(pOutRight, &m_pScratch[0], numSamples);
+        }
+    }
+
+    // Power-normalised VBAP gains for one direction, one per speaker
+    void computeGains(float azimuth, float elevation, float* pGains) {
+        memset(pGains, 0, sizeof(float)*m_nSpeakers);
+        int vertices[3];
+        float gains[3];
+        m_SpeakerGrid.locate(azimuth, elevation, vertices, gains);
+
+        for(int k = 0; k < 3; k++) {
+            if(!m_SpeakerGrid.isPhantom(vertices[k])) {
+                pGains[vertices[k]] += gains[k];
+            }
+            else {
+                // imaginary pole speaker, hand its gain to the ring around it
+                const std::vector<int>& ring = m_SpeakerGrid.phantomNeighbours(vertices[k]);
+                for(size_t n = 0; n < ring.size(); n++)
+                    pGains[ring[n]] += gains[k] / float(ring.size());
+            }
+        }
+
+        float power = 0.0f;
+        for(int s = 0; s < m_nSpeakers; s++)
+            power += pGains[s]*pGains[s];
+        if(power > 0.0f) {
+            float norm = 1.0f / sqrtf(power);
+            for(int s = 0; s < m_nSpeakers; s++)
+                pGains[s] *= norm;
+        }
+    }
+
+private:
+
+    void pan(const SpatialSource& source, int sourceIndex, int numSamples) {
+        float targetGains[MAX_VIRTUAL_SPEAKERS];
+        computeGains(source.fAzimuth, source.fElevation, targetGains);
+
+        float* pGains = &m_pSourceGains[sourceIndex * MAX_VIRTUAL_SPEAKERS];
+        if(!m_pSourceStarted[sourceIndex]) {
+            memcpy(pGains, targetGains, sizeof(float)*m_nSpeakers);
+            m_pSourceStarted[sourceIndex] = true;
+        }
+
+        for(int i = 0; i < numSamples; i++)
+            m_pScratch[i] = source.fGain * source.pInput[i];
+
+        // only the speakers this source is (or was) feeding
+        float inverseLength = 1.0f / float(numSamples);
+        for(int s = 0; s < m_nSpeakers; s++) {
+            if(pGains[s] == 0.0f && targetGains[s] == 0.0f)
+                continue;
+            float step = (targetGains[s] - pGains[s]) * inverseLength;
+            vectorRampedMultiplyAccumulate(&m_pSpeakerBus[s * m_nBlockSize], &m_pScratch[0], pGains[s], step, numSamples);
+            pGains[s] = targetGains[s];
+        }
+    }
+
+    // The layout's rails, once each, prepared first if need be
+    void pinRails(const HRTFBank& bank) {
+        release();
+        m_pBank = &bank;
+        for(int s = 0; s < m_nSpeakers; s++) {
+            int rail = HRTFBank::railOf(m_pSpeakerPositions[s]);
+            if(std::find(m_pPinnedRails.begin(), m_pPinnedRails.end(), rail) == m_pPinnedRails.end()) {
+                bank.pinRail(rail);
+                m_pPinnedRails.push_back(rail);
+            }
+        }
+    }
+
+    void chooseLayout(const HRIRGrid& grid, int numSpeakers) {
+        int horizontal = numSpeakers / 2;
+        int upper = (numSpeakers - horizontal) / 2;
+        int lower = numSpeakers - horizontal - upper;
+
+        m_pSpeakerPositions.clear();
+        addRing(grid, 0.0f, horizontal, 0.0f);
+        addRing(grid, 45.0f, upper, 0.0f);
+        addRing(grid, -45.0f, lower, 180.0f / lower);
+        m_nSpeakers = (int)m_pSpeakerPositions.size();
+
+        // triangulated with imaginary speakers at the poles
+        std::vector<float> azimuths, elevations;
+        for(int s = 0; s < m_nSpeakers; s++) {
+            azimuths.push_back(grid.azimuth(m_pSpeakerPositions[s]));
+            elevations.push_back(grid.elevation(m_pSpeakerPositions[s]));
+        }
+        m_SpeakerGrid.build(azimuths, elevations);
+    }
+
+    // Nearest measured position on the rail at each evenly spaced azimuth
+    void addRing(const HRIRGrid& grid, float elevation, int count, float offset) {
+        for(int k = 0; k < count; k++) {
+            float target = offset + 360.0f * k / count;
+            int bestIndex = -1;
+            float bestDistance = 1e9f;
+            for(int d = 0; d < grid.size(); d++) {
+                if(fabsf(grid.elevation(d) - elevation) > 0.5f)
+                    continue;
+                float distance = fabsf(fmodf(grid.azimuth(d) - target + 540.0f, 360.0f) - 180.0f);
+                if(distance < bestDistance) {
+                    bestDistance = distance;
+                    bestIndex = d;
+                }
+            }
+            if(bestIndex >= 0)
+                m_pSpeakerPositions.push_back(bestIndex);
+        }
+    }
+
+    const HRTFBank* m_pBank;
+    int m_nSpeakers;
+    int m_nBlockSize;
+    int m_nMaxSources;
+
+    // grid index of every speaker, and their triangulation
+    std::vector<int> m_pSpeakerPositions;
+    SphericalGrid m_SpeakerGrid;
+    std::vector<int> m_pPinnedRails;
+
+    // speaker-major bus, m_nSpeakers * m_nBlockSize
+    std::vector<float> m_pSpeakerBus;
+    std::vector<float> m_pScratch;
+
+    std::vector<float> m_pSourceGains;
+    std::vector<bool> m_pSourceStarted;
+
+    fftconvolver::SwitchingConvolver m_pSpeaker_L[MAX_VIRTUAL_SPEAKERS];
+    fftconvolver::SwitchingConvolver m_pSpeaker_R[MAX_VIRTUAL_SPEAKERS];
+};
+
+#endif /* VirtualSpeakerRenderer_hpp */